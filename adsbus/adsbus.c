@@ -1,22 +1,34 @@
 #include <stdlib.h>
 
+#include "aircraft.h"
+#include "batch.h"
 #include "beast.h"
+#include "capture.h"
+#include "cpr.h"
+#include "crc.h"
+#include "dedup.h"
 #include "exec.h"
 #include "file.h"
 #include "hex.h"
+#include "http.h"
 #include "incoming.h"
 #include "json.h"
 #include "log.h"
+#include "metrics.h"
 #include "opts.h"
 #include "outgoing.h"
 #include "peer.h"
+#include "profile.h"
 #include "proto.h"
 #include "rand.h"
 #include "receive.h"
+#include "reorder.h"
 #include "resolve.h"
 #include "send.h"
 #include "send_receive.h"
 #include "server.h"
+#include "sort.h"
+#include "sourcestats.h"
 #include "stats.h"
 #include "stdinout.h"
 #include "wakeup.h"
@@ -25,10 +37,21 @@ static void adsbus_opts_add() {
 	// This order controls the order in --help, but nothing else.
 	server_opts_add();
 	log_opts_add();
+	resolve_opts_add();
 	outgoing_opts_add();
 	incoming_opts_add();
 	exec_opts_add();
 	file_opts_add();
+	capture_opts_add();
+	crc_opts_add();
+	cpr_opts_add();
+	reorder_opts_add();
+	dedup_opts_add();
+	sort_opts_add();
+	stats_opts_add();
+	sourcestats_opts_add();
+	profile_opts_add();
+	batch_opts_add();
 	stdinout_opts_add();
 }
 
@@ -45,40 +68,62 @@ int main(int argc, char *argv[]) {
 	log_init();
 	server_init();
 
-	resolve_init();
-	wakeup_init();
 	peer_init();
+	wakeup_init();
+	resolve_init();
 
 	log_init_peer();
+	profile_init();
+	http_init();
 
 	receive_init();
 	send_init();
+	capture_init();
+	crc_init();
+	cpr_init();
+	sort_init();
+	reorder_init();
+	dedup_init();
 
 	beast_init();
 	json_init();
 	proto_init();
 	stats_init();
+	sourcestats_init();
 
 	outgoing_init();
 	incoming_init();
 	exec_init();
 	file_init();
+	batch_init();
 	stdinout_init();
 
 	peer_loop();
 
+	profile_cleanup();
 	resolve_cleanup();
 
 	receive_cleanup();
+	reorder_cleanup();
+	sort_cleanup();
+	dedup_cleanup();
 	send_cleanup();
+	crc_cleanup();
+	cpr_cleanup();
+	aircraft_cleanup();
+	http_cleanup();
 	send_receive_cleanup();
 	incoming_cleanup();
 	outgoing_cleanup();
 	exec_cleanup();
 	file_cleanup();
+	batch_cleanup();
 
 	json_cleanup();
 	proto_cleanup();
+	stats_cleanup();
+	metrics_cleanup();
+	sourcestats_cleanup();
 
 	rand_cleanup();
 	wakeup_cleanup();
@@ -0,0 +1,361 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpr.h"
+#include "crc.h"
+#include "http.h"
+#include "icaotable.h"
+#include "monotime.h"
+#include "packet.h"
+#include "uuid.h"
+
+#include "aircraft.h"
+
+// Current state per ICAO address, decoded from DF4/5/11/17/18/20/21, and
+// served as a dump1090-style aircraft.json over plain HTTP. Each aircraft
+// keeps its slow-changing fields (callsign, altitude, squawk, position)
+// serialized, and only re-serializes them when one changes; the snapshot
+// stitches those together with the per-request ages. A snapshot is reused
+// as is until a packet arrives or its ages go stale.
+
+struct aircraft_source {
+	uint8_t id[UUID_LEN];
+	uint32_t rssi;
+	uint64_t seen_ns;
+};
+
+#define AIRCRAFT_SOURCES_MAX 4
+#define AIRCRAFT_CALLSIGN_LEN 8
+
+struct aircraft {
+	uint32_t icao;
+	uint64_t seen_ns;
+	uint64_t position_ns;
+	uint64_t messages;
+	uint32_t rssi;
+	bool have_altitude;
+	int32_t altitude;
+	bool have_squawk;
+	uint16_t squawk;
+	bool have_callsign;
+	char callsign[AIRCRAFT_CALLSIGN_LEN + 1];
+	bool have_position;
+	double lat;
+	double lon;
+	struct aircraft_source sources[AIRCRAFT_SOURCES_MAX];
+	// Serialized fields above; NULL when stale
+	char *json;
+	size_t json_len;
+};
+
+#define AIRCRAFT_TABLE_SIZE_MIN 1024
+// Aircraft not heard from for this long are left out and then forgotten
+#define AIRCRAFT_EXPIRE_NS (300 * NS_PER_S)
+// Ages in the snapshot are rounded to this
+#define AIRCRAFT_SNAPSHOT_NS (100 * NS_PER_MS)
+
+static const char aircraft_charset[] = "#ABCDEFGHIJKLMNOPQRSTUVWXYZ##### ###############0123456789######";
+
+static void aircraft_drop(void *);
+
+static bool aircraft_enabled = false;
+static struct icaotable aircraft_table = ICAOTABLE_INIT(struct aircraft, AIRCRAFT_TABLE_SIZE_MIN, AIRCRAFT_EXPIRE_NS, aircraft_drop);
+static uint64_t aircraft_messages = 0;
+// Bumped on every change; the snapshot is rebuilt when it moves
+static uint64_t aircraft_generation = 1;
+static struct http_str aircraft_snapshot = { 0 };
+static uint64_t aircraft_snapshot_generation = 0, aircraft_snapshot_tick = 0;
+
+static double aircraft_dbfs(uint32_t rssi) {
+	// rssi is a scaled signal amplitude
+	return 20 * log10((double) rssi / PACKET_RSSI_MAX);
+}
+
+static double aircraft_age(uint64_t now, uint64_t then) {
+	return (double) ((now - then) / AIRCRAFT_SNAPSHOT_NS) * ((double) AIRCRAFT_SNAPSHOT_NS / NS_PER_S);
+}
+
+static bool aircraft_live(const struct aircraft *aircraft, uint64_t now) {
+	return now - aircraft->seen_ns < AIRCRAFT_EXPIRE_NS;
+}
+
+static void aircraft_drop(void *entry) {
+	free(((struct aircraft *) entry)->json);
+}
+
+static bool aircraft_altitude(uint32_t code, bool ac13, int32_t *altitude) {
+	// Only 25ft increments; Gillham-coded and metric altitudes are skipped
+	uint32_t n;
+	if (ac13) {
+		if (code & 0x40 || !(code & 0x10)) {
+			return false;
+		}
+		n = ((code & 0x1f80) >> 2) | ((code & 0x20) >> 1) | (code & 0xf);
+	} else {
+		if (!(code & 0x10)) {
+			return false;
+		}
+		n = ((code & 0xfe0) >> 1) | (code & 0xf);
+	}
+	if (!n) {
+		return false;
+	}
+	*altitude = (int32_t) n * 25 - 1000;
+	return true;
+}
+
+static uint16_t aircraft_squawk(uint32_t id13) {
+	// C1 A1 C2 A2 C4 A4 X B1 D1 B2 D2 B4 D4, returned as 0xABCD
+	uint16_t a = (uint16_t) (((id13 >> 11) & 1) | ((id13 >> 8) & 2) | ((id13 >> 5) & 4));
+	uint16_t b = (uint16_t) (((id13 >> 5) & 1) | ((id13 >> 2) & 2) | ((id13 << 1) & 4));
+	uint16_t c = (uint16_t) (((id13 >> 12) & 1) | ((id13 >> 9) & 2) | ((id13 >> 6) & 4));
+	uint16_t d = (uint16_t) (((id13 >> 4) & 1) | ((id13 >> 1) & 2) | ((id13 << 2) & 4));
+	return (uint16_t) (a << 12 | b << 8 | c << 4 | d);
+}
+
+static bool aircraft_callsign(const uint8_t *me, char *callsign) {
+	uint64_t bits = 0;
+	for (int i = 0; i < 6; i++) {
+		bits = bits << 8 | me[i];
+	}
+	for (int i = 0; i < AIRCRAFT_CALLSIGN_LEN; i++) {
+		char c = aircraft_charset[(bits >> (42 - 6 * i)) & 0x3f];
+		if (c == '#') {
+			return false;
+		}
+		callsign[i] = c;
+	}
+	callsign[AIRCRAFT_CALLSIGN_LEN] = '\0';
+	return true;
+}
+
+static void aircraft_source_update(struct aircraft *aircraft, const struct packet *packet, uint64_t now) {
+	if (!packet->rssi) {
+		return;
+	}
+	aircraft->rssi = packet->rssi;
+	if (!packet->source_id) {
+		return;
+	}
+	struct aircraft_source *slot = &aircraft->sources[0];
+	for (size_t i = 0; i < AIRCRAFT_SOURCES_MAX; i++) {
+		struct aircraft_source *source = &aircraft->sources[i];
+		if (!strncmp((const char *) source->id, (const char *) packet->source_id, UUID_LEN)) {
+			slot = source;
+			break;
+		}
+		if (source->seen_ns < slot->seen_ns) {
+			// Empty or least recently heard
+			slot = source;
+		}
+	}
+	strncpy((char *) slot->id, (const char *) packet->source_id, UUID_LEN - 1);
+	slot->id[UUID_LEN - 1] = '\0';
+	slot->rssi = packet->rssi;
+	slot->seen_ns = now;
+}
+
+static void aircraft_serialize(struct aircraft *aircraft) {
+	struct http_str str = { 0 };
+	http_str_printf(&str, "{\"hex\":\"%06x\"", aircraft->icao);
+	if (aircraft->have_callsign) {
+		http_str_printf(&str, ",\"flight\":\"%s\"", aircraft->callsign);
+	}
+	if (aircraft->have_altitude) {
+		http_str_printf(&str, ",\"alt_baro\":%d", aircraft->altitude);
+	}
+	if (aircraft->have_squawk) {
+		http_str_printf(&str, ",\"squawk\":\"%04x\"", aircraft->squawk);
+	}
+	if (aircraft->have_position) {
+		http_str_printf(&str, ",\"lat\":%.6f,\"lon\":%.6f", aircraft->lat, aircraft->lon);
+	}
+	aircraft->json = str.data;
+	aircraft->json_len = str.length;
+}
+
+static void aircraft_build_snapshot(uint64_t now) {
+	struct timespec wall;
+	assert(!clock_gettime(CLOCK_REALTIME, &wall));
+
+	struct http_str *str = &aircraft_snapshot;
+	str->length = 0;
+	http_str_printf(str, "{\"now\":%.1f,\"messages\":%ju,\"aircraft\":[", (double) wall.tv_sec + (double) (wall.tv_nsec / 100000000) / 10, (uintmax_t) aircraft_messages);
+	bool first = true;
+	struct aircraft *aircraft;
+	size_t iter = 0;
+	while ((aircraft = icaotable_next(&aircraft_table, &iter))) {
+		if (!aircraft_live(aircraft, now)) {
+			continue;
+		}
+		if (!aircraft->json) {
+			aircraft_serialize(aircraft);
+		}
+		if (!first) {
+			http_str_append(str, ",", 1);
+		}
+		first = false;
+		http_str_append(str, aircraft->json, aircraft->json_len);
+		if (aircraft->have_position) {
+			http_str_printf(str, ",\"seen_pos\":%.1f", aircraft_age(now, aircraft->position_ns));
+		}
+		http_str_printf(str, ",\"messages\":%ju,\"seen\":%.1f", (uintmax_t) aircraft->messages, aircraft_age(now, aircraft->seen_ns));
+		if (aircraft->rssi) {
+			http_str_printf(str, ",\"rssi\":%.1f", aircraft_dbfs(aircraft->rssi));
+		}
+		http_str_append(str, ",\"sources\":[", 12);
+		bool first_source = true;
+		for (size_t j = 0; j < AIRCRAFT_SOURCES_MAX; j++) {
+			struct aircraft_source *source = &aircraft->sources[j];
+			if (!source->seen_ns) {
+				continue;
+			}
+			http_str_printf(str, "%s{\"id\":\"%s\",\"rssi\":%.1f,\"seen\":%.1f}", first_source ? "" : ",", source->id, aircraft_dbfs(source->rssi), aircraft_age(now, source->seen_ns));
+			first_source = false;
+		}
+		http_str_append(str, "]}", 2);
+	}
+	http_str_append(str, "]}\n", 3);
+}
+
+static void aircraft_get_snapshot(const char **data, size_t *len) {
+	uint64_t now = monotime_coarse_ns();
+	uint64_t tick = now / AIRCRAFT_SNAPSHOT_NS;
+	if (aircraft_snapshot_generation != aircraft_generation || aircraft_snapshot_tick != tick) {
+		aircraft_build_snapshot(now);
+		aircraft_snapshot_generation = aircraft_generation;
+		aircraft_snapshot_tick = tick;
+	}
+	*data = aircraft_snapshot.data;
+	*len = aircraft_snapshot.length;
+}
+
+static bool aircraft_http_get(const char *path, const char **body, size_t *len) {
+	if (strcmp(path, "/") && strcmp(path, "/aircraft.json") && strcmp(path, "/data/aircraft.json")) {
+		return false;
+	}
+	aircraft_get_snapshot(body, len);
+	return true;
+}
+
+static struct http_handler _aircraft_http = {
+	.content_type = "application/json",
+	.get = aircraft_http_get,
+};
+struct http_handler *aircraft_http = &_aircraft_http;
+
+void aircraft_cleanup() {
+	icaotable_cleanup(&aircraft_table);
+	free(aircraft_snapshot.data);
+	aircraft_snapshot.data = NULL;
+}
+
+void aircraft_enable() {
+	aircraft_enabled = true;
+	cpr_enable();
+}
+
+void aircraft_update(const struct packet *packet, bool have_position) {
+	if (!aircraft_enabled || packet->type == PACKET_TYPE_MODE_AC || packet->crc_invalid) {
+		return;
+	}
+	const uint8_t *payload = packet->payload;
+	size_t len = packet_payload_len[packet->type];
+	uint8_t df = payload[0] >> 3;
+	uint32_t icao;
+	bool create;
+	switch (df) {
+		case 11:
+			// Low 7 bits may be an interrogator code
+			if (crc_syndrome(payload, len) & ~UINT32_C(0x7f)) {
+				return;
+			}
+			icao = (uint32_t) payload[1] << 16 | (uint32_t) payload[2] << 8 | payload[3];
+			create = true;
+			break;
+
+		case 17:
+		case 18:
+			if (packet->type != PACKET_TYPE_MODE_S_LONG || (df == 18 && (payload[0] & 0x7)) || crc_syndrome(payload, len)) {
+				return;
+			}
+			icao = (uint32_t) payload[1] << 16 | (uint32_t) payload[2] << 8 | payload[3];
+			create = true;
+			break;
+
+		case 4:
+		case 5:
+		case 20:
+		case 21:
+			// Parity is overlaid with the address, so we can only trust
+			// it for aircraft we've already seen
+			icao = crc_syndrome(payload, len);
+			create = false;
+			break;
+
+		default:
+			return;
+	}
+
+	uint64_t now = monotime_coarse_ns();
+	struct aircraft *aircraft = icaotable_get(&aircraft_table, icao, now, create);
+	if (!aircraft || (!create && !aircraft_live(aircraft, now))) {
+		return;
+	}
+	aircraft_messages++;
+	aircraft->messages++;
+	aircraft->seen_ns = now;
+	aircraft_source_update(aircraft, packet, now);
+	aircraft_generation++;
+
+	bool changed = false;
+	if (df == 4 || df == 20) {
+		int32_t altitude;
+		uint32_t ac13 = (uint32_t) (payload[2] & 0x1f) << 8 | payload[3];
+		if (aircraft_altitude(ac13, true, &altitude) && (!aircraft->have_altitude || altitude != aircraft->altitude)) {
+			aircraft->have_altitude = true;
+			aircraft->altitude = altitude;
+			changed = true;
+		}
+	} else if (df == 5 || df == 21) {
+		uint16_t squawk = aircraft_squawk((uint32_t) (payload[2] & 0x1f) << 8 | payload[3]);
+		if (!aircraft->have_squawk || squawk != aircraft->squawk) {
+			aircraft->have_squawk = true;
+			aircraft->squawk = squawk;
+			changed = true;
+		}
+	} else if (df == 17 || df == 18) {
+		uint8_t tc = payload[4] >> 3;
+		char callsign[AIRCRAFT_CALLSIGN_LEN + 1];
+		int32_t altitude;
+		if (tc >= 1 && tc <= 4) {
+			if (aircraft_callsign(&payload[5], callsign) && (!aircraft->have_callsign || strcmp(callsign, aircraft->callsign))) {
+				aircraft->have_callsign = true;
+				memcpy(aircraft->callsign, callsign, sizeof(callsign));
+				changed = true;
+			}
+		} else if (tc >= 9 && tc <= 18) {
+			uint32_t ac12 = (uint32_t) payload[5] << 4 | payload[6] >> 4;
+			if (aircraft_altitude(ac12, false, &altitude) && (!aircraft->have_altitude || altitude != aircraft->altitude)) {
+				aircraft->have_altitude = true;
+				aircraft->altitude = altitude;
+				changed = true;
+			}
+		}
+		double lat, lon;
+		if (have_position && cpr_position(icao, &lat, &lon)) {
+			aircraft->have_position = true;
+			aircraft->lat = lat;
+			aircraft->lon = lon;
+			aircraft->position_ns = now;
+			changed = true;
+		}
+	}
+	if (changed) {
+		free(aircraft->json);
+		aircraft->json = NULL;
+	}
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdbool.h>
+
+struct http_handler;
+struct packet;
+
+void aircraft_cleanup(void);
+void aircraft_enable(void);
+void aircraft_update(const struct packet *, bool);
+extern struct http_handler *aircraft_http;
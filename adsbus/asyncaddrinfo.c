@@ -5,6 +5,7 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -13,7 +14,7 @@
 #include "asyncaddrinfo.h"
 
 struct asyncaddrinfo_resolution {
-	int return_fd;
+	void *passthrough;
 
 	char *node;
 	char *service;
@@ -21,12 +22,21 @@ struct asyncaddrinfo_resolution {
 
 	int err;
 	struct addrinfo *addrs;
+
+	struct asyncaddrinfo_resolution *next;
 };
 
 static size_t asyncaddrinfo_num_threads;
 static pthread_t *asyncaddrinfo_threads = NULL;
 static int asyncaddrinfo_write_fd;
 
+// Completed resolutions, handed back to the main thread. Threads signal
+// additions through a single eventfd.
+static pthread_mutex_t asyncaddrinfo_done_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct asyncaddrinfo_resolution *asyncaddrinfo_done_head = NULL;
+static struct asyncaddrinfo_resolution **asyncaddrinfo_done_tail = &asyncaddrinfo_done_head;
+static int asyncaddrinfo_done_fd = -1;
+
 static void *asyncaddrinfo_main(void *arg) {
 	int fd = (int) (intptr_t) arg;
 
@@ -38,11 +48,15 @@ static void *asyncaddrinfo_main(void *arg) {
 	ssize_t len;
 	while ((len = recv(fd, &res, sizeof(res), 0)) == sizeof(res)) {
 		res->err = getaddrinfo(res->node, res->service, res->hints, &res->addrs);
-		int return_fd = res->return_fd;
-		res->return_fd = -1;
-		assert(send(return_fd, &res, sizeof(res), MSG_EOR) == sizeof(res));
+		res->next = NULL;
+
+		assert(!pthread_mutex_lock(&asyncaddrinfo_done_lock));
+		*asyncaddrinfo_done_tail = res;
+		asyncaddrinfo_done_tail = &res->next;
+		assert(!pthread_mutex_unlock(&asyncaddrinfo_done_lock));
 		// Main thread now owns res
-		assert(!close(return_fd));
+
+		assert(!eventfd_write(asyncaddrinfo_done_fd, 1));
 	}
 	assert(!len);
 	assert(!close(fd));
@@ -63,6 +77,10 @@ static void asyncaddrinfo_del(struct asyncaddrinfo_resolution *res) {
 
 void asyncaddrinfo_init(size_t threads) {
 	assert(!asyncaddrinfo_threads);
+	assert(threads > 0);
+
+	asyncaddrinfo_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(asyncaddrinfo_done_fd >= 0);
 
 	int fds[2];
 	assert(!socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
@@ -89,15 +107,30 @@ void asyncaddrinfo_cleanup() {
 	}
 	free(asyncaddrinfo_threads);
 	asyncaddrinfo_threads = NULL;
+
+	struct asyncaddrinfo_resolution *iter, *next;
+	for (iter = asyncaddrinfo_done_head; iter; iter = next) {
+		next = iter->next;
+		if (!iter->err) {
+			freeaddrinfo(iter->addrs);
+		}
+		asyncaddrinfo_del(iter);
+	}
+	asyncaddrinfo_done_head = NULL;
+	asyncaddrinfo_done_tail = &asyncaddrinfo_done_head;
+
+	assert(!close(asyncaddrinfo_done_fd));
+	asyncaddrinfo_done_fd = -1;
 }
 
-int asyncaddrinfo_resolve(const char *node, const char *service, const struct addrinfo *hints) {
-	int fds[2];
-	assert(!socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+int asyncaddrinfo_fd() {
+	return asyncaddrinfo_done_fd;
+}
 
+void asyncaddrinfo_resolve(const char *node, const char *service, const struct addrinfo *hints, void *passthrough) {
 	struct asyncaddrinfo_resolution *res = malloc(sizeof(*res));
 	assert(res);
-	res->return_fd = fds[1];
+	res->passthrough = passthrough;
 	if (node) {
 		res->node = strdup(node);
 		assert(res->node);
@@ -118,16 +151,25 @@ int asyncaddrinfo_resolve(const char *node, const char *service, const struct ad
 	}
 	assert(send(asyncaddrinfo_write_fd, &res, sizeof(res), MSG_EOR) == sizeof(res));
 	// Resolve thread now owns res
-
-	return fds[0];
 }
 
-int asyncaddrinfo_result(int fd, struct addrinfo **addrs) {
-	struct asyncaddrinfo_resolution *res;
-	assert(recv(fd, &res, sizeof(res), 0) == sizeof(res));
-	assert(!close(fd));
-	*addrs = res->addrs;
-	int err = res->err;
+bool asyncaddrinfo_result(void **passthrough, int *err, struct addrinfo **addrs) {
+	assert(!pthread_mutex_lock(&asyncaddrinfo_done_lock));
+	struct asyncaddrinfo_resolution *res = asyncaddrinfo_done_head;
+	if (res) {
+		asyncaddrinfo_done_head = res->next;
+		if (!asyncaddrinfo_done_head) {
+			asyncaddrinfo_done_tail = &asyncaddrinfo_done_head;
+		}
+	}
+	assert(!pthread_mutex_unlock(&asyncaddrinfo_done_lock));
+
+	if (!res) {
+		return false;
+	}
+	*passthrough = res->passthrough;
+	*err = res->err;
+	*addrs = res->err ? NULL : res->addrs;
 	asyncaddrinfo_del(res);
-	return err;
+	return true;
 }
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 struct addrinfo;
 
 void asyncaddrinfo_init(size_t threads);
 void asyncaddrinfo_cleanup(void);
-int asyncaddrinfo_resolve(const char *node, const char *service, const struct addrinfo *hints);
-int asyncaddrinfo_result(int fd, struct addrinfo **addrs);
+int asyncaddrinfo_fd(void);
+void asyncaddrinfo_resolve(const char *node, const char *service, const struct addrinfo *hints, void *passthrough);
+bool asyncaddrinfo_result(void **passthrough, int *err, struct addrinfo **addrs);
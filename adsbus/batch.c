@@ -0,0 +1,340 @@
+#include <assert.h>
+#include <glob.h>
+#include <libgen.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "log.h"
+#include "monotime.h"
+#include "opts.h"
+#include "peer.h"
+#include "profile.h"
+#include "send.h"
+#include "server.h"
+#include "uuid.h"
+
+#include "batch.h"
+
+// Converts many files in parallel by running one adsbus child per input.
+// Each child has its own event loop and parser state; we only schedule
+// them and add up the results.
+
+struct batch_job {
+	char *input;
+	char *format;
+	off_t size;
+	struct list_head job_list;
+};
+
+struct batch_worker {
+	struct peer peer;
+	uint8_t id[UUID_LEN];
+	pid_t pid;
+	struct batch_job *job;
+	char *output;
+	uint64_t start_ns;
+	struct list_head worker_list;
+};
+
+static struct list_head batch_job_head = LIST_HEAD_INIT(batch_job_head);
+static struct list_head batch_worker_head = LIST_HEAD_INIT(batch_worker_head);
+static opts_group batch_opts;
+
+static char log_module = 'B';
+
+static uint32_t batch_jobs = 0;
+static char *batch_output_dir = NULL;
+static char *batch_suffix = NULL;
+static char **batch_forward = NULL;
+static bool batch_active = false;
+
+static struct {
+	size_t files;
+	size_t failed;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t start_ns;
+} batch_stats;
+
+static void batch_start(void);
+
+static void batch_job_del(struct batch_job *job) {
+	list_del(&job->job_list);
+	free(job->input);
+	free(job->format);
+	free(job);
+}
+
+static void batch_worker_del(struct batch_worker *worker) {
+	peer_close(&worker->peer);
+	list_del(&worker->worker_list);
+	batch_job_del(worker->job);
+	free(worker->output);
+	free(worker);
+}
+
+static void batch_finish() {
+	double secs = (double) (monotime_ns() - batch_stats.start_ns) / NS_PER_S;
+	LOG(server_id, "Batch complete: %zu files (%zu failed), %.1f MB in, %.1f MB out, %.3fs (%.1f MB/s)", batch_stats.files, batch_stats.failed, (double) batch_stats.bytes_in / 1000000, (double) batch_stats.bytes_out / 1000000, secs, secs > 0 ? (double) batch_stats.bytes_in / secs / 1000000 : 0.0);
+	// Release the loop; see batch_init()
+	batch_active = false;
+	peer_count_in--;
+	peer_count_out--;
+}
+
+static void batch_worker_handler(struct peer *peer) {
+	struct batch_worker *worker = container_of(peer, struct batch_worker, peer);
+
+	int status;
+	assert(waitpid(worker->pid, &status, 0) == worker->pid);
+	double secs = (double) (monotime_ns() - worker->start_ns) / NS_PER_S;
+	batch_stats.files++;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+		struct stat st;
+		off_t out = stat(worker->output, &st) ? 0 : st.st_size;
+		batch_stats.bytes_in += (uint64_t) worker->job->size;
+		batch_stats.bytes_out += (uint64_t) out;
+		LOG(worker->id, "Converted %s -> %s (%.1f MB in %.3fs)", worker->job->input, worker->output, (double) worker->job->size / 1000000, secs);
+	} else {
+		batch_stats.failed++;
+		LOG(worker->id, "Failed to convert %s (%s %d)", worker->job->input, WIFEXITED(status) ? "status" : "signal", WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+	}
+	batch_worker_del(worker);
+
+	batch_start();
+	if (list_is_empty(&batch_worker_head)) {
+		batch_finish();
+	}
+}
+
+static char *batch_output_path(const struct batch_job *job) {
+	const char *suffix = batch_suffix;
+	char default_suffix[64];
+	if (!suffix) {
+		snprintf(default_suffix, sizeof(default_suffix), ".%s", job->format);
+		suffix = default_suffix;
+	}
+	char *path;
+	if (batch_output_dir) {
+		char *input = strdup(job->input);
+		assert(input);
+		assert(asprintf(&path, "%s/%s%s", batch_output_dir, basename(input), suffix) > 0);
+		free(input);
+	} else {
+		assert(asprintf(&path, "%s%s", job->input, suffix) > 0);
+	}
+	return path;
+}
+
+static bool batch_spawn(struct batch_job *job) {
+	struct batch_worker *worker = malloc(sizeof(*worker));
+	assert(worker);
+	uuid_gen(worker->id);
+	worker->job = job;
+	worker->output = batch_output_path(job);
+	list_del(&job->job_list);
+	list_head_init(&job->job_list);
+
+	char *read_arg, *write_arg;
+	assert(asprintf(&read_arg, "--file-read=%s", job->input) > 0);
+	assert(asprintf(&write_arg, "--file-write=%s=%s", job->format, worker->output) > 0);
+	size_t num_forward = 0;
+	while (batch_forward[num_forward]) {
+		num_forward++;
+	}
+	char *argv[num_forward + 5];
+	char arg0[] = "adsbus", quiet[] = "--quiet";
+	argv[0] = arg0;
+	argv[1] = quiet;
+	argv[2] = read_arg;
+	argv[3] = write_arg;
+	for (size_t i = 0; i < num_forward; i++) {
+		argv[4 + i] = batch_forward[i];
+	}
+	argv[num_forward + 4] = NULL;
+
+	// Same signal setup as exec children: nothing blocked, SIGPIPE default
+	sigset_t sigmask, sigdefault;
+	assert(!sigemptyset(&sigmask));
+	assert(!sigemptyset(&sigdefault));
+	assert(!sigaddset(&sigdefault, SIGPIPE));
+	posix_spawnattr_t attr;
+	assert(!posix_spawnattr_init(&attr));
+	assert(!posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF));
+	assert(!posix_spawnattr_setsigmask(&attr, &sigmask));
+	assert(!posix_spawnattr_setsigdefault(&attr, &sigdefault));
+
+	worker->start_ns = monotime_ns();
+	int res = posix_spawn(&worker->pid, "/proc/self/exe", NULL, &attr, argv, environ);
+	assert(!posix_spawnattr_destroy(&attr));
+	free(read_arg);
+	free(write_arg);
+	if (res) {
+		LOG(worker->id, "Failed to start worker for %s: %s", job->input, strerror(res));
+		batch_stats.files++;
+		batch_stats.failed++;
+		batch_job_del(job);
+		free(worker->output);
+		free(worker);
+		return false;
+	}
+
+	// A pidfd is readable once the child exits, which fits the event loop
+	// without sharing SIGCHLD with exec.c.
+	worker->peer.fd = (int) syscall(SYS_pidfd_open, worker->pid, 0);
+	assert(worker->peer.fd >= 0);
+	worker->peer.event_handler = batch_worker_handler;
+	list_add(&worker->worker_list, &batch_worker_head);
+	peer_epoll_add(&worker->peer, EPOLLIN);
+	LOG(worker->id, "Converting %s -> %s (process %d)", job->input, worker->output, worker->pid);
+	return true;
+}
+
+static void batch_start() {
+	size_t running = 0;
+	struct batch_worker *worker;
+	list_for_each_entry(worker, &batch_worker_head, worker_list) {
+		running++;
+	}
+	while (running < batch_jobs && !list_is_empty(&batch_job_head)) {
+		if (batch_spawn(list_entry(batch_job_head.next, struct batch_job, job_list))) {
+			running++;
+		}
+	}
+}
+
+static void batch_add_job(const char *input, const char *format) {
+	struct stat st;
+	if (stat(input, &st) || !S_ISREG(st.st_mode)) {
+		return;
+	}
+	struct batch_job *job = malloc(sizeof(*job));
+	assert(job);
+	job->input = strdup(input);
+	assert(job->input);
+	job->format = strdup(format);
+	assert(job->format);
+	job->size = st.st_size;
+
+	// Largest first, so one big file doesn't end up running alone at the end
+	struct batch_job *iter;
+	list_for_each_entry(iter, &batch_job_head, job_list) {
+		if (iter->size < job->size) {
+			break;
+		}
+	}
+	list_add(&job->job_list, &iter->job_list);
+}
+
+static bool batch_convert(const char *arg) {
+	char *format = opts_split(&arg, '=');
+	if (!format) {
+		return false;
+	}
+	if (!send_check_format(format)) {
+		free(format);
+		return false;
+	}
+	glob_t globbuf;
+	int res = glob(arg, 0, NULL, &globbuf);
+	if (res) {
+		if (res == GLOB_NOMATCH) {
+			fprintf(stderr, "No files match: %s\n", arg);
+		}
+		free(format);
+		return false;
+	}
+	for (size_t i = 0; i < globbuf.gl_pathc; i++) {
+		batch_add_job(globbuf.gl_pathv[i], format);
+	}
+	globfree(&globbuf);
+	free(format);
+	return true;
+}
+
+static bool batch_set_jobs(const char *arg) {
+	return opts_parse_uint32(arg, &batch_jobs) && batch_jobs > 0;
+}
+
+static bool batch_set_output_dir(const char *arg) {
+	free(batch_output_dir);
+	batch_output_dir = strdup(arg);
+	assert(batch_output_dir);
+	return true;
+}
+
+static bool batch_set_suffix(const char *arg) {
+	free(batch_suffix);
+	batch_suffix = strdup(arg);
+	assert(batch_suffix);
+	return true;
+}
+
+void batch_opts_add() {
+	opts_add("batch-convert", "FORMAT=GLOB", batch_convert, batch_opts);
+	opts_add("batch-jobs", "COUNT", batch_set_jobs, batch_opts);
+	opts_add("batch-output-dir", "PATH", batch_set_output_dir, batch_opts);
+	opts_add("batch-suffix", "SUFFIX", batch_set_suffix, batch_opts);
+}
+
+void batch_init() {
+	profile_add_handler(batch_worker_handler, "batch");
+	opts_call(batch_opts);
+	if (list_is_empty(&batch_job_head)) {
+		return;
+	}
+	if (!batch_jobs) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		batch_jobs = cpus > 0 ? (uint32_t) cpus : 1;
+	}
+	// Workers get our capture settings (buffering, compression, etc.)
+	batch_forward = opts_forward("capture-");
+
+	// Hold the loop open until every worker is done, like an input and an
+	// output would.
+	batch_active = true;
+	peer_count_in++;
+	peer_count_out++;
+	batch_stats.start_ns = monotime_ns();
+	batch_start();
+	if (list_is_empty(&batch_worker_head)) {
+		batch_finish();
+	}
+}
+
+void batch_cleanup() {
+	struct batch_worker *worker, *next_worker;
+	list_for_each_entry_safe(worker, next_worker, &batch_worker_head, worker_list) {
+		LOG(worker->id, "Sending SIGTERM to worker process %d", worker->pid);
+		kill(worker->pid, SIGTERM);
+		int status;
+		assert(waitpid(worker->pid, &status, 0) == worker->pid);
+		batch_worker_del(worker);
+	}
+	struct batch_job *job, *next_job;
+	list_for_each_entry_safe(job, next_job, &batch_job_head, job_list) {
+		batch_job_del(job);
+	}
+	if (batch_active) {
+		batch_active = false;
+		peer_count_in--;
+		peer_count_out--;
+	}
+	if (batch_forward) {
+		for (char **iter = batch_forward; *iter; iter++) {
+			free(*iter);
+		}
+		free(batch_forward);
+	}
+	free(batch_output_dir);
+	free(batch_suffix);
+}
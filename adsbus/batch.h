@@ -0,0 +1,5 @@
+#pragma once
+
+void batch_opts_add(void);
+void batch_init(void);
+void batch_cleanup(void);
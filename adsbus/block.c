@@ -0,0 +1,385 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet.h"
+#include "uuid.h"
+
+#include "block.h"
+
+// All integers are little-endian.
+//
+// File header:
+//   0  magic "aDsBidx1"
+//   8  version (u32)
+//   12 maximum block size (u32)
+//
+// Block:
+//   0  magic "aDbK"
+//   4  payload length (u32)
+//   8  greeting length at the start of the payload (u32)
+//   12 packets (u32)
+//   16 minimum mlat_timestamp (u64, 0 if none)
+//   24 maximum mlat_timestamp (u64, 0 if none)
+//   32 sources listed (u32)
+//   36 flags (u32)
+//   40 BLOCK_SOURCES_MAX * (source_id[16], packets (u32))
+//   200 payload
+//
+// Footer:
+//   N * (block offset (u64), minimum (u64), maximum (u64), packets (u32), reserved (u32))
+//   index offset (u64)
+//   index entries (u32)
+//   reserved (u32)
+//   magic "aDsBend1"
+
+#define BLOCK_VERSION 1
+#define BLOCK_HEADER_LEN 200
+#define BLOCK_SOURCES_MAX 8
+#define BLOCK_SOURCE_LEN (UUID_LEN + 4)
+#define BLOCK_INDEX_ENTRY_LEN 32
+#define BLOCK_TRAILER_LEN 24
+
+// More sources contributed to the block than are listed in its header
+#define BLOCK_FLAG_SOURCES_TRUNCATED (1 << 0)
+
+static const uint8_t block_file_magic[] = "aDsBidx1";
+static const uint8_t block_magic[] = "aDbK";
+static const uint8_t block_end_magic[] = "aDsBend1";
+
+struct block_entry {
+	uint64_t offset;
+	uint64_t mlat_min;
+	uint64_t mlat_max;
+	uint32_t packets;
+};
+
+struct block_writer {
+	uint8_t *buf;
+	size_t size;
+	size_t length;
+	size_t hello_length;
+	bool closed;
+	uint32_t packets;
+	uint64_t mlat_min;
+	uint64_t mlat_max;
+	uint32_t num_sources;
+	uint32_t flags;
+	struct {
+		uint8_t id[UUID_LEN];
+		uint32_t packets;
+	} sources[BLOCK_SOURCES_MAX];
+	struct block_entry *index;
+	size_t index_length;
+	size_t index_size;
+};
+
+static void block_put32(uint8_t *out, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		out[i] = (uint8_t) (value >> (i * 8));
+	}
+}
+
+static void block_put64(uint8_t *out, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		out[i] = (uint8_t) (value >> (i * 8));
+	}
+}
+
+static uint32_t block_get32(const uint8_t *in) {
+	uint32_t value = 0;
+	for (int i = 3; i >= 0; i--) {
+		value = (value << 8) | in[i];
+	}
+	return value;
+}
+
+static uint64_t block_get64(const uint8_t *in) {
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--) {
+		value = (value << 8) | in[i];
+	}
+	return value;
+}
+
+static void block_writer_reset(struct block_writer *writer) {
+	writer->length = BLOCK_HEADER_LEN + writer->hello_length;
+	writer->closed = false;
+	writer->packets = 0;
+	writer->mlat_min = UINT64_MAX;
+	writer->mlat_max = 0;
+	writer->num_sources = 0;
+	writer->flags = 0;
+}
+
+static void block_writer_add_source(struct block_writer *writer, const uint8_t *source_id) {
+	for (uint32_t i = 0; i < writer->num_sources; i++) {
+		if (!memcmp(writer->sources[i].id, source_id, UUID_LEN)) {
+			writer->sources[i].packets++;
+			return;
+		}
+	}
+	if (writer->num_sources == BLOCK_SOURCES_MAX) {
+		writer->flags |= BLOCK_FLAG_SOURCES_TRUNCATED;
+		return;
+	}
+	memcpy(writer->sources[writer->num_sources].id, source_id, UUID_LEN);
+	writer->sources[writer->num_sources].packets = 1;
+	writer->num_sources++;
+}
+
+struct block_writer *block_writer_new(size_t size, const uint8_t *hello, size_t hello_length) {
+	assert(size >= BLOCK_SIZE_MIN);
+	struct block_writer *writer = malloc(sizeof(*writer));
+	assert(writer);
+	writer->size = size;
+	writer->buf = malloc(size);
+	assert(writer->buf);
+	writer->hello_length = hello_length;
+	memcpy(&writer->buf[BLOCK_HEADER_LEN], hello, hello_length);
+	writer->index = NULL;
+	writer->index_length = writer->index_size = 0;
+	block_writer_reset(writer);
+	return writer;
+}
+
+void block_writer_del(struct block_writer *writer) {
+	free(writer->index);
+	free(writer->buf);
+	free(writer);
+}
+
+void block_writer_start(struct block_writer *writer, uint8_t *out) {
+	// New file: the index only covers blocks after this header.
+	memcpy(out, block_file_magic, 8);
+	block_put32(&out[8], BLOCK_VERSION);
+	block_put32(&out[12], (uint32_t) writer->size);
+	writer->index_length = 0;
+	block_writer_reset(writer);
+}
+
+bool block_writer_add(struct block_writer *writer, const struct packet *packet, const void *data, size_t len) {
+	if (writer->closed) {
+		block_writer_reset(writer);
+	}
+	if (writer->length + len > writer->size) {
+		return false;
+	}
+	memcpy(&writer->buf[writer->length], data, len);
+	writer->length += len;
+	writer->packets++;
+	if (packet->mlat_timestamp) {
+		writer->mlat_min = packet->mlat_timestamp < writer->mlat_min ? packet->mlat_timestamp : writer->mlat_min;
+		writer->mlat_max = packet->mlat_timestamp > writer->mlat_max ? packet->mlat_timestamp : writer->mlat_max;
+	}
+	block_writer_add_source(writer, packet->source_id);
+	return true;
+}
+
+bool block_writer_empty(const struct block_writer *writer) {
+	return writer->closed || !writer->packets;
+}
+
+size_t block_writer_close(struct block_writer *writer, uint64_t offset, const uint8_t **out) {
+	assert(!block_writer_empty(writer));
+	uint64_t mlat_min = writer->mlat_max ? writer->mlat_min : 0;
+
+	uint8_t *header = writer->buf;
+	memset(header, 0, BLOCK_HEADER_LEN);
+	memcpy(header, block_magic, 4);
+	block_put32(&header[4], (uint32_t) (writer->length - BLOCK_HEADER_LEN));
+	block_put32(&header[8], (uint32_t) writer->hello_length);
+	block_put32(&header[12], writer->packets);
+	block_put64(&header[16], mlat_min);
+	block_put64(&header[24], writer->mlat_max);
+	block_put32(&header[32], writer->num_sources);
+	block_put32(&header[36], writer->flags);
+	for (uint32_t i = 0; i < writer->num_sources; i++) {
+		uint8_t *source = &header[40 + i * BLOCK_SOURCE_LEN];
+		memcpy(source, writer->sources[i].id, UUID_LEN);
+		block_put32(&source[UUID_LEN], writer->sources[i].packets);
+	}
+
+	if (writer->index_length == writer->index_size) {
+		writer->index_size = writer->index_size ? writer->index_size * 2 : 256;
+		writer->index = realloc(writer->index, writer->index_size * sizeof(*writer->index));
+		assert(writer->index);
+	}
+	writer->index[writer->index_length++] = (struct block_entry) {
+		.offset = offset,
+		.mlat_min = mlat_min,
+		.mlat_max = writer->mlat_max,
+		.packets = writer->packets,
+	};
+
+	// Contents stay valid until the next block_writer_add()
+	writer->closed = true;
+	*out = writer->buf;
+	return writer->length;
+}
+
+size_t block_writer_footer(struct block_writer *writer, uint64_t offset, uint8_t **out) {
+	size_t len = writer->index_length * BLOCK_INDEX_ENTRY_LEN + BLOCK_TRAILER_LEN;
+	uint8_t *footer = malloc(len);
+	assert(footer);
+	uint8_t *iter = footer;
+	for (size_t i = 0; i < writer->index_length; i++, iter += BLOCK_INDEX_ENTRY_LEN) {
+		block_put64(&iter[0], writer->index[i].offset);
+		block_put64(&iter[8], writer->index[i].mlat_min);
+		block_put64(&iter[16], writer->index[i].mlat_max);
+		block_put32(&iter[24], writer->index[i].packets);
+		block_put32(&iter[28], 0);
+	}
+	block_put64(&iter[0], offset);
+	block_put32(&iter[8], (uint32_t) writer->index_length);
+	block_put32(&iter[12], 0);
+	memcpy(&iter[16], block_end_magic, 8);
+	*out = footer;
+	return len;
+}
+
+bool block_detect(const uint8_t *map, size_t len) {
+	return len >= BLOCK_FILE_HEADER_LEN && !memcmp(map, block_file_magic, 8);
+}
+
+static bool block_header_valid(const uint8_t *map, size_t len, size_t offset) {
+	if (offset > len || len - offset < BLOCK_HEADER_LEN || memcmp(&map[offset], block_magic, 4)) {
+		return false;
+	}
+	size_t length = block_get32(&map[offset + 4]);
+	return length <= len - offset - BLOCK_HEADER_LEN && block_get32(&map[offset + 8]) <= length;
+}
+
+static size_t block_load_footer(const uint8_t *map, size_t len, struct block_entry **out) {
+	if (len < BLOCK_FILE_HEADER_LEN + BLOCK_TRAILER_LEN) {
+		return SIZE_MAX;
+	}
+	const uint8_t *trailer = &map[len - BLOCK_TRAILER_LEN];
+	if (memcmp(&trailer[16], block_end_magic, 8)) {
+		return SIZE_MAX;
+	}
+	uint64_t index_offset = block_get64(&trailer[0]);
+	size_t entries = block_get32(&trailer[8]);
+	// Both fields come from the file; compare before doing arithmetic with
+	// them so a crafted footer can't wrap the sum around to len.
+	if (index_offset < BLOCK_FILE_HEADER_LEN || index_offset > len - BLOCK_TRAILER_LEN) {
+		return SIZE_MAX;
+	}
+	size_t index_len = len - BLOCK_TRAILER_LEN - index_offset;
+	if (index_len % BLOCK_INDEX_ENTRY_LEN || entries != index_len / BLOCK_INDEX_ENTRY_LEN) {
+		return SIZE_MAX;
+	}
+
+	struct block_entry *index = malloc((entries ? entries : 1) * sizeof(*index));
+	assert(index);
+	const uint8_t *iter = &map[index_offset];
+	for (size_t i = 0; i < entries; i++, iter += BLOCK_INDEX_ENTRY_LEN) {
+		index[i] = (struct block_entry) {
+			.offset = block_get64(&iter[0]),
+			.mlat_min = block_get64(&iter[8]),
+			.mlat_max = block_get64(&iter[16]),
+			.packets = block_get32(&iter[24]),
+		};
+	}
+	*out = index;
+	return entries;
+}
+
+static size_t block_scan(const uint8_t *map, size_t len, struct block_entry **out) {
+	// No usable footer (e.g. the writer died); walk the block headers.
+	size_t entries = 0, size = 256;
+	struct block_entry *index = malloc(size * sizeof(*index));
+	assert(index);
+	for (size_t offset = BLOCK_FILE_HEADER_LEN; block_header_valid(map, len, offset); offset += BLOCK_HEADER_LEN + block_get32(&map[offset + 4])) {
+		if (entries == size) {
+			size *= 2;
+			index = realloc(index, size * sizeof(*index));
+			assert(index);
+		}
+		index[entries++] = (struct block_entry) {
+			.offset = offset,
+			.mlat_min = block_get64(&map[offset + 16]),
+			.mlat_max = block_get64(&map[offset + 24]),
+			.packets = block_get32(&map[offset + 12]),
+		};
+	}
+	*out = index;
+	return entries;
+}
+
+size_t block_select(const uint8_t *map, size_t len, uint64_t start, uint64_t end, struct block_range **out, size_t *total, bool *indexed) {
+	struct block_entry *index;
+	size_t entries = block_load_footer(map, len, &index);
+	*indexed = (entries != SIZE_MAX);
+	if (!*indexed) {
+		entries = block_scan(map, len, &index);
+	}
+	*total = entries;
+
+	// Blocks from several sources overlap in time, so search on the running
+	// maximum from the front and the running minimum from the back, which
+	// are both sorted, then check each block in between.
+	size_t first = 0, last = entries;
+	bool all = (start == 0 && end == UINT64_MAX);
+	if (!all && entries) {
+		uint64_t *max_prefix = malloc(entries * sizeof(*max_prefix));
+		uint64_t *min_suffix = malloc(entries * sizeof(*min_suffix));
+		assert(max_prefix);
+		assert(min_suffix);
+		for (size_t i = 0; i < entries; i++) {
+			max_prefix[i] = (i && max_prefix[i - 1] > index[i].mlat_max) ? max_prefix[i - 1] : index[i].mlat_max;
+		}
+		for (size_t i = entries; i-- > 0;) {
+			uint64_t mlat_min = index[i].mlat_max ? index[i].mlat_min : UINT64_MAX;
+			min_suffix[i] = (i < entries - 1 && min_suffix[i + 1] < mlat_min) ? min_suffix[i + 1] : mlat_min;
+		}
+
+		size_t lo = 0, hi = entries;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (max_prefix[mid] < start) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		first = lo;
+
+		lo = first;
+		hi = entries;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (min_suffix[mid] <= end) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		last = lo;
+
+		free(max_prefix);
+		free(min_suffix);
+	}
+
+	struct block_range *ranges = malloc((last > first ? last - first : 1) * sizeof(*ranges));
+	assert(ranges);
+	size_t selected = 0;
+	for (size_t i = first; i < last; i++) {
+		if (!all && (!index[i].mlat_max || index[i].mlat_min > end || index[i].mlat_max < start)) {
+			continue;
+		}
+		if (index[i].offset > SIZE_MAX || !block_header_valid(map, len, (size_t) index[i].offset)) {
+			continue;
+		}
+		size_t offset = (size_t) index[i].offset;
+		ranges[selected++] = (struct block_range) {
+			.offset = offset + BLOCK_HEADER_LEN,
+			.length = block_get32(&map[offset + 4]),
+			.hello_length = block_get32(&map[offset + 8]),
+		};
+	}
+
+	free(index);
+	*out = ranges;
+	return selected;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct packet;
+
+// Indexed capture container: a file header, then blocks of serialized
+// packets (each starting with the format's greeting), then a footer index
+// of per-block mlat_timestamp ranges.
+#define BLOCK_FILE_HEADER_LEN 16
+#define BLOCK_SIZE_MIN 4096
+
+struct block_writer;
+
+struct block_range {
+	size_t offset;
+	size_t length;
+	size_t hello_length;
+};
+
+struct block_writer *block_writer_new(size_t, const uint8_t *, size_t);
+void block_writer_del(struct block_writer *);
+void block_writer_start(struct block_writer *, uint8_t *);
+bool __attribute__ ((warn_unused_result)) block_writer_add(struct block_writer *, const struct packet *, const void *, size_t);
+bool block_writer_empty(const struct block_writer *);
+size_t block_writer_close(struct block_writer *, uint64_t, const uint8_t **);
+size_t block_writer_footer(struct block_writer *, uint64_t, uint8_t **);
+
+bool block_detect(const uint8_t *, size_t);
+size_t block_select(const uint8_t *, size_t, uint64_t, uint64_t, struct block_range **, size_t *, bool *);
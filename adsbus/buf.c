@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "buf.h"
@@ -9,14 +11,18 @@ void buf_init(struct buf *buf) {
 	buf->length = 0;
 }
 
-ssize_t buf_fill(struct buf *buf, int fd) {
+static size_t buf_space(struct buf *buf) {
 	if (buf->start + buf->length == BUF_LEN_MAX) {
 		assert(buf->start > 0);
 		memmove(buf->buf, buf_at(buf, 0), buf->length);
 		buf->start = 0;
 	}
 
-	size_t space = BUF_LEN_MAX - buf->length - buf->start;
+	return BUF_LEN_MAX - buf->length - buf->start;
+}
+
+ssize_t buf_fill(struct buf *buf, int fd) {
+	size_t space = buf_space(buf);
 	ssize_t in = read(fd, buf_at(buf, buf->length), space);
 	if (in <= 0) {
 		return in;
@@ -25,6 +31,48 @@ ssize_t buf_fill(struct buf *buf, int fd) {
 	return in;
 }
 
+ssize_t buf_fill_timestamp(struct buf *buf, int fd, struct timespec *timestamp) {
+	// Like buf_fill(), but also returns the kernel's software receive
+	// timestamp if the socket has SO_TIMESTAMPING on; zero otherwise
+	// buf_space() may compact the buffer, so call it first
+	size_t space = buf_space(buf);
+	struct iovec iov = {
+		.iov_base = buf_at(buf, buf->length),
+		.iov_len = space,
+	};
+	union {
+		// struct scm_timestamping: software, (deprecated), hardware
+		char buf[CMSG_SPACE(sizeof(struct timespec) * 3)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	memset(timestamp, 0, sizeof(*timestamp));
+	ssize_t in = recvmsg(fd, &msg, 0);
+	if (in <= 0) {
+		return in;
+	}
+	buf->length += (size_t) in;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			memcpy(timestamp, CMSG_DATA(cmsg), sizeof(*timestamp));
+		}
+	}
+	return in;
+}
+
+size_t buf_fill_mem(struct buf *buf, const uint8_t *src, size_t len) {
+	size_t space = buf_space(buf);
+	size_t in = len < space ? len : space;
+	memcpy(buf_at(buf, buf->length), src, in);
+	buf->length += in;
+	return in;
+}
+
 void buf_consume(struct buf *buf, size_t length) {
 	assert(buf->length >= length);
 
@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUF_LEN_MAX 256
@@ -20,4 +21,6 @@ struct buf {
 
 void buf_init(struct buf *);
 ssize_t buf_fill(struct buf *, int);
+ssize_t buf_fill_timestamp(struct buf *, int, struct timespec *);
+size_t buf_fill_mem(struct buf *, const uint8_t *, size_t);
 void buf_consume(struct buf *, size_t);
@@ -0,0 +1,664 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zstd.h>
+
+#include "block.h"
+#include "buf.h"
+#include "column.h"
+#include "flow.h"
+#include "log.h"
+#include "monotime.h"
+#include "opts.h"
+#include "packet.h"
+#include "peer.h"
+#include "profile.h"
+#include "wakeup.h"
+
+#include "capture.h"
+
+// Buffered writer for send outputs that are regular files. Serialized
+// packets are batched into large block-aligned writes instead of one
+// write() per packet. Outputs opened through capture_file_open() can also
+// be zstd compressed (".zst" path), rotated (strftime() path template) or
+// written as an indexed block container (see block.c). The columnar format
+// bypasses serialization and is written straight from packets (see
+// column.c).
+struct capture {
+	struct peer peer;
+	struct peer *on_error;
+	const uint8_t *id;
+	int fd;
+	uint8_t *buf;
+	size_t length;
+	size_t written;
+	off_t offset;
+	off_t allocated;
+	bool direct;
+	bool direct_enabled;
+	bool preallocate;
+	bool flush_pending;
+	bool failed;
+	uint64_t last_sync_ms;
+
+	// Only set up for capture_file_open() outputs
+	struct flow *flow;
+	void *passthrough;
+	char *path_template;
+	char *path;
+	int open_flags;
+	time_t rotate_at;
+	ZSTD_CCtx *cctx;
+	uint8_t *in;
+	size_t in_length;
+	struct block_writer *block;
+	struct column_writer *column;
+};
+
+// Handoff from capture_file_open() to the capture_new() call that the
+// send flow makes for the same fd.
+static struct {
+	int fd;
+	struct flow *flow;
+	void *passthrough;
+	char *path_template;
+	char *path;
+	int open_flags;
+	bool indexed;
+} capture_file_pending = {
+	.fd = -1,
+};
+
+static opts_group capture_opts;
+
+static char log_module = 'S'; // borrowing
+
+#define CAPTURE_ALIGN 4096
+
+static uint32_t capture_buffer_size = 1 << 20;
+static uint32_t capture_preallocate = 64 << 20;
+static uint32_t capture_flush_ms = 1000;
+static uint32_t capture_sync_ms = 0;
+static bool capture_direct = false;
+static uint32_t capture_rotate_mb = 0;
+static uint32_t capture_rotate_seconds = 3600;
+static uint32_t capture_zstd_level = 3;
+static uint32_t capture_block_size = 64 << 10;
+static uint32_t capture_column_rows = 1 << 16;
+
+static bool capture_set_buffer_size(const char *arg) {
+	return opts_parse_uint32(arg, &capture_buffer_size) && capture_buffer_size >= 2 * CAPTURE_ALIGN;
+}
+
+static bool capture_set_preallocate(const char *arg) {
+	return opts_parse_uint32(arg, &capture_preallocate);
+}
+
+static bool capture_set_flush_ms(const char *arg) {
+	return opts_parse_uint32(arg, &capture_flush_ms);
+}
+
+static bool capture_set_sync_ms(const char *arg) {
+	return opts_parse_uint32(arg, &capture_sync_ms);
+}
+
+static bool capture_set_direct(const char __attribute__ ((unused)) *arg) {
+	capture_direct = true;
+	return true;
+}
+
+static bool capture_set_rotate_mb(const char *arg) {
+	return opts_parse_uint32(arg, &capture_rotate_mb);
+}
+
+static bool capture_set_rotate_seconds(const char *arg) {
+	return opts_parse_uint32(arg, &capture_rotate_seconds);
+}
+
+static bool capture_set_zstd_level(const char *arg) {
+	return opts_parse_uint32(arg, &capture_zstd_level) && capture_zstd_level >= 1 && capture_zstd_level <= (uint32_t) ZSTD_maxCLevel();
+}
+
+static bool capture_set_block_size(const char *arg) {
+	return opts_parse_uint32(arg, &capture_block_size) && capture_block_size >= BLOCK_SIZE_MIN;
+}
+
+static bool capture_set_column_rows(const char *arg) {
+	return opts_parse_uint32(arg, &capture_column_rows) && capture_column_rows > 0;
+}
+
+static void capture_error(struct capture *capture) {
+	// Our owner will call capture_del(); don't touch capture after this.
+	capture->failed = true;
+	peer_call(capture->on_error);
+}
+
+static bool capture_direct_toggle(struct capture *capture, bool enable) {
+	if (capture->direct_enabled == enable) {
+		return true;
+	}
+	int flags = fcntl(capture->fd, F_GETFL);
+	assert(flags >= 0);
+	flags = enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+	if (fcntl(capture->fd, F_SETFL, flags)) {
+		return false;
+	}
+	capture->direct_enabled = enable;
+	return true;
+}
+
+static void capture_reserve(struct capture *capture, off_t end) {
+	if (!capture->preallocate || end <= capture->allocated) {
+		return;
+	}
+	off_t new_allocated = end + (off_t) capture_preallocate;
+	if (fallocate(capture->fd, FALLOC_FL_KEEP_SIZE, capture->allocated, new_allocated - capture->allocated)) {
+		// Not every filesystem supports this; carry on without it.
+		LOG(capture->id, "Preallocation disabled: %s", strerror(errno));
+		capture->preallocate = false;
+		return;
+	}
+	capture->allocated = new_allocated;
+}
+
+static bool capture_pwrite(struct capture *capture, size_t start, size_t len, bool direct) {
+	if (capture->direct && !capture_direct_toggle(capture, direct)) {
+		LOG(capture->id, "Error changing O_DIRECT: %s", strerror(errno));
+		return false;
+	}
+	capture_reserve(capture, capture->offset + (off_t) (start + len));
+	while (len) {
+		ssize_t ret = pwrite(capture->fd, &capture->buf[start], len, capture->offset + (off_t) start);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			LOG(capture->id, "Error writing: %s", ret ? strerror(errno) : "no progress");
+			return false;
+		}
+		start += (size_t) ret;
+		len -= (size_t) ret;
+	}
+	return true;
+}
+
+static bool capture_consume(struct capture *capture, size_t len, bool direct) {
+	if (!len) {
+		return true;
+	}
+	if (len > capture->written) {
+		// A forced flush may have already written part of this through the
+		// page cache; buffered writes can skip that, but O_DIRECT needs the
+		// whole block from its aligned start.
+		size_t start = direct ? 0 : capture->written;
+		if (!capture_pwrite(capture, start, len - start, direct)) {
+			return false;
+		}
+	}
+	capture->offset += (off_t) len;
+	capture->length -= len;
+	capture->written = capture->written > len ? capture->written - len : 0;
+	memmove(capture->buf, &capture->buf[len], capture->length);
+	return true;
+}
+
+static bool capture_flush(struct capture *capture, bool force) {
+	if (!capture->direct) {
+		return capture_consume(capture, capture->length, false);
+	}
+
+	// O_DIRECT needs block-aligned offsets and lengths. Write any unaligned
+	// head through the page cache, then whole blocks directly.
+	size_t head = (CAPTURE_ALIGN - (size_t) (capture->offset % CAPTURE_ALIGN)) % CAPTURE_ALIGN;
+	if (head) {
+		if (head > capture->length) {
+			head = force ? capture->length : 0;
+		}
+		if (!capture_consume(capture, head, false)) {
+			return false;
+		}
+	}
+	if (!(capture->offset % CAPTURE_ALIGN) && !capture_consume(capture, capture->length & ~(size_t) (CAPTURE_ALIGN - 1), true)) {
+		return false;
+	}
+
+	if (force && capture->length > capture->written) {
+		// Partial last block: write it through the page cache, but keep it
+		// buffered so the next direct write covers the whole block.
+		if (!capture_pwrite(capture, capture->written, capture->length - capture->written, false)) {
+			return false;
+		}
+		capture->written = capture->length;
+	}
+	return true;
+}
+
+static bool capture_sync(struct capture *capture, bool force) {
+	if (!capture_sync_ms) {
+		return true;
+	}
+	uint64_t now = monotime_coarse_ns() / NS_PER_MS;
+	if (!force && now - capture->last_sync_ms < capture_sync_ms) {
+		return true;
+	}
+	capture->last_sync_ms = now;
+	if (fdatasync(capture->fd)) {
+		LOG(capture->id, "Error syncing: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static bool capture_compress(struct capture *capture, ZSTD_EndDirective mode) {
+	ZSTD_inBuffer in = {
+		.src = capture->in,
+		.size = capture->in_length,
+		.pos = 0,
+	};
+	while (true) {
+		if (capture->length == capture_buffer_size && !capture_flush(capture, false)) {
+			return false;
+		}
+		ZSTD_outBuffer out = {
+			.dst = capture->buf,
+			.size = capture_buffer_size,
+			.pos = capture->length,
+		};
+		size_t remaining = ZSTD_compressStream2(capture->cctx, &out, &in, mode);
+		if (ZSTD_isError(remaining)) {
+			LOG(capture->id, "Error compressing: %s", ZSTD_getErrorName(remaining));
+			return false;
+		}
+		capture->length = out.pos;
+		if (mode == ZSTD_e_continue ? (in.pos == in.size) : !remaining) {
+			break;
+		}
+	}
+	capture->in_length = 0;
+	return true;
+}
+
+static bool capture_append(struct capture *capture, const void *data, size_t len) {
+	if (capture->cctx) {
+		assert(len <= capture_buffer_size);
+		if (capture->in_length + len > capture_buffer_size && !capture_compress(capture, ZSTD_e_continue)) {
+			return false;
+		}
+		memcpy(&capture->in[capture->in_length], data, len);
+		capture->in_length += len;
+		return true;
+	}
+	const uint8_t *iter = data;
+	while (len) {
+		if (capture->length == capture_buffer_size && !capture_flush(capture, false)) {
+			return false;
+		}
+		size_t chunk = capture_buffer_size - capture->length;
+		chunk = chunk < len ? chunk : len;
+		memcpy(&capture->buf[capture->length], iter, chunk);
+		capture->length += chunk;
+		iter += chunk;
+		len -= chunk;
+	}
+	return true;
+}
+
+static uint64_t capture_position(struct capture *capture) {
+	return (uint64_t) capture->offset + capture->length;
+}
+
+static bool capture_block_close(struct capture *capture) {
+	if (block_writer_empty(capture->block)) {
+		return true;
+	}
+	const uint8_t *data;
+	size_t len = block_writer_close(capture->block, capture_position(capture), &data);
+	return capture_append(capture, data, len);
+}
+
+static bool capture_column_close(struct capture *capture) {
+	if (column_writer_empty(capture->column)) {
+		return true;
+	}
+	const uint8_t *data;
+	size_t len = column_writer_close(capture->column, &data);
+	return capture_append(capture, data, len);
+}
+
+static bool capture_block_finish(struct capture *capture) {
+	if (!capture_block_close(capture)) {
+		return false;
+	}
+	uint8_t *footer;
+	size_t len = block_writer_footer(capture->block, capture_position(capture), &footer);
+	bool ret = capture_append(capture, footer, len);
+	free(footer);
+	return ret;
+}
+
+static bool capture_drain(struct capture *capture, ZSTD_EndDirective mode) {
+	// ZSTD_e_flush makes everything so far decodable; ZSTD_e_end also
+	// closes the frame (or writes the block index).
+	if (capture->block && mode == ZSTD_e_end && !capture_block_finish(capture)) {
+		return false;
+	}
+	if (capture->column && mode == ZSTD_e_end && !capture_column_close(capture)) {
+		return false;
+	}
+	if (capture->cctx && !capture_compress(capture, mode)) {
+		return false;
+	}
+	return capture_flush(capture, true) && capture_sync(capture, mode == ZSTD_e_end);
+}
+
+static void capture_flush_handler(struct peer *peer) {
+	struct capture *capture = container_of(peer, struct capture, peer);
+	capture->flush_pending = false;
+	// Bound what a crash can lose to one flush interval, at the cost of
+	// smaller blocks on quiet inputs.
+	if ((capture->block && !capture_block_close(capture)) || !capture_drain(capture, ZSTD_e_flush)) {
+		capture_error(capture);
+	}
+}
+
+static void capture_truncate(struct capture *capture) {
+	// Everything before offset is on disk, and so are the first written
+	// bytes of buf; after a successful drain that is all of it. After a
+	// failure, the rest never made it out, and anything past this is
+	// preallocated zeros or the start of a short write.
+	off_t end = capture->offset + (off_t) capture->written;
+	if (capture->failed || capture->allocated > end) {
+		// Hand back preallocated blocks past the end of the data
+		if (ftruncate(capture->fd, end)) {
+			LOG(capture->id, "Error truncating: %s", strerror(errno));
+		}
+	}
+}
+
+static void capture_attach(struct capture *capture) {
+	// We track the offset ourselves, and pwrite() ignores it under O_APPEND.
+	int flags = fcntl(capture->fd, F_GETFL);
+	assert(flags >= 0);
+	capture->offset = lseek(capture->fd, 0, (flags & O_APPEND) ? SEEK_END : SEEK_CUR);
+	assert(capture->offset >= 0);
+	assert(!fcntl(capture->fd, F_SETFL, flags & ~O_APPEND));
+	capture->allocated = capture->offset;
+	capture->length = capture->written = 0;
+	capture->direct_enabled = false;
+
+	if (capture->direct && !capture_direct_toggle(capture, true)) {
+		LOG(capture->id, "O_DIRECT not supported: %s", strerror(errno));
+		capture->direct = false;
+	}
+}
+
+static bool capture_start(struct capture *capture) {
+	if (capture->block) {
+		// Block writer repeats the greeting at the start of each block
+		uint8_t header[BLOCK_FILE_HEADER_LEN];
+		block_writer_start(capture->block, header);
+		return capture_append(capture, header, sizeof(header));
+	}
+	if (capture->column) {
+		uint8_t header[COLUMN_FILE_HEADER_LEN];
+		column_writer_start(header);
+		return capture_append(capture, header, sizeof(header));
+	}
+	struct buf buf = BUF_INIT, *buf_ptr = &buf;
+	flow_get_hello(capture->flow, &buf_ptr, capture->passthrough);
+	return capture_append(capture, buf_at(buf_ptr, 0), buf_ptr->length);
+}
+
+static char *capture_path_expand(const char *path_template) {
+	char path[4096];
+	time_t now = time(NULL);
+	struct tm tm;
+	assert(gmtime_r(&now, &tm));
+	size_t len = strftime(path, sizeof(path), path_template, &tm);
+	if (!len) {
+		return NULL;
+	}
+	char *ret = strdup(path);
+	assert(ret);
+	return ret;
+}
+
+static void capture_rotate_schedule(struct capture *capture) {
+	if (!capture_rotate_seconds) {
+		return;
+	}
+	// Line up with wall clock boundaries, e.g. on the hour
+	time_t now = time(NULL);
+	capture->rotate_at = (now / capture_rotate_seconds + 1) * capture_rotate_seconds;
+}
+
+static bool capture_rotate_due(struct capture *capture) {
+	if (!capture->path_template) {
+		return false;
+	}
+	if (capture_rotate_mb && capture->offset + (off_t) capture->length >= (off_t) capture_rotate_mb << 20) {
+		return true;
+	}
+	return capture_rotate_seconds && time(NULL) >= capture->rotate_at;
+}
+
+static bool capture_rotate(struct capture *capture) {
+	capture_rotate_schedule(capture);
+
+	char *path = capture_path_expand(capture->path_template);
+	if (!path || !strcmp(path, capture->path)) {
+		// Same name; keep appending rather than clobbering it
+		free(path);
+		return true;
+	}
+
+	if (!capture_drain(capture, ZSTD_e_end)) {
+		free(path);
+		return false;
+	}
+	capture_truncate(capture);
+
+	int fd = open(path, capture->open_flags | O_CLOEXEC | O_NOCTTY, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		// Keep writing (a new frame, if compressing) to the old file. The
+		// block index is kept, so the next footer covers the whole file.
+		LOG(capture->id, "Error opening rotated file %s: %s", path, strerror(errno));
+		free(path);
+		return capture->block ? true : capture_start(capture);
+	}
+	LOG(capture->id, "Rotating to: %s", path);
+	assert(dup2(fd, capture->fd) == capture->fd);
+	assert(!close(fd));
+	free(capture->path);
+	capture->path = path;
+
+	capture_attach(capture);
+	return capture_start(capture);
+}
+
+void capture_opts_add() {
+	opts_add("capture-buffer-size", "BYTES", capture_set_buffer_size, capture_opts);
+	opts_add("capture-preallocate", "BYTES", capture_set_preallocate, capture_opts);
+	opts_add("capture-flush-ms", "MS", capture_set_flush_ms, capture_opts);
+	opts_add("capture-sync-ms", "MS", capture_set_sync_ms, capture_opts);
+	opts_add("capture-direct", NULL, capture_set_direct, capture_opts);
+	opts_add("capture-rotate-mb", "MB", capture_set_rotate_mb, capture_opts);
+	opts_add("capture-rotate-seconds", "SECONDS", capture_set_rotate_seconds, capture_opts);
+	opts_add("capture-zstd-level", "LEVEL", capture_set_zstd_level, capture_opts);
+	opts_add("capture-block-size", "BYTES", capture_set_block_size, capture_opts);
+	opts_add("capture-column-rows", "ROWS", capture_set_column_rows, capture_opts);
+}
+
+void capture_init() {
+	opts_call(capture_opts);
+	capture_buffer_size = (capture_buffer_size + CAPTURE_ALIGN - 1) & ~(uint32_t) (CAPTURE_ALIGN - 1);
+	profile_add_handler(capture_flush_handler, "capture");
+}
+
+struct capture *capture_new(int fd, const uint8_t *id, struct peer *on_error, bool columnar) {
+	struct capture *capture = malloc(sizeof(*capture));
+	assert(capture);
+	capture->peer.fd = -1;
+	capture->peer.event_handler = capture_flush_handler;
+	capture->peer.wakeup_slot = 0;
+	capture->on_error = on_error;
+	capture->id = id;
+	capture->fd = fd;
+	void *buf;
+	assert(!posix_memalign(&buf, CAPTURE_ALIGN, capture_buffer_size));
+	capture->buf = buf;
+	capture->direct = capture_direct;
+	capture->preallocate = capture_preallocate > 0;
+	capture->flush_pending = capture->failed = false;
+	capture->last_sync_ms = monotime_coarse_ns() / NS_PER_MS;
+	capture->flow = NULL;
+	capture->passthrough = NULL;
+	capture->path_template = capture->path = NULL;
+	capture->cctx = NULL;
+	capture->in = NULL;
+	capture->in_length = 0;
+	capture->block = NULL;
+	capture->column = columnar ? column_writer_new(capture_column_rows, (int) capture_zstd_level) : NULL;
+	capture_attach(capture);
+
+	if (capture_file_pending.fd != fd) {
+		// Any greeting has already been written.
+		if (capture->column) {
+			assert(capture_start(capture));
+		}
+		return capture;
+	}
+
+	capture->flow = capture_file_pending.flow;
+	capture->passthrough = capture_file_pending.passthrough;
+	capture->open_flags = capture_file_pending.open_flags;
+	capture->path = capture_file_pending.path;
+	if (strchr(capture_file_pending.path_template, '%')) {
+		capture->path_template = capture_file_pending.path_template;
+		capture_rotate_schedule(capture);
+	} else {
+		free(capture_file_pending.path_template);
+	}
+	capture_file_pending.fd = -1;
+
+	size_t path_len = strlen(capture->path);
+	if (capture->column) {
+		// Columns are compressed individually
+	} else if (capture_file_pending.indexed) {
+		struct buf hello = BUF_INIT, *hello_ptr = &hello;
+		flow_get_hello(capture->flow, &hello_ptr, capture->passthrough);
+		capture->block = block_writer_new(capture_block_size, buf_at(hello_ptr, 0), hello_ptr->length);
+	} else if (path_len >= 4 && !strcmp(&capture->path[path_len - 4], ".zst")) {
+		capture->cctx = ZSTD_createCCtx();
+		assert(capture->cctx);
+		assert(!ZSTD_isError(ZSTD_CCtx_setParameter(capture->cctx, ZSTD_c_compressionLevel, (int) capture_zstd_level)));
+		capture->in = malloc(capture_buffer_size);
+		assert(capture->in);
+	}
+
+	// Hello was deferred to us so it's compressed, indexed and repeated on
+	// rotation
+	assert(capture_start(capture));
+	return capture;
+}
+
+void capture_del(struct capture *capture) {
+	wakeup_cancel(&capture->peer);
+	if (!capture->failed) {
+		capture_drain(capture, ZSTD_e_end);
+	}
+	capture_truncate(capture);
+	if (capture->cctx) {
+		ZSTD_freeCCtx(capture->cctx);
+	}
+	if (capture->block) {
+		block_writer_del(capture->block);
+	}
+	if (capture->column) {
+		column_writer_del(capture->column);
+	}
+	free(capture->in);
+	free(capture->path_template);
+	free(capture->path);
+	free(capture->buf);
+	free(capture);
+}
+
+bool capture_file_wanted(const char *path) {
+	size_t len = strlen(path);
+	return strchr(path, '%') || (len >= 4 && !strcmp(&path[len - 4], ".zst"));
+}
+
+int capture_file_open(const char *path_template, int flags, struct flow *flow, void *passthrough, bool indexed, bool *captured) {
+	*captured = false;
+	char *path = capture_path_expand(path_template);
+	if (!path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int fd = open(path, flags | O_CLOEXEC | O_NOCTTY, S_IRUSR | S_IWUSR);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		free(path);
+		return fd;
+	}
+
+	assert(capture_file_pending.fd == -1);
+	capture_file_pending.fd = fd;
+	capture_file_pending.flow = flow;
+	capture_file_pending.passthrough = passthrough;
+	capture_file_pending.path_template = strdup(path_template);
+	assert(capture_file_pending.path_template);
+	capture_file_pending.path = path;
+	capture_file_pending.open_flags = flags;
+	capture_file_pending.indexed = indexed;
+	*captured = true;
+	return fd;
+}
+
+bool capture_write(struct capture *capture, const struct packet *packet, const void *data, size_t len) {
+	// Returns false on failure, after on_error has run; the caller may
+	// have been freed by it.
+	if (capture_rotate_due(capture) && !capture_rotate(capture)) {
+		capture_error(capture);
+		return false;
+	}
+	if (capture->column) {
+		if (column_writer_add(capture->column, packet) && !capture_column_close(capture)) {
+			capture_error(capture);
+			return false;
+		}
+	} else if (capture->block) {
+		if (!block_writer_add(capture->block, packet, data, len)) {
+			// Block is full
+			if (!capture_block_close(capture)) {
+				capture_error(capture);
+				return false;
+			}
+			assert(block_writer_add(capture->block, packet, data, len));
+		}
+	} else if (!capture_append(capture, data, len)) {
+		capture_error(capture);
+		return false;
+	}
+
+	if (!capture_flush_ms) {
+		if (!capture_drain(capture, ZSTD_e_flush)) {
+			capture_error(capture);
+			return false;
+		}
+		return true;
+	}
+	if (!capture->flush_pending) {
+		capture->flush_pending = true;
+		wakeup_add(&capture->peer, capture_flush_ms);
+	}
+	return true;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct capture;
+struct flow;
+struct packet;
+struct peer;
+
+void capture_opts_add(void);
+void capture_init(void);
+struct capture *capture_new(int, const uint8_t *, struct peer *, bool);
+void capture_del(struct capture *);
+bool capture_write(struct capture *, const struct packet *, const void *, size_t);
+bool capture_file_wanted(const char *);
+int capture_file_open(const char *, int, struct flow *, void *, bool, bool *);
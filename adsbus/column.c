@@ -0,0 +1,507 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zstd.h>
+
+#include "packet.h"
+#include "uuid.h"
+
+#include "column.h"
+
+// All integers are little-endian.
+//
+// File header (may be repeated, e.g. after appending):
+//   0  magic "aDsBcol1"
+//   8  version (u32)
+//   12 reserved (u32)
+//
+// Row group:
+//   0  magic "aDcG"
+//   4  rows (u32)
+//   8  minimum mlat_timestamp (u64, 0 if none)
+//   16 maximum mlat_timestamp (u64, 0 if none)
+//   24 columns (u32)
+//   28 reserved (u32)
+//   32 columns * (column ID (u32), raw length (u32), compressed length (u32))
+//   then each column's zstd frame, in directory order
+//
+// Columns (unknown IDs are skipped by readers):
+//   sources: source_id dictionary for this group, UUID_LEN bytes each
+//   source:  dictionary index (u16) per row
+//   type:    packet type (u8) per row
+//   hops:    varint per row
+//   mlat:    zigzag varint delta from the previous row (first from 0)
+//   rssi:    u32 per row
+//   payload: packet_payload_len[type] bytes per row
+
+#define COLUMN_VERSION 1
+#define COLUMN_GROUP_HEADER_LEN 32
+#define COLUMN_DIRECTORY_ENTRY_LEN 12
+#define COLUMN_SOURCES_MAX UINT16_MAX
+
+enum column_id {
+	COLUMN_SOURCES,
+	COLUMN_SOURCE,
+	COLUMN_TYPE,
+	COLUMN_HOPS,
+	COLUMN_MLAT,
+	COLUMN_RSSI,
+	COLUMN_PAYLOAD,
+	NUM_COLUMNS,
+};
+
+static const uint8_t column_file_magic[] = "aDsBcol1";
+static const uint8_t column_group_magic[] = "aDcG";
+
+struct column_buf {
+	uint8_t *data;
+	size_t length;
+	size_t size;
+};
+
+struct column_writer {
+	uint32_t rows_max;
+	int level;
+	ZSTD_CCtx *cctx;
+	bool closed;
+	uint32_t rows;
+	uint64_t mlat_min;
+	uint64_t mlat_max;
+	uint64_t mlat_last;
+	uint16_t num_sources;
+	uint16_t source_last;
+	struct column_buf columns[NUM_COLUMNS];
+	struct column_buf out;
+};
+
+struct column_reader {
+	const uint8_t *map;
+	size_t len;
+	size_t pos;
+	ZSTD_DCtx *dctx;
+	const char *error;
+
+	uint32_t rows;
+	uint32_t row;
+	bool loaded;
+	const uint8_t *chunks[NUM_COLUMNS];
+	size_t raw_lengths[NUM_COLUMNS];
+	size_t compressed_lengths[NUM_COLUMNS];
+	struct column_buf columns[NUM_COLUMNS];
+	uint64_t *mlat;
+	uint32_t *hops;
+	size_t *payload_offsets;
+	size_t rows_size;
+};
+
+static void column_put32(uint8_t *out, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		out[i] = (uint8_t) (value >> (i * 8));
+	}
+}
+
+static void column_put64(uint8_t *out, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		out[i] = (uint8_t) (value >> (i * 8));
+	}
+}
+
+static uint32_t column_get32(const uint8_t *in) {
+	uint32_t value = 0;
+	for (int i = 3; i >= 0; i--) {
+		value = (value << 8) | in[i];
+	}
+	return value;
+}
+
+static uint64_t column_get64(const uint8_t *in) {
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--) {
+		value = (value << 8) | in[i];
+	}
+	return value;
+}
+
+static uint8_t *column_buf_reserve(struct column_buf *buf, size_t len) {
+	if (buf->length + len > buf->size) {
+		while (buf->length + len > buf->size) {
+			buf->size = buf->size ? buf->size * 2 : 4096;
+		}
+		buf->data = realloc(buf->data, buf->size);
+		assert(buf->data);
+	}
+	uint8_t *ret = &buf->data[buf->length];
+	buf->length += len;
+	return ret;
+}
+
+static void column_buf_append(struct column_buf *buf, const void *data, size_t len) {
+	memcpy(column_buf_reserve(buf, len), data, len);
+}
+
+static void column_buf_varint(struct column_buf *buf, uint64_t value) {
+	uint8_t tmp[10];
+	size_t len = 0;
+	do {
+		tmp[len] = (uint8_t) (value & 0x7f);
+		value >>= 7;
+		if (value) {
+			tmp[len] |= 0x80;
+		}
+		len++;
+	} while (value);
+	column_buf_append(buf, tmp, len);
+}
+
+static bool column_get_varint(const uint8_t **iter, const uint8_t *end, uint64_t *value) {
+	*value = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (*iter == end) {
+			return false;
+		}
+		uint8_t byte = *(*iter)++;
+		*value |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void column_writer_reset(struct column_writer *writer) {
+	writer->closed = false;
+	writer->rows = 0;
+	writer->mlat_min = UINT64_MAX;
+	writer->mlat_max = 0;
+	writer->mlat_last = 0;
+	writer->num_sources = 0;
+	writer->source_last = 0;
+	for (int i = 0; i < NUM_COLUMNS; i++) {
+		writer->columns[i].length = 0;
+	}
+}
+
+static uint16_t column_writer_source(struct column_writer *writer, const uint8_t *source_id) {
+	const uint8_t *sources = writer->columns[COLUMN_SOURCES].data;
+	// Consecutive packets usually share a source
+	if (writer->num_sources && !memcmp(&sources[writer->source_last * UUID_LEN], source_id, UUID_LEN)) {
+		return writer->source_last;
+	}
+	for (uint16_t i = 0; i < writer->num_sources; i++) {
+		if (!memcmp(&sources[i * UUID_LEN], source_id, UUID_LEN)) {
+			writer->source_last = i;
+			return i;
+		}
+	}
+	column_buf_append(&writer->columns[COLUMN_SOURCES], source_id, UUID_LEN);
+	writer->source_last = writer->num_sources++;
+	return writer->source_last;
+}
+
+struct column_writer *column_writer_new(uint32_t rows_max, int level) {
+	struct column_writer *writer = malloc(sizeof(*writer));
+	assert(writer);
+	writer->rows_max = rows_max;
+	writer->level = level;
+	writer->cctx = ZSTD_createCCtx();
+	assert(writer->cctx);
+	memset(writer->columns, 0, sizeof(writer->columns));
+	memset(&writer->out, 0, sizeof(writer->out));
+	column_writer_reset(writer);
+	return writer;
+}
+
+void column_writer_del(struct column_writer *writer) {
+	for (int i = 0; i < NUM_COLUMNS; i++) {
+		free(writer->columns[i].data);
+	}
+	free(writer->out.data);
+	ZSTD_freeCCtx(writer->cctx);
+	free(writer);
+}
+
+void column_writer_start(uint8_t *out) {
+	memcpy(out, column_file_magic, 8);
+	column_put32(&out[8], COLUMN_VERSION);
+	column_put32(&out[12], 0);
+}
+
+bool column_writer_add(struct column_writer *writer, const struct packet *packet) {
+	// Returns true when the group is full and should be closed.
+	if (writer->closed) {
+		column_writer_reset(writer);
+	}
+	uint16_t source = column_writer_source(writer, packet->source_id);
+	uint8_t tmp[4] = {
+		(uint8_t) source,
+		(uint8_t) (source >> 8),
+	};
+	column_buf_append(&writer->columns[COLUMN_SOURCE], tmp, 2);
+	tmp[0] = (uint8_t) packet->type;
+	column_buf_append(&writer->columns[COLUMN_TYPE], tmp, 1);
+	column_buf_varint(&writer->columns[COLUMN_HOPS], packet->hops);
+	int64_t delta = (int64_t) (packet->mlat_timestamp - writer->mlat_last);
+	column_buf_varint(&writer->columns[COLUMN_MLAT], ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+	writer->mlat_last = packet->mlat_timestamp;
+	column_put32(tmp, packet->rssi);
+	column_buf_append(&writer->columns[COLUMN_RSSI], tmp, 4);
+	column_buf_append(&writer->columns[COLUMN_PAYLOAD], packet->payload, packet_payload_len[packet->type]);
+
+	if (packet->mlat_timestamp) {
+		writer->mlat_min = packet->mlat_timestamp < writer->mlat_min ? packet->mlat_timestamp : writer->mlat_min;
+		writer->mlat_max = packet->mlat_timestamp > writer->mlat_max ? packet->mlat_timestamp : writer->mlat_max;
+	}
+	writer->rows++;
+	return writer->rows >= writer->rows_max || writer->num_sources == COLUMN_SOURCES_MAX;
+}
+
+bool column_writer_empty(const struct column_writer *writer) {
+	return writer->closed || !writer->rows;
+}
+
+size_t column_writer_close(struct column_writer *writer, const uint8_t **out) {
+	assert(!column_writer_empty(writer));
+	size_t bound = COLUMN_GROUP_HEADER_LEN + NUM_COLUMNS * COLUMN_DIRECTORY_ENTRY_LEN;
+	for (int i = 0; i < NUM_COLUMNS; i++) {
+		bound += ZSTD_compressBound(writer->columns[i].length);
+	}
+	writer->out.length = 0;
+	uint8_t *header = column_buf_reserve(&writer->out, bound);
+
+	memcpy(header, column_group_magic, 4);
+	column_put32(&header[4], writer->rows);
+	column_put64(&header[8], writer->mlat_max ? writer->mlat_min : 0);
+	column_put64(&header[16], writer->mlat_max);
+	column_put32(&header[24], NUM_COLUMNS);
+	column_put32(&header[28], 0);
+
+	size_t offset = COLUMN_GROUP_HEADER_LEN + NUM_COLUMNS * COLUMN_DIRECTORY_ENTRY_LEN;
+	for (int i = 0; i < NUM_COLUMNS; i++) {
+		size_t compressed = ZSTD_compressCCtx(writer->cctx, &header[offset], bound - offset, writer->columns[i].data, writer->columns[i].length, writer->level);
+		assert(!ZSTD_isError(compressed));
+		uint8_t *entry = &header[COLUMN_GROUP_HEADER_LEN + (size_t) i * COLUMN_DIRECTORY_ENTRY_LEN];
+		column_put32(&entry[0], (uint32_t) i);
+		column_put32(&entry[4], (uint32_t) writer->columns[i].length);
+		column_put32(&entry[8], (uint32_t) compressed);
+		offset += compressed;
+	}
+
+	// Contents stay valid until the next column_writer_add()
+	writer->closed = true;
+	*out = writer->out.data;
+	return offset;
+}
+
+bool column_detect(const uint8_t *map, size_t len) {
+	return len >= COLUMN_FILE_HEADER_LEN && !memcmp(map, column_file_magic, 8);
+}
+
+struct column_reader *column_reader_new(const uint8_t *map, size_t len) {
+	struct column_reader *reader = malloc(sizeof(*reader));
+	assert(reader);
+	memset(reader, 0, sizeof(*reader));
+	reader->map = map;
+	reader->len = len;
+	reader->dctx = ZSTD_createDCtx();
+	assert(reader->dctx);
+	return reader;
+}
+
+void column_reader_del(struct column_reader *reader) {
+	for (int i = 0; i < NUM_COLUMNS; i++) {
+		free(reader->columns[i].data);
+	}
+	free(reader->mlat);
+	free(reader->hops);
+	free(reader->payload_offsets);
+	ZSTD_freeDCtx(reader->dctx);
+	free(reader);
+}
+
+const char *column_reader_error(const struct column_reader *reader) {
+	return reader->error;
+}
+
+static bool column_reader_fail(struct column_reader *reader, const char *error) {
+	reader->error = error;
+	return false;
+}
+
+static bool column_reader_decompress(struct column_reader *reader, enum column_id id) {
+	struct column_buf *buf = &reader->columns[id];
+	buf->length = 0;
+	uint8_t *out = column_buf_reserve(buf, reader->raw_lengths[id] ? reader->raw_lengths[id] : 1);
+	size_t ret = ZSTD_decompressDCtx(reader->dctx, out, reader->raw_lengths[id], reader->chunks[id], reader->compressed_lengths[id]);
+	if (ZSTD_isError(ret) || ret != reader->raw_lengths[id]) {
+		return column_reader_fail(reader, "corrupt column");
+	}
+	buf->length = ret;
+	return true;
+}
+
+static bool column_reader_parse_group(struct column_reader *reader, uint64_t *mlat_min, uint64_t *mlat_max) {
+	const uint8_t *header = &reader->map[reader->pos];
+	size_t remaining = reader->len - reader->pos;
+	if (remaining < COLUMN_GROUP_HEADER_LEN || memcmp(header, column_group_magic, 4)) {
+		return column_reader_fail(reader, "bad row group header");
+	}
+	uint32_t columns = column_get32(&header[24]);
+	if (columns > (remaining - COLUMN_GROUP_HEADER_LEN) / COLUMN_DIRECTORY_ENTRY_LEN) {
+		return column_reader_fail(reader, "truncated row group");
+	}
+	reader->rows = column_get32(&header[4]);
+	*mlat_min = column_get64(&header[8]);
+	*mlat_max = column_get64(&header[16]);
+
+	memset(reader->chunks, 0, sizeof(reader->chunks));
+	size_t offset = COLUMN_GROUP_HEADER_LEN + columns * COLUMN_DIRECTORY_ENTRY_LEN;
+	for (uint32_t i = 0; i < columns; i++) {
+		const uint8_t *entry = &header[COLUMN_GROUP_HEADER_LEN + i * COLUMN_DIRECTORY_ENTRY_LEN];
+		uint32_t id = column_get32(&entry[0]);
+		size_t compressed = column_get32(&entry[8]);
+		if (compressed > remaining - offset) {
+			return column_reader_fail(reader, "truncated row group");
+		}
+		if (id < NUM_COLUMNS) {
+			reader->chunks[id] = &header[offset];
+			reader->raw_lengths[id] = column_get32(&entry[4]);
+			reader->compressed_lengths[id] = compressed;
+		}
+		offset += compressed;
+	}
+	for (int i = 0; i < NUM_COLUMNS; i++) {
+		if (!reader->chunks[i]) {
+			return column_reader_fail(reader, "missing column");
+		}
+	}
+	reader->pos += offset;
+	return true;
+}
+
+static bool column_reader_load_mlat(struct column_reader *reader) {
+	// rows comes straight from the group header; hold it to the fixed-width
+	// columns' lengths in the directory before sizing anything by it.
+	// Every mlat varint takes at least one byte.
+	if (reader->raw_lengths[COLUMN_TYPE] != reader->rows ||
+			reader->raw_lengths[COLUMN_SOURCE] != (size_t) reader->rows * 2 ||
+			reader->raw_lengths[COLUMN_RSSI] != (size_t) reader->rows * 4 ||
+			reader->raw_lengths[COLUMN_MLAT] < reader->rows) {
+		return column_reader_fail(reader, "column length mismatch");
+	}
+	if (reader->rows > reader->rows_size) {
+		reader->rows_size = reader->rows;
+		reader->mlat = realloc(reader->mlat, reader->rows_size * sizeof(*reader->mlat));
+		reader->hops = realloc(reader->hops, reader->rows_size * sizeof(*reader->hops));
+		reader->payload_offsets = realloc(reader->payload_offsets, reader->rows_size * sizeof(*reader->payload_offsets));
+		assert(reader->mlat);
+		assert(reader->hops);
+		assert(reader->payload_offsets);
+	}
+	if (!column_reader_decompress(reader, COLUMN_MLAT)) {
+		return false;
+	}
+	const uint8_t *iter = reader->columns[COLUMN_MLAT].data;
+	const uint8_t *end = iter + reader->columns[COLUMN_MLAT].length;
+	uint64_t last = 0;
+	for (uint32_t i = 0; i < reader->rows; i++) {
+		uint64_t zigzag;
+		if (!column_get_varint(&iter, end, &zigzag)) {
+			return column_reader_fail(reader, "corrupt mlat column");
+		}
+		last += (zigzag >> 1) ^ (0 - (zigzag & 1));
+		reader->mlat[i] = last;
+	}
+	return true;
+}
+
+static bool column_reader_load_rest(struct column_reader *reader) {
+	// Only decoded once a row in the group is actually wanted
+	static const enum column_id ids[] = { COLUMN_SOURCES, COLUMN_SOURCE, COLUMN_TYPE, COLUMN_HOPS, COLUMN_RSSI, COLUMN_PAYLOAD };
+	for (size_t i = 0; i < sizeof(ids) / sizeof(*ids); i++) {
+		if (!column_reader_decompress(reader, ids[i])) {
+			return false;
+		}
+	}
+	size_t num_sources = reader->columns[COLUMN_SOURCES].length / UUID_LEN;
+	if (reader->columns[COLUMN_SOURCE].length != (size_t) reader->rows * 2 ||
+			reader->columns[COLUMN_TYPE].length != reader->rows ||
+			reader->columns[COLUMN_RSSI].length != (size_t) reader->rows * 4) {
+		return column_reader_fail(reader, "column length mismatch");
+	}
+
+	const uint8_t *hops = reader->columns[COLUMN_HOPS].data;
+	const uint8_t *hops_end = hops + reader->columns[COLUMN_HOPS].length;
+	size_t payload_offset = 0;
+	for (uint32_t i = 0; i < reader->rows; i++) {
+		uint8_t type = reader->columns[COLUMN_TYPE].data[i];
+		const uint8_t *source = &reader->columns[COLUMN_SOURCE].data[i * 2];
+		uint64_t hop;
+		if (type == PACKET_TYPE_NONE || type >= NUM_TYPES ||
+				(size_t) (source[0] | (source[1] << 8)) >= num_sources ||
+				!column_get_varint(&hops, hops_end, &hop) || hop > UINT32_MAX) {
+			return column_reader_fail(reader, "corrupt row");
+		}
+		reader->hops[i] = (uint32_t) hop;
+		reader->payload_offsets[i] = payload_offset;
+		payload_offset += packet_payload_len[type];
+	}
+	if (payload_offset != reader->columns[COLUMN_PAYLOAD].length) {
+		return column_reader_fail(reader, "column length mismatch");
+	}
+	reader->loaded = true;
+	return true;
+}
+
+static bool column_reader_load(struct column_reader *reader, uint64_t start, uint64_t end, bool all) {
+	while (reader->pos < reader->len) {
+		if (column_detect(&reader->map[reader->pos], reader->len - reader->pos)) {
+			reader->pos += COLUMN_FILE_HEADER_LEN;
+			continue;
+		}
+		uint64_t mlat_min, mlat_max;
+		if (!column_reader_parse_group(reader, &mlat_min, &mlat_max)) {
+			return false;
+		}
+		if (!all && (!mlat_max || mlat_max < start || mlat_min > end)) {
+			// Skip without decompressing anything
+			continue;
+		}
+		reader->row = 0;
+		reader->loaded = false;
+		return column_reader_load_mlat(reader);
+	}
+	return false;
+}
+
+bool column_reader_next(struct column_reader *reader, struct packet *packet, uint64_t start, uint64_t end) {
+	bool all = (start == 0 && end == UINT64_MAX);
+	while (true) {
+		if (reader->error) {
+			return false;
+		}
+		if (reader->row == reader->rows) {
+			reader->rows = reader->row = 0;
+			if (!column_reader_load(reader, start, end, all)) {
+				return false;
+			}
+			continue;
+		}
+		uint32_t row = reader->row++;
+		if (!all && (reader->mlat[row] < start || reader->mlat[row] > end)) {
+			continue;
+		}
+		if (!reader->loaded && !column_reader_load_rest(reader)) {
+			return false;
+		}
+
+		const uint8_t *source = &reader->columns[COLUMN_SOURCE].data[row * 2];
+		packet->source_id = &reader->columns[COLUMN_SOURCES].data[(size_t) (source[0] | (source[1] << 8)) * UUID_LEN];
+		packet->type = (enum packet_type) reader->columns[COLUMN_TYPE].data[row];
+		packet->hops = reader->hops[row];
+		packet->mlat_timestamp = reader->mlat[row];
+		packet->rssi = column_get32(&reader->columns[COLUMN_RSSI].data[row * 4]);
+		memcpy(packet->payload, &reader->columns[COLUMN_PAYLOAD].data[reader->payload_offsets[row]], packet_payload_len[packet->type]);
+		return true;
+	}
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct packet;
+
+// Columnar archive: a file header, then row groups that store each packet
+// field as a separately zstd-compressed column chunk.
+#define COLUMN_FILE_HEADER_LEN 16
+
+struct column_writer;
+struct column_reader;
+
+struct column_writer *column_writer_new(uint32_t, int);
+void column_writer_del(struct column_writer *);
+void column_writer_start(uint8_t *);
+bool __attribute__ ((warn_unused_result)) column_writer_add(struct column_writer *, const struct packet *);
+bool column_writer_empty(const struct column_writer *);
+size_t column_writer_close(struct column_writer *, const uint8_t **);
+
+bool column_detect(const uint8_t *, size_t);
+struct column_reader *column_reader_new(const uint8_t *, size_t);
+void column_reader_del(struct column_reader *);
+bool column_reader_next(struct column_reader *, struct packet *, uint64_t, uint64_t);
+const char *column_reader_error(const struct column_reader *);
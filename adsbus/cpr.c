@@ -0,0 +1,261 @@
+#include <stdlib.h>
+
+#include "crc.h"
+#include "icaotable.h"
+#include "monotime.h"
+#include "opts.h"
+#include "packet.h"
+
+#include "cpr.h"
+
+// Decodes Compact Position Reporting from DF17/18 airborne and surface
+// position messages, keeping the latest position per ICAO address.
+// Global decoding pairs an even and an odd frame; after that, single
+// frames are decoded locally against the last position. Nothing is
+// tracked until a consumer calls cpr_enable().
+
+struct cpr_frame {
+	uint32_t lat;
+	uint32_t lon;
+	uint64_t ns;
+};
+
+struct cpr_aircraft {
+	uint32_t icao;
+	uint64_t seen_ns;
+	bool surface;
+	struct cpr_frame frames[2];
+	bool have_position;
+	double lat;
+	double lon;
+	uint64_t position_ns;
+};
+
+static opts_group cpr_opts;
+
+#define CPR_TABLE_SIZE_MIN 1024
+// Even/odd frames further apart than this may be from different zones
+#define CPR_PAIR_AIRBORNE_NS (10 * NS_PER_S)
+#define CPR_PAIR_SURFACE_NS (25 * NS_PER_S)
+// How long a position stays usable, as a local decode reference and for
+// callers of cpr_position()
+#define CPR_POSITION_NS (60 * NS_PER_S)
+// Aircraft not heard from for this long are forgotten when the table grows
+#define CPR_EXPIRE_NS (300 * NS_PER_S)
+
+static struct icaotable cpr_table = ICAOTABLE_INIT(struct cpr_aircraft, CPR_TABLE_SIZE_MIN, CPR_EXPIRE_NS, NULL);
+static bool cpr_enabled = false;
+static bool cpr_have_reference = false;
+static double cpr_reference_lat, cpr_reference_lon;
+
+// Latitudes at which the number of longitude zones drops, from 59 down
+static const double cpr_nl_table[] = {
+	10.47047130, 14.82817437, 18.18626357, 21.02939493, 23.54504487,
+	25.82924707, 27.93898710, 29.91135686, 31.77209708, 33.53993436,
+	35.22899598, 36.85025108, 38.41241892, 39.92256684, 41.38651832,
+	42.80914012, 44.19454951, 45.54626723, 46.86733252, 48.16039128,
+	49.42776439, 50.67150166, 51.89342469, 53.09516153, 54.27817472,
+	55.44378444, 56.59318756, 57.72747354, 58.84763776, 59.95459277,
+	61.04917774, 62.13216659, 63.20427479, 64.26616523, 65.31845310,
+	66.36171008, 67.39646774, 68.42322022, 69.44242631, 70.45451075,
+	71.45986473, 72.45884545, 73.45177442, 74.43893416, 75.42056257,
+	76.39684391, 77.36789461, 78.33374083, 79.29428225, 80.24923213,
+	81.19801349, 82.13956981, 83.07199445, 83.99173563, 84.89166191,
+	85.75541621, 86.53536998, 87.00000000,
+};
+#define CPR_NL_MAX 59
+
+static bool cpr_set_reference(const char *arg) {
+	char *end;
+	cpr_reference_lat = strtod(arg, &end);
+	if (*end != ',') {
+		return false;
+	}
+	cpr_reference_lon = strtod(end + 1, &end);
+	if (*end || cpr_reference_lat < -90 || cpr_reference_lat > 90 || cpr_reference_lon < -180 || cpr_reference_lon > 180) {
+		return false;
+	}
+	cpr_have_reference = true;
+	return true;
+}
+
+static double cpr_floor(double x) {
+	double t = (double) (int64_t) x;
+	return t > x ? t - 1 : t;
+}
+
+static double cpr_mod(double x, double y) {
+	return x - y * cpr_floor(x / y);
+}
+
+static int cpr_nl(double lat) {
+	if (lat < 0) {
+		lat = -lat;
+	}
+	for (size_t i = 0; i < sizeof(cpr_nl_table) / sizeof(*cpr_nl_table); i++) {
+		if (lat < cpr_nl_table[i]) {
+			return CPR_NL_MAX - (int) i;
+		}
+	}
+	return 1;
+}
+
+static double cpr_closest(double value, double ref, double period) {
+	// value + k * period nearest to ref
+	return value + period * cpr_floor((ref - value) / period + 0.5);
+}
+
+static bool cpr_decode_global(struct cpr_aircraft *aircraft, int latest, double *lat_out, double *lon_out) {
+	double span = aircraft->surface ? 90.0 : 360.0;
+	double lat_e = aircraft->frames[0].lat / 131072.0, lat_o = aircraft->frames[1].lat / 131072.0;
+	double lon_e = aircraft->frames[0].lon / 131072.0, lon_o = aircraft->frames[1].lon / 131072.0;
+
+	double j = cpr_floor(59 * lat_e - 60 * lat_o + 0.5);
+	double rlat_e = span / 60 * (cpr_mod(j, 60) + lat_e);
+	double rlat_o = span / 59 * (cpr_mod(j, 59) + lat_o);
+
+	double ref_lat = 0, ref_lon = 0;
+	if (aircraft->surface) {
+		// Surface zones repeat every 90 degrees; pick the copy nearest a
+		// known position.
+		if (aircraft->have_position) {
+			ref_lat = aircraft->lat;
+			ref_lon = aircraft->lon;
+		} else if (cpr_have_reference) {
+			ref_lat = cpr_reference_lat;
+			ref_lon = cpr_reference_lon;
+		} else {
+			return false;
+		}
+		rlat_e = cpr_closest(rlat_e, ref_lat, 90);
+		rlat_o = cpr_closest(rlat_o, ref_lat, 90);
+	} else {
+		if (rlat_e >= 270) {
+			rlat_e -= 360;
+		}
+		if (rlat_o >= 270) {
+			rlat_o -= 360;
+		}
+	}
+	if (rlat_e < -90 || rlat_e > 90 || rlat_o < -90 || rlat_o > 90) {
+		return false;
+	}
+	if (cpr_nl(rlat_e) != cpr_nl(rlat_o)) {
+		// Straddling a zone boundary; wait for another pair
+		return false;
+	}
+
+	double rlat = latest ? rlat_o : rlat_e;
+	int nl = cpr_nl(rlat);
+	int ni = nl - latest > 1 ? nl - latest : 1;
+	double m = cpr_floor(lon_e * (nl - 1) - lon_o * nl + 0.5);
+	double rlon = span / ni * (cpr_mod(m, ni) + (latest ? lon_o : lon_e));
+	if (aircraft->surface) {
+		rlon = cpr_closest(rlon, ref_lon, 90);
+	}
+	rlon = cpr_mod(rlon + 180, 360) - 180;
+
+	*lat_out = rlat;
+	*lon_out = rlon;
+	return true;
+}
+
+static void cpr_decode_local(struct cpr_aircraft *aircraft, int odd, double ref_lat, double ref_lon, double *lat_out, double *lon_out) {
+	double span = aircraft->surface ? 90.0 : 360.0;
+	double lat_cpr = aircraft->frames[odd].lat / 131072.0, lon_cpr = aircraft->frames[odd].lon / 131072.0;
+
+	double dlat = span / (60 - odd);
+	double j = cpr_floor(ref_lat / dlat) + cpr_floor(cpr_mod(ref_lat, dlat) / dlat - lat_cpr + 0.5);
+	double rlat = dlat * (j + lat_cpr);
+
+	int ni = cpr_nl(rlat) - odd > 1 ? cpr_nl(rlat) - odd : 1;
+	double dlon = span / ni;
+	double m = cpr_floor(ref_lon / dlon) + cpr_floor(cpr_mod(ref_lon, dlon) / dlon - lon_cpr + 0.5);
+	double rlon = dlon * (m + lon_cpr);
+
+	*lat_out = rlat;
+	*lon_out = cpr_mod(rlon + 180, 360) - 180;
+}
+
+void cpr_opts_add() {
+	opts_add("cpr-reference", "LAT,LON", cpr_set_reference, cpr_opts);
+}
+
+void cpr_init() {
+	opts_call(cpr_opts);
+}
+
+void cpr_cleanup() {
+	icaotable_cleanup(&cpr_table);
+}
+
+void cpr_enable() {
+	cpr_enabled = true;
+}
+
+bool cpr_update(const struct packet *packet) {
+	// Returns true if packet yielded a new position
+	if (!cpr_enabled || packet->type != PACKET_TYPE_MODE_S_LONG || packet->crc_invalid) {
+		return false;
+	}
+	const uint8_t *payload = packet->payload;
+	uint8_t df = payload[0] >> 3;
+	if (df != 17 && !(df == 18 && (payload[0] & 0x7) == 0)) {
+		return false;
+	}
+	uint8_t tc = payload[4] >> 3;
+	bool surface;
+	if (tc >= 5 && tc <= 8) {
+		surface = true;
+	} else if ((tc >= 9 && tc <= 18) || (tc >= 20 && tc <= 22)) {
+		surface = false;
+	} else {
+		return false;
+	}
+	// --crc-policy=pass leaves bad frames unmarked
+	if (crc_syndrome(payload, PACKET_PAYLOAD_LEN_MAX)) {
+		return false;
+	}
+
+	uint64_t now = monotime_coarse_ns();
+	uint32_t icao = (uint32_t) payload[1] << 16 | (uint32_t) payload[2] << 8 | payload[3];
+	struct cpr_aircraft *aircraft = icaotable_get(&cpr_table, icao, now, true);
+	aircraft->seen_ns = now;
+	if (aircraft->surface != surface) {
+		// Frames of the other kind don't pair with these
+		aircraft->frames[0].ns = aircraft->frames[1].ns = 0;
+		aircraft->surface = surface;
+	}
+
+	int odd = (payload[6] >> 2) & 1;
+	struct cpr_frame *frame = &aircraft->frames[odd];
+	frame->lat = (uint32_t) (payload[6] & 0x3) << 15 | (uint32_t) payload[7] << 7 | payload[8] >> 1;
+	frame->lon = (uint32_t) (payload[8] & 0x1) << 16 | (uint32_t) payload[9] << 8 | payload[10];
+	frame->ns = now;
+
+	double lat, lon;
+	struct cpr_frame *other = &aircraft->frames[!odd];
+	if (other->ns && now - other->ns <= (surface ? CPR_PAIR_SURFACE_NS : CPR_PAIR_AIRBORNE_NS) && cpr_decode_global(aircraft, odd, &lat, &lon)) {
+		// Decoded from a pair
+	} else if (aircraft->have_position && now - aircraft->position_ns <= CPR_POSITION_NS) {
+		cpr_decode_local(aircraft, odd, aircraft->lat, aircraft->lon, &lat, &lon);
+	} else {
+		return false;
+	}
+	aircraft->have_position = true;
+	aircraft->lat = lat;
+	aircraft->lon = lon;
+	aircraft->position_ns = now;
+	return true;
+}
+
+bool cpr_position(uint32_t icao, double *lat, double *lon) {
+	uint64_t now = monotime_coarse_ns();
+	struct cpr_aircraft *aircraft = icaotable_get(&cpr_table, icao, now, false);
+	if (!aircraft || !aircraft->have_position || now - aircraft->position_ns > CPR_POSITION_NS) {
+		return false;
+	}
+	*lat = aircraft->lat;
+	*lon = aircraft->lon;
+	return true;
+}
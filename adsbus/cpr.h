@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct packet;
+
+void cpr_opts_add(void);
+void cpr_init(void);
+void cpr_cleanup(void);
+void cpr_enable(void);
+bool cpr_update(const struct packet *);
+bool cpr_position(uint32_t, double *, double *);
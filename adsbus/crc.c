@@ -0,0 +1,216 @@
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+#include "opts.h"
+#include "packet.h"
+#include "sourcetable.h"
+#include "uuid.h"
+
+#include "crc.h"
+
+// Mode-S parity: CRC-24 (generator 0x1FFF409) over everything but the last
+// 24 bits, XORed into them. Only DF11/17/18 carry plain parity; the other
+// formats overlay it with the address, so we can't check them here.
+// Results are counted per source and logged at exit.
+
+struct crc_source {
+	uint8_t id[UUID_LEN];
+	struct crc_counts counts;
+};
+
+static opts_group crc_opts;
+
+static char log_module = 'C';
+
+#define CRC_POLY 0xfff409
+#define CRC_MASK 0xffffff
+#define CRC_LONG_BITS 112
+// Syndrome -> bit table for single-bit errors in long frames
+#define CRC_SYNDROME_SIZE 256
+
+static enum {
+	CRC_POLICY_PASS,
+	CRC_POLICY_MARK,
+	CRC_POLICY_DROP,
+} crc_policy = CRC_POLICY_PASS;
+static bool crc_correct = false;
+static struct sourcetable crc_sources = SOURCETABLE_INIT(struct crc_source);
+
+// Slicing-by-4: crc_table[k][b] is b * x^(24 + 8k) mod P
+static uint32_t crc_table[4][256];
+
+static struct {
+	uint32_t syndrome;
+	int8_t bit;
+} crc_syndromes[CRC_SYNDROME_SIZE];
+
+static bool crc_set_policy(const char *arg) {
+	if (!strcasecmp(arg, "pass")) {
+		crc_policy = CRC_POLICY_PASS;
+		return true;
+	}
+	if (!strcasecmp(arg, "mark")) {
+		crc_policy = CRC_POLICY_MARK;
+		return true;
+	}
+	if (!strcasecmp(arg, "drop")) {
+		crc_policy = CRC_POLICY_DROP;
+		return true;
+	}
+	return false;
+}
+
+static bool crc_set_correct(const char __attribute__ ((unused)) *arg) {
+	crc_correct = true;
+	return true;
+}
+
+uint32_t crc_syndrome(const uint8_t *payload, size_t len) {
+	// Returns 0 for a frame with good parity
+	size_t data_len = len - 3;
+	uint32_t crc = 0;
+	size_t i = 0;
+	for (; i + 4 <= data_len; i += 4) {
+		uint32_t v = (crc << 8) ^ ((uint32_t) payload[i] << 24 | (uint32_t) payload[i + 1] << 16 | (uint32_t) payload[i + 2] << 8 | payload[i + 3]);
+		crc = crc_table[3][v >> 24] ^ crc_table[2][(v >> 16) & 0xff] ^ crc_table[1][(v >> 8) & 0xff] ^ crc_table[0][v & 0xff];
+	}
+	for (; i < data_len; i++) {
+		crc = ((crc << 8) ^ crc_table[0][((crc >> 16) ^ payload[i]) & 0xff]) & CRC_MASK;
+	}
+	return crc ^ ((uint32_t) payload[data_len] << 16 | (uint32_t) payload[data_len + 1] << 8 | payload[data_len + 2]);
+}
+
+static size_t crc_syndrome_slot(uint32_t syndrome) {
+	return (syndrome ^ (syndrome >> 8) ^ (syndrome >> 16)) & (CRC_SYNDROME_SIZE - 1);
+}
+
+static int crc_syndrome_lookup(uint32_t syndrome) {
+	for (size_t i = crc_syndrome_slot(syndrome);; i = (i + 1) & (CRC_SYNDROME_SIZE - 1)) {
+		if (crc_syndromes[i].bit < 0) {
+			return -1;
+		}
+		if (crc_syndromes[i].syndrome == syndrome) {
+			return crc_syndromes[i].bit;
+		}
+	}
+}
+
+static void crc_init_tables() {
+	for (uint32_t b = 0; b < 256; b++) {
+		uint32_t crc = b << 16;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc & 0x800000) ? ((crc << 1) ^ CRC_POLY) : (crc << 1);
+		}
+		crc_table[0][b] = crc & CRC_MASK;
+	}
+	for (int k = 1; k < 4; k++) {
+		for (uint32_t b = 0; b < 256; b++) {
+			uint32_t prev = crc_table[k - 1][b];
+			crc_table[k][b] = ((prev << 8) ^ crc_table[0][prev >> 16]) & CRC_MASK;
+		}
+	}
+
+	for (size_t i = 0; i < CRC_SYNDROME_SIZE; i++) {
+		crc_syndromes[i].bit = -1;
+	}
+	uint8_t frame[CRC_LONG_BITS / 8];
+	for (int bit = 0; bit < CRC_LONG_BITS; bit++) {
+		memset(frame, 0, sizeof(frame));
+		frame[bit / 8] = (uint8_t) (0x80 >> (bit % 8));
+		uint32_t syndrome = crc_syndrome(frame, sizeof(frame));
+		size_t slot = crc_syndrome_slot(syndrome);
+		while (crc_syndromes[slot].bit >= 0) {
+			assert(crc_syndromes[slot].syndrome != syndrome);
+			slot = (slot + 1) & (CRC_SYNDROME_SIZE - 1);
+		}
+		crc_syndromes[slot].syndrome = syndrome;
+		crc_syndromes[slot].bit = (int8_t) bit;
+	}
+}
+
+void crc_opts_add() {
+	opts_add("crc-policy", "pass|mark|drop", crc_set_policy, crc_opts);
+	opts_add("crc-correct", NULL, crc_set_correct, crc_opts);
+}
+
+void crc_init() {
+	opts_call(crc_opts);
+	crc_init_tables();
+}
+
+void crc_cleanup() {
+	struct crc_source *source;
+	size_t iter = 0;
+	while ((source = sourcetable_next(&crc_sources, &iter))) {
+		LOG(source->id, "Parity: %ju valid, %ju corrected, %ju invalid (%s)", (uintmax_t) source->counts.valid, (uintmax_t) source->counts.corrected, (uintmax_t) source->counts.invalid, crc_policy == CRC_POLICY_DROP ? "dropped" : "marked");
+	}
+	sourcetable_cleanup(&crc_sources);
+}
+
+static bool crc_packet_syndrome(const struct packet *packet, uint32_t *syndrome) {
+	// Returns false for frames without a checkable parity field
+	if (packet->type == PACKET_TYPE_MODE_AC) {
+		return false;
+	}
+	uint8_t df = packet->payload[0] >> 3;
+	if (df == 11 && packet->type == PACKET_TYPE_MODE_S_SHORT) {
+		// Low 7 bits may be an interrogator code
+		*syndrome = crc_syndrome(packet->payload, 7) & ~UINT32_C(0x7f);
+		return true;
+	}
+	if ((df == 17 || df == 18) && packet->type == PACKET_TYPE_MODE_S_LONG) {
+		*syndrome = crc_syndrome(packet->payload, 14);
+		return true;
+	}
+	return false;
+}
+
+bool crc_filter(struct packet *packet) {
+	// Returns false if the packet should be dropped
+	uint32_t syndrome;
+	if (crc_policy == CRC_POLICY_PASS || !crc_packet_syndrome(packet, &syndrome)) {
+		return true;
+	}
+
+	struct crc_counts *counts = &((struct crc_source *) sourcetable_get(&crc_sources, packet->source_id))->counts;
+	if (!syndrome) {
+		counts->valid++;
+		return true;
+	}
+	if (crc_correct && packet->type == PACKET_TYPE_MODE_S_LONG) {
+		int bit = crc_syndrome_lookup(syndrome);
+		// A flip in the DF field would make this some other kind of frame
+		if (bit >= 5) {
+			packet->payload[bit / 8] ^= (uint8_t) (0x80 >> (bit % 8));
+			counts->corrected++;
+			return true;
+		}
+	}
+	counts->invalid++;
+	if (crc_policy == CRC_POLICY_DROP) {
+		return false;
+	}
+	packet->crc_invalid = true;
+	return true;
+}
+
+bool crc_valid(const struct packet *packet) {
+	// For +valid outputs. With --crc-policy=pass nothing was marked on the
+	// way in, so check parity here instead.
+	if (packet->crc_invalid) {
+		return false;
+	}
+	if (crc_policy != CRC_POLICY_PASS) {
+		return true;
+	}
+	uint32_t syndrome;
+	return !crc_packet_syndrome(packet, &syndrome) || !syndrome;
+}
+
+const struct crc_counts *crc_get_counts(const uint8_t *source_id) {
+	// NULL if nothing from this source has been checked
+	struct crc_source *source = sourcetable_find(&crc_sources, source_id);
+	return source ? &source->counts : NULL;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct packet;
+
+struct crc_counts {
+	uint64_t valid;
+	uint64_t corrected;
+	uint64_t invalid;
+};
+
+void crc_opts_add(void);
+void crc_init(void);
+void crc_cleanup(void);
+uint32_t crc_syndrome(const uint8_t *, size_t);
+bool crc_filter(struct packet *);
+bool crc_valid(const struct packet *);
+const struct crc_counts *crc_get_counts(const uint8_t *);
@@ -0,0 +1,298 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "monotime.h"
+#include "opts.h"
+#include "packet.h"
+#include "peer.h"
+#include "profile.h"
+#include "send.h"
+#include "server.h"
+#include "uuid.h"
+#include "wakeup.h"
+
+#include "dedup.h"
+
+// Suppresses copies of the same frame heard by several receivers, for
+// outputs that asked for it ("FORMAT+dedup"). Frames are keyed by a hash
+// of type and payload in an open-addressed table. Expiry is by generation:
+// the table in use is swapped out once per window, and the previous one
+// is still consulted, so nothing ever walks the table to evict entries.
+
+struct dedup_entry {
+	uint64_t hash;
+	uint64_t seen_ns;
+	uint64_t pending;
+};
+
+struct dedup_table {
+	struct dedup_entry *entries;
+	size_t size;
+	size_t count;
+	uint64_t start_ns;
+};
+
+struct dedup_pending {
+	uint64_t due_ns;
+	struct packet packet;
+	uint8_t source_id[UUID_LEN];
+	// For send's same-socket check; the input may be gone by release
+	dev_t input_dev;
+	ino_t input_ino;
+};
+
+static opts_group dedup_opts;
+
+static char log_module = 'D';
+
+#define DEDUP_TABLE_SIZE_MIN 4096
+#define DEDUP_PENDING_NONE UINT64_MAX
+
+static uint32_t dedup_window_ms = 500;
+static enum {
+	DEDUP_POLICY_FIRST,
+	DEDUP_POLICY_BEST_RSSI,
+} dedup_policy = DEDUP_POLICY_FIRST;
+
+static struct dedup_table dedup_tables[2];
+static struct dedup_table *dedup_current = &dedup_tables[0], *dedup_previous = &dedup_tables[1];
+
+// best-rssi holds each frame for the window; with a fixed window, release
+// order is arrival order, so a ring of absolute sequence numbers suffices.
+static struct dedup_pending *dedup_pending = NULL;
+static size_t dedup_pending_size = 0;
+static uint64_t dedup_pending_head = 0, dedup_pending_tail = 0;
+static struct peer dedup_peer;
+
+static struct dedup_counts dedup_stats;
+
+static bool dedup_set_window_ms(const char *arg) {
+	return opts_parse_uint32(arg, &dedup_window_ms) && dedup_window_ms > 0;
+}
+
+static bool dedup_set_policy(const char *arg) {
+	if (!strcasecmp(arg, "first")) {
+		dedup_policy = DEDUP_POLICY_FIRST;
+		return true;
+	}
+	if (!strcasecmp(arg, "best-rssi")) {
+		dedup_policy = DEDUP_POLICY_BEST_RSSI;
+		return true;
+	}
+	return false;
+}
+
+static uint64_t dedup_hash(const struct packet *packet) {
+	uint64_t words[2] = {0};
+	memcpy(words, packet->payload, packet_payload_len[packet->type]);
+	uint64_t hash = (uint64_t) packet->type;
+	for (size_t i = 0; i < 2; i++) {
+		hash = (hash ^ words[i]) * UINT64_C(0x9e3779b97f4a7c15);
+		hash ^= hash >> 29;
+	}
+	// Zero marks an empty slot
+	return hash ? hash : 1;
+}
+
+static struct dedup_entry *dedup_find(struct dedup_table *table, uint64_t hash) {
+	// Returns the matching entry, or the empty slot where it would go
+	size_t mask = table->size - 1;
+	for (size_t i = (size_t) hash & mask;; i = (i + 1) & mask) {
+		struct dedup_entry *entry = &table->entries[i];
+		if (!entry->hash || entry->hash == hash) {
+			return entry;
+		}
+	}
+}
+
+static void dedup_table_init(struct dedup_table *table, size_t size, uint64_t now) {
+	free(table->entries);
+	table->entries = calloc(size, sizeof(*table->entries));
+	assert(table->entries);
+	table->size = size;
+	table->count = 0;
+	table->start_ns = now;
+}
+
+static void dedup_table_grow(struct dedup_table *table) {
+	struct dedup_entry *old = table->entries;
+	size_t old_size = table->size;
+	table->entries = calloc(old_size * 2, sizeof(*table->entries));
+	assert(table->entries);
+	table->size = old_size * 2;
+	for (size_t i = 0; i < old_size; i++) {
+		if (old[i].hash) {
+			*dedup_find(table, old[i].hash) = old[i];
+		}
+	}
+	free(old);
+}
+
+static void dedup_rotate(uint64_t now) {
+	// Size the new generation for what the last one held, with room to spare
+	size_t size = DEDUP_TABLE_SIZE_MIN;
+	while (size < dedup_current->count * 4) {
+		size *= 2;
+	}
+	struct dedup_table *tmp = dedup_previous;
+	dedup_previous = dedup_current;
+	dedup_current = tmp;
+	dedup_table_init(dedup_current, size, now);
+}
+
+static struct dedup_entry *dedup_lookup(uint64_t hash, uint64_t now) {
+	uint64_t window_ns = dedup_window_ms * UINT64_C(1000000);
+	struct dedup_entry *entry = dedup_find(dedup_current, hash);
+	if (entry->hash && now - entry->seen_ns <= window_ns) {
+		return entry;
+	}
+	struct dedup_entry *old = dedup_find(dedup_previous, hash);
+	if (old->hash && now - old->seen_ns <= window_ns) {
+		return old;
+	}
+	return NULL;
+}
+
+static void dedup_insert(uint64_t hash, uint64_t now, uint64_t pending) {
+	if ((dedup_current->count + 1) * 2 > dedup_current->size) {
+		dedup_table_grow(dedup_current);
+	}
+	struct dedup_entry *entry = dedup_find(dedup_current, hash);
+	if (!entry->hash) {
+		dedup_current->count++;
+	}
+	entry->hash = hash;
+	entry->seen_ns = now;
+	entry->pending = pending;
+}
+
+static struct dedup_pending *dedup_pending_get(uint64_t seq) {
+	return &dedup_pending[seq & (dedup_pending_size - 1)];
+}
+
+static void dedup_pending_release() {
+	struct dedup_pending *pending = dedup_pending_get(dedup_pending_head++);
+	pending->packet.source_id = pending->source_id;
+	struct stat input_stat = {
+		.st_dev = pending->input_dev,
+		.st_ino = pending->input_ino,
+	};
+	pending->packet.input_stat = &input_stat;
+	send_write_unique(&pending->packet);
+}
+
+static uint64_t dedup_pending_add(struct packet *packet) {
+	if (dedup_pending_tail - dedup_pending_head == dedup_pending_size) {
+		size_t new_size = dedup_pending_size ? dedup_pending_size * 2 : 1024;
+		struct dedup_pending *new_pending = malloc(new_size * sizeof(*new_pending));
+		assert(new_pending);
+		for (uint64_t seq = dedup_pending_head; seq < dedup_pending_tail; seq++) {
+			new_pending[seq & (new_size - 1)] = *dedup_pending_get(seq);
+		}
+		free(dedup_pending);
+		dedup_pending = new_pending;
+		dedup_pending_size = new_size;
+	}
+
+	uint64_t seq = dedup_pending_tail++;
+	struct dedup_pending *pending = dedup_pending_get(seq);
+	// wakeup schedules on monotime_ns(); the coarse clock can lag it by a
+	// tick, which would fire the handler early and re-arm it.
+	pending->due_ns = monotime_ns() + dedup_window_ms * UINT64_C(1000000);
+	memcpy(&pending->packet, packet, sizeof(pending->packet));
+	pending->input_dev = packet->input_stat->st_dev;
+	pending->input_ino = packet->input_stat->st_ino;
+	memcpy(pending->source_id, packet->source_id, UUID_LEN);
+	if (seq == dedup_pending_head) {
+		wakeup_add(&dedup_peer, dedup_window_ms);
+	}
+	return seq;
+}
+
+static void dedup_handler(struct peer __attribute__ ((unused)) *peer) {
+	uint64_t now = monotime_ns();
+	while (dedup_pending_head < dedup_pending_tail && dedup_pending_get(dedup_pending_head)->due_ns <= now) {
+		dedup_pending_release();
+	}
+	if (dedup_pending_head < dedup_pending_tail) {
+		wakeup_add_ns(&dedup_peer, dedup_pending_get(dedup_pending_head)->due_ns - now);
+	}
+}
+
+void dedup_opts_add() {
+	opts_add("dedup-window-ms", "MS", dedup_set_window_ms, dedup_opts);
+	opts_add("dedup-policy", "first|best-rssi", dedup_set_policy, dedup_opts);
+}
+
+void dedup_init() {
+	opts_call(dedup_opts);
+	uint64_t now = monotime_coarse_ns();
+	dedup_table_init(dedup_current, DEDUP_TABLE_SIZE_MIN, now);
+	dedup_table_init(dedup_previous, DEDUP_TABLE_SIZE_MIN, now);
+	dedup_peer.fd = -1;
+	dedup_peer.event_handler = dedup_handler;
+	profile_add_handler(dedup_handler, "dedup");
+
+	metrics_add_counter("adsbus_dedup_hits", "Packets suppressed as duplicates.", NULL, &dedup_stats.hits);
+	metrics_add_counter("adsbus_dedup_misses", "Packets passed as first seen.", NULL, &dedup_stats.misses);
+	metrics_add_counter("adsbus_dedup_replaced", "Held packets replaced by a copy with better RSSI.", NULL, &dedup_stats.replaced);
+}
+
+void dedup_cleanup() {
+	wakeup_cancel(&dedup_peer);
+	while (dedup_pending_head < dedup_pending_tail) {
+		dedup_pending_release();
+	}
+	if (dedup_stats.hits || dedup_stats.misses) {
+		LOG(server_id, "Suppressed %ju duplicates of %ju packets (%.1f%%); %ju replaced by better RSSI", (uintmax_t) dedup_stats.hits, (uintmax_t) (dedup_stats.hits + dedup_stats.misses), (double) dedup_stats.hits * 100 / (double) (dedup_stats.hits + dedup_stats.misses), (uintmax_t) dedup_stats.replaced);
+	}
+	free(dedup_pending);
+	free(dedup_tables[0].entries);
+	free(dedup_tables[1].entries);
+}
+
+const struct dedup_counts *dedup_get_counts() {
+	// NULL if no output has asked for dedup
+	return dedup_stats.hits || dedup_stats.misses ? &dedup_stats : NULL;
+}
+
+void dedup_write(struct packet *packet) {
+	if (packet->type == PACKET_TYPE_NONE) {
+		send_write_unique(packet);
+		return;
+	}
+	uint64_t now = monotime_coarse_ns();
+	if (now - dedup_current->start_ns >= dedup_window_ms * UINT64_C(1000000)) {
+		dedup_rotate(now);
+	}
+
+	uint64_t hash = dedup_hash(packet);
+	struct dedup_entry *entry = dedup_lookup(hash, now);
+	if (entry) {
+		dedup_stats.hits++;
+		if (entry->pending != DEDUP_PENDING_NONE && entry->pending >= dedup_pending_head) {
+			struct dedup_pending *pending = dedup_pending_get(entry->pending);
+			if (packet->rssi > pending->packet.rssi) {
+				memcpy(&pending->packet, packet, sizeof(pending->packet));
+				pending->input_dev = packet->input_stat->st_dev;
+				pending->input_ino = packet->input_stat->st_ino;
+				memcpy(pending->source_id, packet->source_id, UUID_LEN);
+				dedup_stats.replaced++;
+			}
+		}
+		return;
+	}
+
+	dedup_stats.misses++;
+	if (dedup_policy == DEDUP_POLICY_FIRST) {
+		dedup_insert(hash, now, DEDUP_PENDING_NONE);
+		send_write_unique(packet);
+	} else {
+		dedup_insert(hash, now, dedup_pending_add(packet));
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+struct packet;
+
+struct dedup_counts {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t replaced;
+};
+
+void dedup_opts_add(void);
+void dedup_init(void);
+void dedup_cleanup(void);
+void dedup_write(struct packet *);
+const struct dedup_counts *dedup_get_counts(void);
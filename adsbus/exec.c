@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/signalfd.h>
@@ -39,6 +40,8 @@ static opts_group exec_opts;
 
 static char log_module = 'E';
 
+#define EXEC_BUF_SIZE (1 << 20)
+
 static void exec_spawn_wrapper(struct peer *);
 
 static void exec_child_cleanup(struct exec *exec, int status) {
@@ -55,6 +58,7 @@ static void exec_child_cleanup(struct exec *exec, int status) {
 
 static void exec_del(struct exec *exec) {
 	flow_ref_dec(exec->flow);
+	wakeup_cancel(&exec->peer);
 
 	if (exec->child > 0) {
 		LOG(exec->id, "Sending SIGTERM to child process %d", exec->child);
@@ -73,20 +77,21 @@ static void exec_sigchld_handler(struct peer *peer) {
 	struct signalfd_siginfo siginfo;
 	assert(read(peer->fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo));
 
-	int status;
-	pid_t pid = waitpid(-1, &status, WNOHANG);
-	if (pid == 0) {
-		// No child
-		return;
-	}
-	assert(pid > 0);
+	// Only reap our own children; other modules (batch.c) have theirs. Signals
+	// coalesce, so check all of them.
 	struct exec *iter, *next;
 	list_for_each_entry_safe(iter, next, &exec_head, exec_list) {
-		if (iter->child == pid) {
-			exec_child_cleanup(iter, status);
-			peer_call(&iter->peer);
-			break;
+		if (iter->child <= 0) {
+			continue;
 		}
+		int status;
+		pid_t pid = waitpid(iter->child, &status, WNOHANG);
+		if (pid == 0) {
+			continue;
+		}
+		assert(pid == iter->child);
+		exec_child_cleanup(iter, status);
+		peer_call(&iter->peer);
 	}
 }
 
@@ -102,8 +107,8 @@ static void exec_retry(struct peer *peer) {
 static void exec_log_handler(struct peer *peer) {
 	struct exec *exec = container_of(peer, struct exec, log_peer);
 
-	char linebuf[4096];
-	ssize_t ret = read(exec->log_peer.fd, linebuf, 4096);
+	char linebuf[65536];
+	ssize_t ret = read(exec->log_peer.fd, linebuf, sizeof(linebuf));
 	if (ret <= 0) {
 		LOG(exec->id, "Log input stream closed");
 		peer_close(&exec->log_peer);
@@ -141,51 +146,92 @@ static void exec_parent(struct exec *exec, pid_t child, int data_fd, int log_fd)
 	}
 }
 
-static void __attribute__ ((noreturn)) exec_child(const struct exec *exec, int data_fd, int log_fd) {
-	assert(!setpgid(0, 0));
+static void exec_pipe(int fds[2]) {
+	assert(!pipe2(fds, O_CLOEXEC));
+	// Best effort; unprivileged processes are capped by fs.pipe-max-size
+	fcntl(fds[1], F_SETPIPE_SZ, EXEC_BUF_SIZE);
+}
 
-	// Other than that, fds should have CLOEXEC set
-	if (data_fd != STDIN_FILENO) {
-		assert(dup2(data_fd, STDIN_FILENO) == STDIN_FILENO);
-	}
-	if (data_fd != STDOUT_FILENO) {
-		assert(dup2(data_fd, STDOUT_FILENO) == STDOUT_FILENO);
+static void exec_socketpair(int fds[2]) {
+	assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+	int size = EXEC_BUF_SIZE;
+	for (int i = 0; i < 2; i++) {
+		// Silently capped by net.core.[rw]mem_max
+		assert(!setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)));
+		assert(!setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)));
 	}
-	if (data_fd != STDIN_FILENO && data_fd != STDOUT_FILENO) {
-		assert(!close(data_fd));
-	}
-	if (log_fd != STDERR_FILENO) {
-		assert(dup2(log_fd, STDERR_FILENO) == STDERR_FILENO);
-		assert(!close(log_fd));
-	}
-
-	sigset_t sigmask;
-	assert(!sigemptyset(&sigmask));
-	assert(!sigprocmask(SIG_SETMASK, &sigmask, NULL));
+}
 
-	assert(!execl("/bin/sh", "sh", "-c", exec->command, NULL));
-	abort();
+static void exec_file_action(posix_spawn_file_actions_t *file_actions, int fd, int target_fd, int null_flags) {
+	if (fd == -1) {
+		assert(!posix_spawn_file_actions_addopen(file_actions, target_fd, "/dev/null", null_flags, 0));
+	} else {
+		assert(!posix_spawn_file_actions_adddup2(file_actions, fd, target_fd));
+	}
 }
 
 static void exec_spawn(struct exec *exec) {
 	LOG(exec->id, "Executing: %s", exec->command);
+
+	// Data only flows one way for send and receive, so use a pipe and give
+	// the child /dev/null for the other direction.
 	int data_fds[2], log_fds[2];
-	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, data_fds));
-	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, log_fds));
-
-	assert(!fcntl(data_fds[0], F_SETFD, FD_CLOEXEC));
-	assert(!fcntl(log_fds[0], F_SETFD, FD_CLOEXEC));
-	
-	int res = fork();
-	assert(res >= 0);
-	if (res) {
-		assert(!close(data_fds[1]));
-		assert(!close(log_fds[1]));
-		assert(!shutdown(log_fds[0], SHUT_WR));
-		exec_parent(exec, res, data_fds[0], log_fds[0]);
+	int data_fd, child_fd, child_in = -1, child_out = -1;
+	if (exec->flow == receive_flow) {
+		exec_pipe(data_fds);
+		data_fd = data_fds[0];
+		child_fd = child_out = data_fds[1];
+	} else if (exec->flow == send_flow) {
+		exec_pipe(data_fds);
+		data_fd = data_fds[1];
+		child_fd = child_in = data_fds[0];
 	} else {
-		exec_child(exec, data_fds[1], log_fds[1]);
+		exec_socketpair(data_fds);
+		data_fd = data_fds[0];
+		child_fd = child_in = child_out = data_fds[1];
 	}
+	exec_pipe(log_fds);
+
+	// All our fds have CLOEXEC set; dup2 clears it on the targets only
+	posix_spawn_file_actions_t file_actions;
+	assert(!posix_spawn_file_actions_init(&file_actions));
+	exec_file_action(&file_actions, child_in, STDIN_FILENO, O_RDONLY);
+	exec_file_action(&file_actions, child_out, STDOUT_FILENO, O_WRONLY);
+	exec_file_action(&file_actions, log_fds[1], STDERR_FILENO, 0);
+
+	// We block SIGCHLD, SIGINT and SIGTERM and ignore SIGPIPE; don't pass
+	// that on to the child.
+	sigset_t sigmask, sigdefault;
+	assert(!sigemptyset(&sigmask));
+	assert(!sigemptyset(&sigdefault));
+	assert(!sigaddset(&sigdefault, SIGPIPE));
+
+	posix_spawnattr_t attr;
+	assert(!posix_spawnattr_init(&attr));
+	assert(!posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF));
+	assert(!posix_spawnattr_setpgroup(&attr, 0));
+	assert(!posix_spawnattr_setsigmask(&attr, &sigmask));
+	assert(!posix_spawnattr_setsigdefault(&attr, &sigdefault));
+
+	char arg0[] = "sh", arg1[] = "-c";
+	char *argv[] = { arg0, arg1, exec->command, NULL };
+	pid_t child;
+	int res = posix_spawn(&child, "/bin/sh", &file_actions, &attr, argv, environ);
+
+	assert(!posix_spawnattr_destroy(&attr));
+	assert(!posix_spawn_file_actions_destroy(&file_actions));
+	assert(!close(child_fd));
+	assert(!close(log_fds[1]));
+
+	if (res) {
+		LOG(exec->id, "Failed to execute: %s", strerror(res));
+		assert(!close(data_fd));
+		assert(!close(log_fds[0]));
+		exec_retry(&exec->peer);
+		return;
+	}
+
+	exec_parent(exec, child, data_fd, log_fds[0]);
 }
 
 static void exec_spawn_wrapper(struct peer *peer) {
@@ -244,6 +290,7 @@ void exec_new(const char *command, struct flow *flow, void *passthrough) {
 	struct exec *exec = malloc(sizeof(*exec));
 	assert(exec);
 	exec->peer.fd = -1;
+	exec->peer.wakeup_slot = 0;
 	uuid_gen(exec->id);
 	exec->command = strdup(command);
 	assert(exec->command);
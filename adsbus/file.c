@@ -1,12 +1,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "flow.h"
 #include "log.h"
 #include "opts.h"
@@ -28,6 +30,9 @@ struct file {
 	struct flow *flow;
 	void *passthrough;
 	bool retry;
+	bool loop;
+	bool indexed;
+	struct receive_options options;
 	struct list_head file_list;
 };
 
@@ -63,6 +68,7 @@ static bool file_should_retry(int fd, struct file *file) {
 
 static void file_del(struct file *file) {
 	flow_ref_dec(file->flow);
+	wakeup_cancel(&file->peer);
 	list_del(&file->file_list);
 	free(file->path);
 	free(file);
@@ -79,7 +85,11 @@ static void file_handle_close(struct peer *peer) {
 	struct file *file = container_of(peer, struct file, peer);
 	LOG(file->id, "File closed: %s", file->path);
 
-	if (file->retry) {
+	if (file->loop) {
+		// Start over from the event loop, not from inside the close
+		file->peer.event_handler = file_open_wrapper;
+		wakeup_add(&file->peer, 0);
+	} else if (file->retry) {
 		file_retry(file);
 	} else {
 		file_del(file);
@@ -88,7 +98,13 @@ static void file_handle_close(struct peer *peer) {
 
 static void file_open(struct file *file) {
 	LOG(file->id, "Opening file: %s", file->path);
-	int fd = open(file->path, file->flags | O_CLOEXEC | O_NOCTTY, S_IRUSR | S_IWUSR);
+	bool captured = false;
+	int fd;
+	if (file->flow == send_flow && (file->indexed || capture_file_wanted(file->path))) {
+		fd = capture_file_open(file->path, file->flags, file->flow, file->passthrough, file->indexed, &captured);
+	} else {
+		fd = open(file->path, file->flags | O_CLOEXEC | O_NOCTTY, S_IRUSR | S_IWUSR);
+	}
 	if (fd == -1) {
 		LOG(file->id, "Error opening file: %s", strerror(errno));
 		file_retry(file);
@@ -98,6 +114,11 @@ static void file_open(struct file *file) {
 	file->retry = file_should_retry(fd, file);
 	file->peer.event_handler = file_handle_close;
 	file->attempt = 0;
+	if (captured) {
+		// The capture writer sends the greeting itself
+		flow_new(fd, file->flow, file->passthrough, &file->peer);
+		return;
+	}
 	if (!flow_new_send_hello(fd, file->flow, file->passthrough, &file->peer)) {
 		LOG(file->id, "Error writing greeting");
 		file_retry(file);
@@ -110,12 +131,13 @@ static void file_open_wrapper(struct peer *peer) {
 	file_open(file);
 }
 
-static void file_new(const char *path, int flags, struct flow *flow, void *passthrough) {
+static struct file *file_alloc(const char *path, int flags, struct flow *flow, void *passthrough) {
 	flow_ref_inc(flow);
 
 	struct file *file = malloc(sizeof(*file));
 	assert(file);
 	file->peer.fd = -1;
+	file->peer.wakeup_slot = 0;
 	uuid_gen(file->id);
 	file->path = strdup(path);
 	assert(file->path);
@@ -123,10 +145,41 @@ static void file_new(const char *path, int flags, struct flow *flow, void *passt
 	file->attempt = 0;
 	file->flow = flow;
 	file->passthrough = passthrough;
+	file->loop = false;
+	file->indexed = false;
 
 	list_add(&file->file_list, &file_head);
 
+	return file;
+}
+
+static void file_new(const char *path, int flags, struct flow *flow, void *passthrough) {
+	file_open(file_alloc(path, flags, flow, passthrough));
+}
+
+static bool file_replay_add(const char *arg, bool loop) {
+	char *speed_str = opts_split(&arg, '=');
+	if (!speed_str) {
+		return false;
+	}
+	char *end_ptr;
+	double speed = strtod(speed_str, &end_ptr);
+	bool valid = (speed_str[0] != '\0' && end_ptr[0] == '\0' && isfinite(speed) && speed > 0);
+	free(speed_str);
+	if (!valid) {
+		return false;
+	}
+
+	struct file *file = file_alloc(arg, O_RDONLY, receive_flow, NULL);
+	file->options = (struct receive_options) {
+		.speed = speed,
+		.range_start = 0,
+		.range_end = UINT64_MAX,
+	};
+	file->passthrough = &file->options;
+	file->loop = loop;
 	file_open(file);
+	return true;
 }
 
 static bool file_write_add(const char *path, struct flow *flow, void *passthrough) {
@@ -134,6 +187,13 @@ static bool file_write_add(const char *path, struct flow *flow, void *passthroug
 	return true;
 }
 
+static bool file_write_indexed_add(const char *path, struct flow *flow, void *passthrough) {
+	struct file *file = file_alloc(path, O_WRONLY | O_CREAT | O_NOFOLLOW | O_TRUNC, flow, passthrough);
+	file->indexed = true;
+	file_open(file);
+	return true;
+}
+
 static bool file_append_add(const char *path, struct flow *flow, void *passthrough) {
 	file_append_new(path, flow, passthrough);
 	return true;
@@ -144,26 +204,71 @@ static bool file_read(const char *arg) {
 	return true;
 }
 
+static bool file_read_range(const char *arg) {
+	char *start_str = opts_split(&arg, '=');
+	if (!start_str) {
+		return false;
+	}
+	char *end_str = opts_split(&arg, '=');
+	if (!end_str) {
+		free(start_str);
+		return false;
+	}
+	uint64_t start, end;
+	bool valid = (opts_parse_uint64(start_str, &start) && opts_parse_uint64(end_str, &end) && start <= end);
+	free(start_str);
+	free(end_str);
+	if (!valid) {
+		return false;
+	}
+
+	struct file *file = file_alloc(arg, O_RDONLY, receive_flow, NULL);
+	file->options = (struct receive_options) {
+		.speed = 0,
+		.range_start = start,
+		.range_end = end,
+	};
+	file->passthrough = &file->options;
+	file_open(file);
+	return true;
+}
+
+static bool file_replay(const char *arg) {
+	return file_replay_add(arg, false);
+}
+
+static bool file_replay_loop(const char *arg) {
+	return file_replay_add(arg, true);
+}
+
 static bool file_write(const char *arg) {
-	return send_add(file_write_add, send_flow, arg);
+	return send_add_file(file_write_add, send_flow, arg);
 }
 
 static bool file_write_read(const char *arg) {
-	return send_add(file_write_add, send_receive_flow, arg);
+	return send_add_file(file_write_add, send_receive_flow, arg);
+}
+
+static bool file_write_indexed(const char *arg) {
+	return send_add_file(file_write_indexed_add, send_flow, arg);
 }
 
 static bool file_append(const char *arg) {
-	return send_add(file_append_add, send_flow, arg);
+	return send_add_file(file_append_add, send_flow, arg);
 }
 
 static bool file_append_read(const char *arg) {
-	return send_add(file_append_add, send_receive_flow, arg);
+	return send_add_file(file_append_add, send_receive_flow, arg);
 }
 
 void file_opts_add() {
 	opts_add("file-read", "PATH", file_read, file_opts);
+	opts_add("file-read-range", "START=END=PATH", file_read_range, file_opts);
+	opts_add("file-replay", "SPEED=PATH", file_replay, file_opts);
+	opts_add("file-replay-loop", "SPEED=PATH", file_replay_loop, file_opts);
 	opts_add("file-write", "FORMAT=PATH", file_write, file_opts);
 	opts_add("file-write-read", "FORMAT=PATH", file_write_read, file_opts);
+	opts_add("file-write-indexed", "FORMAT=PATH", file_write_indexed, file_opts);
 	opts_add("file-append", "FORMAT=PATH", file_append, file_opts);
 	opts_add("file-append-read", "FORMAT=PATH", file_append_read, file_opts);
 }
@@ -188,5 +293,5 @@ void file_write_new(const char *path, struct flow *flow, void *passthrough) {
 }
 
 void file_append_new(const char *path, struct flow *flow, void *passthrough) {
-	file_new(path, O_WRONLY | O_CREAT | O_NOFOLLOW, flow, passthrough);
+	file_new(path, O_WRONLY | O_CREAT | O_NOFOLLOW | O_APPEND, flow, passthrough);
 }
@@ -0,0 +1,523 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cpr.h"
+#include "crc.h"
+#include "packet.h"
+#include "uuid.h"
+
+#include "filter.h"
+
+// Output filters, written as format suffixes:
+//   df:17,18  icao:4840D6,ABC123  type:ac,short,long  source:UUID  valid
+//   area:LAT,LON,LAT,LON[,LAT,LON...]
+// Terms of different kinds must all match; values within a term are
+// alternatives. Each filter is compiled into bitmasks plus a hash set for
+// ICAO addresses, so matching costs a few ANDs per packet.
+//
+// An area is a box (two corners) or a polygon (three or more points), not
+// crossing the antimeridian. It matches every packet from an aircraft
+// whose last decoded position is inside. Areas are looked up through one
+// grid over all of them: each cell knows which areas cover it entirely and
+// which only partly, and only the latter need a point-in-polygon test.
+
+struct filter {
+	uint32_t df_mask;
+	uint8_t type_mask;
+	uint64_t source_mask;
+	uint64_t area_mask;
+	bool valid;
+	// Sorted for filter_equal(); hashed for filter_match()
+	uint32_t *icaos;
+	size_t num_icaos;
+	uint32_t *icao_table;
+	size_t icao_table_size;
+};
+
+// Sources named in any filter, so that source sets are bitmasks
+#define FILTER_SOURCES_MAX 64
+static uint8_t filter_sources[FILTER_SOURCES_MAX][UUID_LEN];
+static size_t filter_num_sources = 0;
+
+struct filter_area {
+	size_t num_points;
+	double *lat;
+	double *lon;
+	double min_lat, max_lat, min_lon, max_lon;
+};
+
+#define FILTER_AREAS_MAX 64
+static struct filter_area filter_areas[FILTER_AREAS_MAX];
+static size_t filter_num_areas = 0;
+
+#define FILTER_GRID_DIM 128
+static struct filter_cell {
+	uint64_t full;
+	uint64_t partial;
+} *filter_grid = NULL;
+static double filter_grid_lat, filter_grid_lon, filter_grid_cell_lat, filter_grid_cell_lon;
+
+static const char *filter_type_names[NUM_TYPES] = {
+	[PACKET_TYPE_MODE_AC] = "ac",
+	[PACKET_TYPE_MODE_S_SHORT] = "short",
+	[PACKET_TYPE_MODE_S_LONG] = "long",
+};
+
+static uint32_t filter_icao_hash(uint32_t icao) {
+	return (icao * UINT32_C(0x9e3779b1)) >> 8;
+}
+
+static bool filter_parse_list(const char *list, bool (*add)(struct filter *, const char *, size_t), struct filter *filter) {
+	if (!*list) {
+		return false;
+	}
+	while (true) {
+		const char *end = strchr(list, ',');
+		size_t len = end ? (size_t) (end - list) : strlen(list);
+		if (!len || !add(filter, list, len)) {
+			return false;
+		}
+		if (!end) {
+			return true;
+		}
+		list = end + 1;
+	}
+}
+
+static bool filter_add_df(struct filter *filter, const char *value, size_t len) {
+	char *end;
+	unsigned long df = strtoul(value, &end, 10);
+	if ((size_t) (end - value) != len || df > 24) {
+		return false;
+	}
+	filter->df_mask |= UINT32_C(1) << df;
+	return true;
+}
+
+static bool filter_add_icao(struct filter *filter, const char *value, size_t len) {
+	char *end;
+	unsigned long icao = strtoul(value, &end, 16);
+	if ((size_t) (end - value) != len || len > 6) {
+		return false;
+	}
+	filter->icaos = realloc(filter->icaos, (filter->num_icaos + 1) * sizeof(*filter->icaos));
+	assert(filter->icaos);
+	filter->icaos[filter->num_icaos++] = (uint32_t) icao;
+	return true;
+}
+
+static bool filter_add_type(struct filter *filter, const char *value, size_t len) {
+	for (int i = 0; i < NUM_TYPES; i++) {
+		if (filter_type_names[i] && strlen(filter_type_names[i]) == len && !strncasecmp(filter_type_names[i], value, len)) {
+			filter->type_mask |= (uint8_t) (1 << i);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool filter_add_source(struct filter *filter, const char *value, size_t len) {
+	if (len != UUID_LEN - 1) {
+		return false;
+	}
+	size_t i;
+	for (i = 0; i < filter_num_sources; i++) {
+		if (!strncasecmp((const char *) filter_sources[i], value, len)) {
+			break;
+		}
+	}
+	if (i == filter_num_sources) {
+		if (filter_num_sources == FILTER_SOURCES_MAX) {
+			return false;
+		}
+		memcpy(filter_sources[i], value, len);
+		filter_sources[i][len] = '\0';
+		filter_num_sources++;
+	}
+	filter->source_mask |= UINT64_C(1) << i;
+	return true;
+}
+
+static bool filter_add_area(struct filter *filter, const char *value) {
+	struct filter_area area = {0};
+	while (true) {
+		char *end;
+		double lat = strtod(value, &end);
+		if (end == value || *end != ',') {
+			free(area.lat);
+			free(area.lon);
+			return false;
+		}
+		value = end + 1;
+		double lon = strtod(value, &end);
+		if (end == value || (*end && *end != ',') || lat < -90 || lat > 90 || lon < -180 || lon > 180) {
+			free(area.lat);
+			free(area.lon);
+			return false;
+		}
+		area.lat = realloc(area.lat, (area.num_points + 1) * sizeof(*area.lat));
+		assert(area.lat);
+		area.lon = realloc(area.lon, (area.num_points + 1) * sizeof(*area.lon));
+		assert(area.lon);
+		area.lat[area.num_points] = lat;
+		area.lon[area.num_points] = lon;
+		area.num_points++;
+		if (!*end) {
+			break;
+		}
+		value = end + 1;
+	}
+
+	if (area.num_points == 2) {
+		// Box: store all four corners, so it is also a valid polygon
+		double lat0 = area.lat[0], lon0 = area.lon[0], lat1 = area.lat[1], lon1 = area.lon[1];
+		area.lat = realloc(area.lat, 4 * sizeof(*area.lat));
+		assert(area.lat);
+		area.lon = realloc(area.lon, 4 * sizeof(*area.lon));
+		assert(area.lon);
+		double lats[4] = {lat0, lat0, lat1, lat1}, lons[4] = {lon0, lon1, lon1, lon0};
+		memcpy(area.lat, lats, sizeof(lats));
+		memcpy(area.lon, lons, sizeof(lons));
+		area.num_points = 4;
+	} else if (area.num_points < 3) {
+		free(area.lat);
+		free(area.lon);
+		return false;
+	}
+
+	size_t i;
+	for (i = 0; i < filter_num_areas; i++) {
+		struct filter_area *iter = &filter_areas[i];
+		if (iter->num_points == area.num_points &&
+				!memcmp(iter->lat, area.lat, area.num_points * sizeof(*area.lat)) &&
+				!memcmp(iter->lon, area.lon, area.num_points * sizeof(*area.lon))) {
+			break;
+		}
+	}
+	if (i < filter_num_areas) {
+		free(area.lat);
+		free(area.lon);
+	} else {
+		if (filter_num_areas == FILTER_AREAS_MAX) {
+			free(area.lat);
+			free(area.lon);
+			return false;
+		}
+		area.min_lat = area.max_lat = area.lat[0];
+		area.min_lon = area.max_lon = area.lon[0];
+		for (size_t j = 1; j < area.num_points; j++) {
+			area.min_lat = area.lat[j] < area.min_lat ? area.lat[j] : area.min_lat;
+			area.max_lat = area.lat[j] > area.max_lat ? area.lat[j] : area.max_lat;
+			area.min_lon = area.lon[j] < area.min_lon ? area.lon[j] : area.min_lon;
+			area.max_lon = area.lon[j] > area.max_lon ? area.lon[j] : area.max_lon;
+		}
+		filter_areas[filter_num_areas++] = area;
+		cpr_enable();
+		// Rebuilt on next use
+		free(filter_grid);
+		filter_grid = NULL;
+	}
+	filter->area_mask |= UINT64_C(1) << i;
+	return true;
+}
+
+static bool filter_area_contains(const struct filter_area *area, double lat, double lon) {
+	if (lat < area->min_lat || lat > area->max_lat || lon < area->min_lon || lon > area->max_lon) {
+		return false;
+	}
+	// Even-odd ray cast towards +lon
+	bool inside = false;
+	for (size_t i = 0, j = area->num_points - 1; i < area->num_points; j = i++) {
+		if ((area->lat[i] > lat) != (area->lat[j] > lat) &&
+				lon < (area->lon[j] - area->lon[i]) * (lat - area->lat[i]) / (area->lat[j] - area->lat[i]) + area->lon[i]) {
+			inside = !inside;
+		}
+	}
+	return inside;
+}
+
+static bool filter_segment_hits_cell(double lat0, double lon0, double lat1, double lon1, double min_lat, double min_lon, double max_lat, double max_lon) {
+	// Liang-Barsky clip of the segment against the cell
+	double t0 = 0, t1 = 1;
+	double p[4] = {lon0 - lon1, lon1 - lon0, lat0 - lat1, lat1 - lat0};
+	double q[4] = {lon0 - min_lon, max_lon - lon0, lat0 - min_lat, max_lat - lat0};
+	for (int i = 0; i < 4; i++) {
+		if (p[i] == 0) {
+			if (q[i] < 0) {
+				return false;
+			}
+			continue;
+		}
+		double r = q[i] / p[i];
+		if (p[i] < 0) {
+			if (r > t1) {
+				return false;
+			}
+			t0 = r > t0 ? r : t0;
+		} else {
+			if (r < t0) {
+				return false;
+			}
+			t1 = r < t1 ? r : t1;
+		}
+	}
+	return true;
+}
+
+static void filter_grid_build() {
+	double min_lat = filter_areas[0].min_lat, max_lat = filter_areas[0].max_lat;
+	double min_lon = filter_areas[0].min_lon, max_lon = filter_areas[0].max_lon;
+	for (size_t i = 1; i < filter_num_areas; i++) {
+		min_lat = filter_areas[i].min_lat < min_lat ? filter_areas[i].min_lat : min_lat;
+		max_lat = filter_areas[i].max_lat > max_lat ? filter_areas[i].max_lat : max_lat;
+		min_lon = filter_areas[i].min_lon < min_lon ? filter_areas[i].min_lon : min_lon;
+		max_lon = filter_areas[i].max_lon > max_lon ? filter_areas[i].max_lon : max_lon;
+	}
+	filter_grid_lat = min_lat;
+	filter_grid_lon = min_lon;
+	// Slightly oversized, so the far edges land inside the last cell
+	filter_grid_cell_lat = (max_lat - min_lat) / FILTER_GRID_DIM * 1.0001 + 1e-9;
+	filter_grid_cell_lon = (max_lon - min_lon) / FILTER_GRID_DIM * 1.0001 + 1e-9;
+
+	filter_grid = calloc(FILTER_GRID_DIM * FILTER_GRID_DIM, sizeof(*filter_grid));
+	assert(filter_grid);
+	for (size_t a = 0; a < filter_num_areas; a++) {
+		struct filter_area *area = &filter_areas[a];
+		size_t lat_first = (size_t) ((area->min_lat - filter_grid_lat) / filter_grid_cell_lat);
+		size_t lat_last = (size_t) ((area->max_lat - filter_grid_lat) / filter_grid_cell_lat);
+		size_t lon_first = (size_t) ((area->min_lon - filter_grid_lon) / filter_grid_cell_lon);
+		size_t lon_last = (size_t) ((area->max_lon - filter_grid_lon) / filter_grid_cell_lon);
+		for (size_t y = lat_first; y <= lat_last && y < FILTER_GRID_DIM; y++) {
+			for (size_t x = lon_first; x <= lon_last && x < FILTER_GRID_DIM; x++) {
+				double cell_min_lat = filter_grid_lat + (double) y * filter_grid_cell_lat;
+				double cell_min_lon = filter_grid_lon + (double) x * filter_grid_cell_lon;
+				double cell_max_lat = cell_min_lat + filter_grid_cell_lat;
+				double cell_max_lon = cell_min_lon + filter_grid_cell_lon;
+				bool edge = false;
+				for (size_t i = 0, j = area->num_points - 1; i < area->num_points && !edge; j = i++) {
+					edge = filter_segment_hits_cell(area->lat[j], area->lon[j], area->lat[i], area->lon[i], cell_min_lat, cell_min_lon, cell_max_lat, cell_max_lon);
+				}
+				struct filter_cell *cell = &filter_grid[y * FILTER_GRID_DIM + x];
+				if (edge) {
+					cell->partial |= UINT64_C(1) << a;
+				} else if (filter_area_contains(area, (cell_min_lat + cell_max_lat) / 2, (cell_min_lon + cell_max_lon) / 2)) {
+					// No edge crosses the cell, so all of it is on the same side
+					cell->full |= UINT64_C(1) << a;
+				}
+			}
+		}
+	}
+}
+
+static int filter_compare_icao(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return x < y ? -1 : (x > y);
+}
+
+uint32_t filter_packet_icao(struct filter_packet *fp) {
+	// Returns FILTER_ICAO_EMPTY if the frame carries no address
+	if (fp->have_icao) {
+		return fp->icao;
+	}
+	const struct packet *packet = fp->packet;
+	fp->have_icao = true;
+	fp->icao = FILTER_ICAO_EMPTY;
+	if (packet->type == PACKET_TYPE_MODE_AC) {
+		return fp->icao;
+	}
+	uint8_t df = packet->payload[0] >> 3;
+	if (df == 11 || df == 17 || df == 18) {
+		fp->icao = (uint32_t) packet->payload[1] << 16 | (uint32_t) packet->payload[2] << 8 | packet->payload[3];
+	} else {
+		// Address/parity overlay: the syndrome is the address
+		fp->icao = crc_syndrome(packet->payload, packet_payload_len[packet->type]);
+	}
+	return fp->icao;
+}
+
+static uint64_t filter_packet_area(struct filter_packet *fp) {
+	if (fp->have_area) {
+		return fp->area_bits;
+	}
+	fp->have_area = true;
+	fp->area_bits = 0;
+	double lat, lon;
+	uint32_t icao = filter_packet_icao(fp);
+	if (icao == FILTER_ICAO_EMPTY || !cpr_position(icao, &lat, &lon)) {
+		return 0;
+	}
+	if (!filter_grid) {
+		filter_grid_build();
+	}
+	if (lat < filter_grid_lat || lon < filter_grid_lon) {
+		return 0;
+	}
+	size_t y = (size_t) ((lat - filter_grid_lat) / filter_grid_cell_lat);
+	size_t x = (size_t) ((lon - filter_grid_lon) / filter_grid_cell_lon);
+	if (y >= FILTER_GRID_DIM || x >= FILTER_GRID_DIM) {
+		return 0;
+	}
+	struct filter_cell *cell = &filter_grid[y * FILTER_GRID_DIM + x];
+	fp->area_bits = cell->full;
+	for (uint64_t partial = cell->partial; partial; partial &= partial - 1) {
+		int a = __builtin_ctzll(partial);
+		if (filter_area_contains(&filter_areas[a], lat, lon)) {
+			fp->area_bits |= UINT64_C(1) << a;
+		}
+	}
+	return fp->area_bits;
+}
+
+static uint64_t filter_packet_source(struct filter_packet *fp) {
+	if (!fp->have_source) {
+		fp->have_source = true;
+		fp->source_bit = 0;
+		for (size_t i = 0; i < filter_num_sources; i++) {
+			if (!strcasecmp((const char *) filter_sources[i], (const char *) fp->packet->source_id)) {
+				fp->source_bit = UINT64_C(1) << i;
+				break;
+			}
+		}
+	}
+	return fp->source_bit;
+}
+
+struct filter *filter_new() {
+	struct filter *filter = calloc(1, sizeof(*filter));
+	assert(filter);
+	return filter;
+}
+
+void filter_del(struct filter *filter) {
+	free(filter->icaos);
+	free(filter->icao_table);
+	free(filter);
+}
+
+bool filter_add_term(struct filter *filter, const char *term) {
+	if (!strcasecmp(term, "valid")) {
+		filter->valid = true;
+		return true;
+	}
+	const char *value = strchr(term, ':');
+	if (!value) {
+		return false;
+	}
+	size_t len = (size_t) (value - term);
+	value++;
+	if (len == 2 && !strncasecmp(term, "df", len)) {
+		return filter_parse_list(value, filter_add_df, filter);
+	}
+	if (len == 4 && !strncasecmp(term, "icao", len)) {
+		return filter_parse_list(value, filter_add_icao, filter);
+	}
+	if (len == 4 && !strncasecmp(term, "type", len)) {
+		return filter_parse_list(value, filter_add_type, filter);
+	}
+	if (len == 6 && !strncasecmp(term, "source", len)) {
+		return filter_parse_list(value, filter_add_source, filter);
+	}
+	if (len == 4 && !strncasecmp(term, "area", len)) {
+		return filter_add_area(filter, value);
+	}
+	return false;
+}
+
+void filter_compile(struct filter *filter) {
+	if (!filter->num_icaos) {
+		return;
+	}
+	qsort(filter->icaos, filter->num_icaos, sizeof(*filter->icaos), filter_compare_icao);
+	size_t out = 1;
+	for (size_t i = 1; i < filter->num_icaos; i++) {
+		if (filter->icaos[i] != filter->icaos[out - 1]) {
+			filter->icaos[out++] = filter->icaos[i];
+		}
+	}
+	filter->num_icaos = out;
+
+	filter->icao_table_size = 8;
+	while (filter->icao_table_size < filter->num_icaos * 2) {
+		filter->icao_table_size *= 2;
+	}
+	filter->icao_table = malloc(filter->icao_table_size * sizeof(*filter->icao_table));
+	assert(filter->icao_table);
+	for (size_t i = 0; i < filter->icao_table_size; i++) {
+		filter->icao_table[i] = FILTER_ICAO_EMPTY;
+	}
+	size_t mask = filter->icao_table_size - 1;
+	for (size_t i = 0; i < filter->num_icaos; i++) {
+		size_t slot = filter_icao_hash(filter->icaos[i]) & mask;
+		while (filter->icao_table[slot] != FILTER_ICAO_EMPTY) {
+			slot = (slot + 1) & mask;
+		}
+		filter->icao_table[slot] = filter->icaos[i];
+	}
+}
+
+void filter_cleanup() {
+	for (size_t i = 0; i < filter_num_areas; i++) {
+		free(filter_areas[i].lat);
+		free(filter_areas[i].lon);
+	}
+	filter_num_areas = 0;
+	free(filter_grid);
+	filter_grid = NULL;
+}
+
+bool filter_equal(const struct filter *a, const struct filter *b) {
+	if (!a || !b) {
+		return a == b;
+	}
+	return a->df_mask == b->df_mask &&
+		a->type_mask == b->type_mask &&
+		a->source_mask == b->source_mask &&
+		a->area_mask == b->area_mask &&
+		a->valid == b->valid &&
+		a->num_icaos == b->num_icaos &&
+		(!a->num_icaos || !memcmp(a->icaos, b->icaos, a->num_icaos * sizeof(*a->icaos)));
+}
+
+bool filter_match(const struct filter *filter, struct filter_packet *fp) {
+	if (!filter) {
+		return true;
+	}
+	const struct packet *packet = fp->packet;
+	if (filter->valid && !crc_valid(packet)) {
+		return false;
+	}
+	if (filter->type_mask && !(filter->type_mask & (1 << packet->type))) {
+		return false;
+	}
+	if (filter->df_mask) {
+		if (packet->type == PACKET_TYPE_MODE_AC) {
+			return false;
+		}
+		uint8_t df = packet->payload[0] >> 3;
+		if (!(filter->df_mask & (UINT32_C(1) << (df > 24 ? 24 : df)))) {
+			return false;
+		}
+	}
+	if (filter->source_mask && !(filter->source_mask & filter_packet_source(fp))) {
+		return false;
+	}
+	if (filter->area_mask && !(filter->area_mask & filter_packet_area(fp))) {
+		return false;
+	}
+	if (filter->icao_table) {
+		uint32_t icao = filter_packet_icao(fp);
+		if (icao == FILTER_ICAO_EMPTY) {
+			return false;
+		}
+		size_t mask = filter->icao_table_size - 1;
+		for (size_t slot = filter_icao_hash(icao) & mask; filter->icao_table[slot] != FILTER_ICAO_EMPTY; slot = (slot + 1) & mask) {
+			if (filter->icao_table[slot] == icao) {
+				return true;
+			}
+		}
+		return false;
+	}
+	return true;
+}
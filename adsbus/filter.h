@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct packet;
+struct filter;
+
+#define FILTER_ICAO_EMPTY UINT32_MAX
+
+// Per-packet values that filters test, computed on first use and shared
+// by every filter and rate limit that sees the packet.
+struct filter_packet {
+	const struct packet *packet;
+	bool have_icao;
+	uint32_t icao;
+	bool have_source;
+	uint64_t source_bit;
+	bool have_area;
+	uint64_t area_bits;
+};
+
+struct filter *filter_new(void);
+void filter_del(struct filter *);
+bool filter_add_term(struct filter *, const char *);
+void filter_compile(struct filter *);
+void filter_cleanup(void);
+bool filter_equal(const struct filter *, const struct filter *);
+bool filter_match(const struct filter *, struct filter_packet *);
+uint32_t filter_packet_icao(struct filter_packet *);
@@ -0,0 +1,192 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flow.h"
+#include "list.h"
+#include "peer.h"
+#include "profile.h"
+#include "wakeup.h"
+
+#include "http.h"
+
+// Minimal HTTP/1.0 server for read-only endpoints (aircraft.json,
+// metrics): one GET per connection, answered from whatever the handler
+// returns, then closed.
+
+struct http_client {
+	struct peer peer;
+	struct peer timeout_peer;
+	struct peer *on_close;
+	const struct http_handler *handler;
+	char request[1024];
+	size_t request_len;
+	char *response;
+	size_t response_len;
+	size_t response_sent;
+	struct list_head client_list;
+};
+
+#define HTTP_CLIENT_TIMEOUT_MS 10000
+
+static struct list_head http_client_head = LIST_HEAD_INIT(http_client_head);
+
+static void http_client_new(int, void *, struct peer *);
+
+static struct flow _http_flow = {
+	.name = "http",
+	.new = http_client_new,
+	.ref_count = &peer_count_out,
+};
+struct flow *http_flow = &_http_flow;
+
+static void http_str_reserve(struct http_str *str, size_t len) {
+	if (str->size - str->length > len) {
+		return;
+	}
+	while (str->size - str->length <= len) {
+		str->size = str->size ? str->size * 2 : 256;
+	}
+	str->data = realloc(str->data, str->size);
+	assert(str->data);
+}
+
+static void http_client_del(struct http_client *client) {
+	wakeup_cancel(&client->timeout_peer);
+	peer_close(&client->peer);
+	list_del(&client->client_list);
+	peer_call(client->on_close);
+	free(client->response);
+	// The timeout can fire in the same epoll batch as a read or write
+	peer_free(client);
+}
+
+static void http_client_timeout(struct peer *peer) {
+	http_client_del(container_of(peer, struct http_client, timeout_peer));
+}
+
+static void http_client_write(struct peer *peer) {
+	struct http_client *client = container_of(peer, struct http_client, peer);
+	while (client->response_sent < client->response_len) {
+		ssize_t res = write(client->peer.fd, &client->response[client->response_sent], client->response_len - client->response_sent);
+		if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (res <= 0) {
+			break;
+		}
+		client->response_sent += (size_t) res;
+	}
+	http_client_del(client);
+}
+
+static void http_client_respond(struct http_client *client) {
+	const char *status = "200 OK", *body;
+	size_t body_len;
+	char path[64];
+	if (sscanf(client->request, "GET %63s HTTP/", path) != 1) {
+		status = "405 Method Not Allowed";
+		body = "";
+		body_len = 0;
+	} else if (!client->handler->get(path, &body, &body_len)) {
+		status = "404 Not Found";
+		body = "";
+		body_len = 0;
+	}
+
+	struct http_str str = { 0 };
+	http_str_printf(&str,
+			"HTTP/1.0 %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"Cache-Control: no-cache\r\n"
+			"Access-Control-Allow-Origin: *\r\n"
+			"Connection: close\r\n"
+			"\r\n", status, client->handler->content_type, body_len);
+	http_str_append(&str, body, body_len);
+	client->response = str.data;
+	client->response_len = str.length;
+	client->response_sent = 0;
+
+	peer_epoll_del(&client->peer);
+	client->peer.event_handler = http_client_write;
+	peer_epoll_add(&client->peer, EPOLLOUT);
+}
+
+static void http_client_read(struct peer *peer) {
+	struct http_client *client = container_of(peer, struct http_client, peer);
+	ssize_t res = read(client->peer.fd, &client->request[client->request_len], sizeof(client->request) - client->request_len - 1);
+	if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (res <= 0) {
+		http_client_del(client);
+		return;
+	}
+	client->request_len += (size_t) res;
+	client->request[client->request_len] = '\0';
+	if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n")) {
+		http_client_respond(client);
+		return;
+	}
+	if (client->request_len == sizeof(client->request) - 1) {
+		// Headers too long to be for us
+		http_client_del(client);
+	}
+}
+
+static void http_client_new(int fd, void *passthrough, struct peer *on_close) {
+	struct http_client *client = malloc(sizeof(*client));
+	assert(client);
+	client->peer.fd = fd;
+	client->peer.event_handler = http_client_read;
+	client->timeout_peer.fd = -1;
+	client->timeout_peer.event_handler = http_client_timeout;
+	client->timeout_peer.wakeup_slot = 0;
+	client->on_close = on_close;
+	client->handler = passthrough;
+	client->request_len = 0;
+	client->response = NULL;
+	list_add(&client->client_list, &http_client_head);
+	peer_epoll_add(&client->peer, EPOLLIN);
+	wakeup_add(&client->timeout_peer, HTTP_CLIENT_TIMEOUT_MS);
+}
+
+void http_init() {
+	profile_add_handler(http_client_read, "http");
+	profile_add_handler(http_client_write, "http");
+	profile_add_handler(http_client_timeout, "http");
+}
+
+void http_cleanup() {
+	struct http_client *iter, *next;
+	list_for_each_entry_safe(iter, next, &http_client_head, client_list) {
+		http_client_del(iter);
+	}
+}
+
+void http_str_printf(struct http_str *str, const char *format, ...) {
+	http_str_reserve(str, 0);
+	while (true) {
+		va_list ap;
+		va_start(ap, format);
+		int len = vsnprintf(&str->data[str->length], str->size - str->length, format, ap);
+		va_end(ap);
+		assert(len >= 0);
+		if ((size_t) len < str->size - str->length) {
+			str->length += (size_t) len;
+			return;
+		}
+		http_str_reserve(str, (size_t) len);
+	}
+}
+
+void http_str_append(struct http_str *str, const void *data, size_t len) {
+	http_str_reserve(str, len);
+	memcpy(&str->data[str->length], data, len);
+	str->length += len;
+}
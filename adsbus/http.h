@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct flow;
+
+struct http_str {
+	char *data;
+	size_t length;
+	size_t size;
+};
+
+// What an HTTP listener serves; passed as the flow passthrough
+struct http_handler {
+	const char *content_type;
+	// Returns false for unknown paths
+	bool (*get)(const char *, const char **, size_t *);
+};
+
+void http_init(void);
+void http_cleanup(void);
+void __attribute__ ((format (printf, 2, 3))) http_str_printf(struct http_str *, const char *, ...);
+void http_str_append(struct http_str *, const void *, size_t);
+extern struct flow *http_flow;
@@ -0,0 +1,124 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icaotable.h"
+
+// Open addressing with linear probing, kept at most half full.
+
+struct icaotable_head {
+	uint32_t key;
+	uint64_t seen_ns;
+};
+
+#define ICAOTABLE_KEY_EMPTY UINT32_MAX
+
+static uint32_t icaotable_key(const uint8_t *entry) {
+	uint32_t key;
+	memcpy(&key, entry + offsetof(struct icaotable_head, key), sizeof(key));
+	return key;
+}
+
+static bool icaotable_live(const struct icaotable *table, const uint8_t *entry, uint64_t now) {
+	uint64_t seen_ns;
+	memcpy(&seen_ns, entry + offsetof(struct icaotable_head, seen_ns), sizeof(seen_ns));
+	return icaotable_key(entry) != ICAOTABLE_KEY_EMPTY && now - seen_ns < table->expire_ns;
+}
+
+static size_t icaotable_slot(uint32_t key, size_t size) {
+	return (size_t) ((key * UINT32_C(0x9e3779b1)) >> 8) & (size - 1);
+}
+
+static uint8_t *icaotable_probe(const struct icaotable *table, uint32_t key) {
+	// Returns the entry for key, or the empty slot where it would go
+	for (size_t i = icaotable_slot(key, table->size);; i = (i + 1) & (table->size - 1)) {
+		uint8_t *entry = &table->entries[i * table->entry_size];
+		uint32_t entry_key = icaotable_key(entry);
+		if (entry_key == key || entry_key == ICAOTABLE_KEY_EMPTY) {
+			return entry;
+		}
+	}
+}
+
+static void icaotable_resize(struct icaotable *table, uint64_t now) {
+	// Rehash, dropping records we haven't heard from in a while
+	uint8_t *old = table->entries;
+	size_t old_size = table->size;
+	size_t live = 0;
+	for (size_t i = 0; i < old_size; i++) {
+		if (icaotable_live(table, &old[i * table->entry_size], now)) {
+			live++;
+		}
+	}
+	table->size = table->size_min;
+	while (table->size < live * 4) {
+		table->size *= 2;
+	}
+	table->entries = malloc(table->size * table->entry_size);
+	assert(table->entries);
+	uint32_t empty = ICAOTABLE_KEY_EMPTY;
+	for (size_t i = 0; i < table->size; i++) {
+		memcpy(&table->entries[i * table->entry_size], &empty, sizeof(empty));
+	}
+	table->count = 0;
+	for (size_t i = 0; i < old_size; i++) {
+		uint8_t *entry = &old[i * table->entry_size];
+		if (icaotable_live(table, entry, now)) {
+			memcpy(icaotable_probe(table, icaotable_key(entry)), entry, table->entry_size);
+			table->count++;
+		} else if (icaotable_key(entry) != ICAOTABLE_KEY_EMPTY && table->drop) {
+			table->drop(entry);
+		}
+	}
+	free(old);
+}
+
+void *icaotable_get(struct icaotable *table, uint32_t key, uint64_t now, bool create) {
+	// New records are zeroed but for key; returns NULL if absent and !create
+	assert(key != ICAOTABLE_KEY_EMPTY);
+	if (!table->size) {
+		if (!create) {
+			return NULL;
+		}
+		icaotable_resize(table, now);
+	}
+	uint8_t *entry = icaotable_probe(table, key);
+	if (icaotable_key(entry) != ICAOTABLE_KEY_EMPTY) {
+		return entry;
+	}
+	if (!create) {
+		return NULL;
+	}
+	if ((table->count + 1) * 2 > table->size) {
+		icaotable_resize(table, now);
+		entry = icaotable_probe(table, key);
+	}
+	memset(entry, 0, table->entry_size);
+	memcpy(entry + offsetof(struct icaotable_head, key), &key, sizeof(key));
+	table->count++;
+	return entry;
+}
+
+void *icaotable_next(const struct icaotable *table, size_t *iter) {
+	// Start with *iter = 0; returns NULL when done. Includes records past
+	// expire_ns that haven't been dropped yet.
+	while (*iter < table->size) {
+		uint8_t *entry = &table->entries[(*iter)++ * table->entry_size];
+		if (icaotable_key(entry) != ICAOTABLE_KEY_EMPTY) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+void icaotable_cleanup(struct icaotable *table) {
+	for (size_t i = 0; i < table->size; i++) {
+		uint8_t *entry = &table->entries[i * table->entry_size];
+		if (icaotable_key(entry) != ICAOTABLE_KEY_EMPTY && table->drop) {
+			table->drop(entry);
+		}
+	}
+	free(table->entries);
+	table->entries = NULL;
+	table->size = table->count = 0;
+}
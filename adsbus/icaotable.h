@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Records keyed by a 32-bit value, usually an ICAO address. Record types
+// must start with uint32_t key, then uint64_t seen_ns (monotonic, last
+// heard); records not heard from within expire_ns are dropped when the
+// table grows, passing each to drop (if set) first. Records are stored
+// inline and move when the table grows, so don't keep pointers across a
+// creating icaotable_get().
+struct icaotable {
+	size_t entry_size;
+	size_t size_min;
+	uint64_t expire_ns;
+	void (*drop)(void *);
+	uint8_t *entries;
+	size_t size;
+	size_t count;
+};
+
+#define ICAOTABLE_INIT(type, size_min_, expire_ns_, drop_) { .entry_size = sizeof(type), .size_min = (size_min_), .expire_ns = (expire_ns_), .drop = (drop_) }
+
+void *icaotable_get(struct icaotable *, uint32_t, uint64_t, bool);
+void *icaotable_next(const struct icaotable *, size_t *);
+void icaotable_cleanup(struct icaotable *);
@@ -8,10 +8,14 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "aircraft.h"
 #include "flow.h"
+#include "http.h"
 #include "log.h"
+#include "metrics.h"
 #include "opts.h"
 #include "peer.h"
+#include "profile.h"
 #include "receive.h"
 #include "resolve.h"
 #include "send.h"
@@ -79,6 +83,7 @@ static void incoming_handler(struct peer *peer) {
 
 static void incoming_del(struct incoming *incoming) {
 	flow_ref_dec(incoming->flow);
+	wakeup_cancel(&incoming->peer);
 	peer_close(&incoming->peer);
 	list_del(&incoming->incoming_list);
 	free(incoming->node);
@@ -122,7 +127,7 @@ static void incoming_listen(struct peer *peer) {
 		break;
 	}
 
-	freeaddrinfo(addrs);
+	resolve_free(addrs);
 
 	if (addr == NULL) {
 		LOG(incoming->id, "Failed to bind any addresses for %s/%s...", incoming->node, incoming->service);
@@ -168,13 +173,26 @@ static bool incoming_listen_send_receive(const char *arg) {
 	return send_add(incoming_add, send_receive_flow, arg);
 }
 
+static bool incoming_listen_aircraft(const char *arg) {
+	aircraft_enable();
+	return incoming_add(arg, http_flow, aircraft_http);
+}
+
+static bool incoming_listen_metrics(const char *arg) {
+	return incoming_add(arg, http_flow, metrics_http);
+}
+
 void incoming_opts_add() {
 	opts_add("listen-receive", "[HOST/]PORT", incoming_listen_receive, incoming_opts);
 	opts_add("listen-send", "FORMAT=[HOST/]PORT", incoming_listen_send, incoming_opts);
 	opts_add("listen-send-receive", "FORMAT=[HOST/]PORT", incoming_listen_send_receive, incoming_opts);
+	opts_add("listen-aircraft", "[HOST/]PORT", incoming_listen_aircraft, incoming_opts);
+	opts_add("listen-metrics", "[HOST/]PORT", incoming_listen_metrics, incoming_opts);
 }
 
 void incoming_init() {
+	profile_add_handler(incoming_handler, "incoming");
+	profile_add_handler(incoming_listen, "incoming");
 	opts_call(incoming_opts);
 }
 
@@ -190,6 +208,7 @@ void incoming_new(const char *node, const char *service, struct flow *flow, void
 
 	struct incoming *incoming = malloc(sizeof(*incoming));
 	incoming->peer.event_handler = incoming_handler;
+	incoming->peer.wakeup_slot = 0;
 	uuid_gen(incoming->id);
 	incoming->node = node ? strdup(node) : NULL;
 	incoming->service = strdup(service);
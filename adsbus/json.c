@@ -44,6 +44,9 @@ static void json_add_common(struct packet *packet, json_t *obj) {
 	if (packet->rssi) {
 		json_object_set_new(obj, "rssi", json_integer(packet->rssi));
 	}
+	if (packet->crc_invalid) {
+		json_object_set_new(obj, "crc_invalid", json_true());
+	}
 }
 
 static void json_serialize_payload(struct packet *packet, struct buf *buf) {
@@ -141,6 +144,8 @@ static bool json_parse_common(json_t *in, struct packet *packet, struct json_par
 		packet->rssi = packet_rssi_scale_in((uint32_t) val, state->rssi_max);
 	}
 
+	packet->crc_invalid = json_is_true(json_object_get(in, "crc_invalid"));
+
 	return true;
 }
 
@@ -0,0 +1,56 @@
+#include <assert.h>
+#include <string.h>
+
+#include "latency.h"
+
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+
+static uint32_t latency_bucket(uint64_t ns) {
+	if (ns < LATENCY_SUB_COUNT) {
+		return (uint32_t) ns;
+	}
+	uint32_t exp = 63 - (uint32_t) __builtin_clzll(ns);
+	if (exp >= LATENCY_EXP_MAX) {
+		return LATENCY_BUCKETS - 1;
+	}
+	return ((exp - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) | (uint32_t) ((ns >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB_COUNT - 1));
+}
+
+static uint64_t latency_bucket_max(uint32_t bucket) {
+	// Largest value that lands in this bucket
+	if (bucket < LATENCY_SUB_COUNT) {
+		return bucket;
+	}
+	uint32_t shift = (bucket >> LATENCY_SUB_BITS) - 1;
+	uint64_t mantissa = (bucket & (LATENCY_SUB_COUNT - 1)) | LATENCY_SUB_COUNT;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void latency_record(struct latency *latency, uint64_t ns) {
+	latency->buckets[latency_bucket(ns)]++;
+	latency->count++;
+	if (ns > latency->max_ns) {
+		latency->max_ns = ns;
+	}
+}
+
+uint64_t latency_percentile(const struct latency *latency, double percentile) {
+	// Upper bound of the bucket holding the given fraction of samples
+	uint64_t target = (uint64_t) (percentile * (double) latency->count);
+	if (target >= latency->count) {
+		return latency->max_ns;
+	}
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += latency->buckets[i];
+		if (seen > target) {
+			uint64_t max = latency_bucket_max(i);
+			return max < latency->max_ns ? max : latency->max_ns;
+		}
+	}
+	return latency->max_ns;
+}
+
+void latency_reset(struct latency *latency) {
+	memset(latency, 0, sizeof(*latency));
+}
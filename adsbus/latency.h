@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+// Log-linear histogram of nanosecond durations: exact below 16ns, then 16
+// buckets per power of two (under 6.25% error) up to about 36 minutes.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_EXP_MAX 41
+#define LATENCY_BUCKETS ((LATENCY_EXP_MAX - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+struct latency {
+	uint64_t count;
+	uint64_t max_ns;
+	uint32_t buckets[LATENCY_BUCKETS];
+};
+
+void latency_record(struct latency *, uint64_t);
+uint64_t latency_percentile(const struct latency *, double);
+void latency_reset(struct latency *);
@@ -0,0 +1,164 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "peer.h"
+#include "stats.h"
+
+#include "metrics.h"
+
+// OpenMetrics text exposition of counters that modules already keep.
+// Nothing here runs per packet: modules bump their own plain integers and
+// either register pointers to them here or keep them in their stats entry,
+// and everything is read and formatted only when scraped.
+
+struct metrics_counter {
+	const char *name;
+	const char *help;
+	char *labels;
+	const uint64_t *value;
+};
+
+static struct metrics_counter *metrics_counters = NULL;
+static size_t metrics_counters_count = 0;
+static struct http_str metrics_body = { 0 };
+static const char *metrics_kind_names[NUM_STATS_KINDS] = {
+	[STATS_KIND_RECEIVE] = "receive",
+	[STATS_KIND_SEND] = "send",
+};
+
+static void metrics_family(const char *name, const char *type, const char *help) {
+	http_str_printf(&metrics_body, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void metrics_label_value(const char *value) {
+	for (const char *iter = value; *iter; iter++) {
+		switch (*iter) {
+			case '"':
+			case '\\':
+				http_str_printf(&metrics_body, "\\%c", *iter);
+				break;
+
+			case '\n':
+				http_str_append(&metrics_body, "\\n", 2);
+				break;
+
+			default:
+				http_str_append(&metrics_body, iter, 1);
+				break;
+		}
+	}
+}
+
+static void metrics_connection_labels(const struct stats_entry *entry) {
+	http_str_printf(&metrics_body, "{kind=\"%s\",id=\"%s\",format=\"", metrics_kind_names[entry->kind], (const char *) entry->id);
+	metrics_label_value(entry->format ? entry->format : "");
+	http_str_append(&metrics_body, "\"}", 2);
+}
+
+static void metrics_connections(const char *name, const char *help, size_t offset) {
+	// offset selects the field within struct stats_counters
+	metrics_family(name, "counter", help);
+	struct stats_entry *entry;
+	stats_for_each(entry) {
+		http_str_printf(&metrics_body, "%s_total", name);
+		metrics_connection_labels(entry);
+		http_str_printf(&metrics_body, " %ju\n", (uintmax_t) *(const uint64_t *) ((const char *) &entry->counters + offset));
+	}
+}
+
+static void metrics_totals(const char *name, const char *help, size_t offset) {
+	metrics_family(name, "counter", help);
+	for (int i = 0; i < NUM_STATS_KINDS; i++) {
+		struct stats_counters totals;
+		stats_get_totals((enum stats_kind) i, &totals);
+		http_str_printf(&metrics_body, "%s_total{kind=\"%s\"} %ju\n", name, metrics_kind_names[i], (uintmax_t) *(const uint64_t *) ((const char *) &totals + offset));
+	}
+}
+
+static void metrics_build() {
+	metrics_body.length = 0;
+
+	metrics_family("adsbus_peers", "gauge", "Open peers by direction.");
+	http_str_printf(&metrics_body, "adsbus_peers{direction=\"in\"} %u\n", peer_count_in);
+	http_str_printf(&metrics_body, "adsbus_peers{direction=\"out\"} %u\n", peer_count_out);
+	http_str_printf(&metrics_body, "adsbus_peers{direction=\"out_in\"} %u\n", peer_count_out_in);
+
+	metrics_family("adsbus_event_loop_iterations", "counter", "Event loop wakeups.");
+	http_str_printf(&metrics_body, "adsbus_event_loop_iterations_total %ju\n", (uintmax_t) peer_loop_iterations);
+	metrics_family("adsbus_event_loop_busy_seconds", "counter", "Time spent handling events, excluding waits.");
+	http_str_printf(&metrics_body, "adsbus_event_loop_busy_seconds_total %.9f\n", (double) peer_loop_busy_ns / 1000000000);
+
+	metrics_totals("adsbus_packets", "Packets received or sent, including closed connections.", offsetof(struct stats_counters, packets));
+	metrics_totals("adsbus_bytes", "Bytes received or sent, including closed connections.", offsetof(struct stats_counters, bytes));
+	metrics_totals("adsbus_parse_errors", "Input that no parser could make sense of.", offsetof(struct stats_counters, parse_errors));
+	metrics_totals("adsbus_drops", "Packets dropped on receive (hop limit, parity) or failed writes on send.", offsetof(struct stats_counters, drops));
+
+	metrics_connections("adsbus_connection_packets", "Packets per open connection.", offsetof(struct stats_counters, packets));
+	metrics_connections("adsbus_connection_bytes", "Bytes per open connection.", offsetof(struct stats_counters, bytes));
+	metrics_connections("adsbus_connection_parse_errors", "Parse errors per open connection.", offsetof(struct stats_counters, parse_errors));
+	metrics_connections("adsbus_connection_drops", "Drops or failed writes per open connection.", offsetof(struct stats_counters, drops));
+	metrics_family("adsbus_connection_queue_bytes", "gauge", "Bytes queued in the kernel: unread for receive, unsent for send.");
+	struct stats_entry *entry;
+	stats_for_each(entry) {
+		int queue_bytes;
+		if (!stats_get_queue_bytes(entry, &queue_bytes)) {
+			continue;
+		}
+		http_str_append(&metrics_body, "adsbus_connection_queue_bytes", 29);
+		metrics_connection_labels(entry);
+		http_str_printf(&metrics_body, " %d\n", queue_bytes);
+	}
+
+	for (size_t i = 0; i < metrics_counters_count; i++) {
+		struct metrics_counter *counter = &metrics_counters[i];
+		if (!i || strcmp(counter->name, metrics_counters[i - 1].name)) {
+			metrics_family(counter->name, "counter", counter->help);
+		}
+		http_str_printf(&metrics_body, "%s_total%s%s%s %ju\n", counter->name, counter->labels ? "{" : "", counter->labels ? counter->labels : "", counter->labels ? "}" : "", (uintmax_t) *counter->value);
+	}
+
+	http_str_append(&metrics_body, "# EOF\n", 6);
+}
+
+static bool metrics_http_get(const char *path, const char **body, size_t *len) {
+	if (strcmp(path, "/") && strcmp(path, "/metrics")) {
+		return false;
+	}
+	metrics_build();
+	*body = metrics_body.data;
+	*len = metrics_body.length;
+	return true;
+}
+
+static struct http_handler _metrics_http = {
+	.content_type = "application/openmetrics-text; version=1.0.0; charset=utf-8",
+	.get = metrics_http_get,
+};
+struct http_handler *metrics_http = &_metrics_http;
+
+void metrics_cleanup() {
+	for (size_t i = 0; i < metrics_counters_count; i++) {
+		free(metrics_counters[i].labels);
+	}
+	free(metrics_counters);
+	metrics_counters = NULL;
+	metrics_counters_count = 0;
+	free(metrics_body.data);
+	metrics_body = (struct http_str) { 0 };
+}
+
+void metrics_add_counter(const char *name, const char *help, const char *labels, const uint64_t *value) {
+	// name and help must outlive us; labels are copied. Counters sharing a
+	// name must be added consecutively.
+	metrics_counters = realloc(metrics_counters, (metrics_counters_count + 1) * sizeof(*metrics_counters));
+	assert(metrics_counters);
+	struct metrics_counter *counter = &metrics_counters[metrics_counters_count++];
+	counter->name = name;
+	counter->help = help;
+	counter->labels = labels ? strdup(labels) : NULL;
+	assert(!labels || counter->labels);
+	counter->value = value;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+struct http_handler;
+
+void metrics_cleanup(void);
+void metrics_add_counter(const char *, const char *, const char *, const uint64_t *);
+extern struct http_handler *metrics_http;
@@ -0,0 +1,18 @@
+#include <assert.h>
+#include <time.h>
+
+#include "monotime.h"
+
+static uint64_t monotime_get(clockid_t clock_id) {
+	struct timespec now;
+	assert(!clock_gettime(clock_id, &now));
+	return (uint64_t) now.tv_sec * NS_PER_S + (uint64_t) now.tv_nsec;
+}
+
+uint64_t monotime_ns() {
+	return monotime_get(CLOCK_MONOTONIC);
+}
+
+uint64_t monotime_coarse_ns() {
+	return monotime_get(CLOCK_MONOTONIC_COARSE);
+}
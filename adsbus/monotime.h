@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+#define NS_PER_S UINT64_C(1000000000)
+#define NS_PER_MS UINT64_C(1000000)
+
+// Nanoseconds on CLOCK_MONOTONIC. The coarse variant is cheaper but only
+// advances once per tick (a few ms); use it for ages and expiry, not for
+// measuring short intervals.
+uint64_t monotime_ns(void);
+uint64_t monotime_coarse_ns(void);
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <errno.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -90,6 +91,29 @@ void opts_call(opts_group group) {
 	}
 }
 
+char **opts_forward(const char *prefix) {
+	// Rebuilds --name[=value] for each flag starting with prefix, e.g. to
+	// pass settings on to a child process. NULL-terminated.
+	char **ret = malloc((size_t) opts_argc * sizeof(*ret));
+	assert(ret);
+	size_t num = 0;
+	optind = 1;
+	int longindex;
+	while (getopt_long_only(opts_argc, opts_argv, "", opts_long, &longindex) == 0) {
+		if (strncmp(opts_long[longindex].name, prefix, strlen(prefix))) {
+			continue;
+		}
+		if (optarg) {
+			assert(asprintf(&ret[num], "--%s=%s", opts_long[longindex].name, optarg) > 0);
+		} else {
+			assert(asprintf(&ret[num], "--%s", opts_long[longindex].name) > 0);
+		}
+		num++;
+	}
+	ret[num] = NULL;
+	return ret;
+}
+
 char *opts_split(const char **arg, char delim) {
 	char *split = strchr(*arg, delim);
 	if (!split) {
@@ -99,3 +123,24 @@ char *opts_split(const char **arg, char delim) {
 	*arg = split + 1;
 	return ret;
 }
+
+bool opts_parse_uint32(const char *arg, uint32_t *out) {
+	char *end_ptr;
+	unsigned long value = strtoul(arg, &end_ptr, 10);
+	if (arg[0] == '\0' || end_ptr[0] != '\0' || value > UINT32_MAX) {
+		return false;
+	}
+	*out = (uint32_t) value;
+	return true;
+}
+
+bool opts_parse_uint64(const char *arg, uint64_t *out) {
+	char *end_ptr;
+	errno = 0;
+	unsigned long long value = strtoull(arg, &end_ptr, 10);
+	if (arg[0] == '\0' || arg[0] == '-' || end_ptr[0] != '\0' || errno) {
+		return false;
+	}
+	*out = (uint64_t) value;
+	return true;
+}
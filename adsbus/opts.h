@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef bool (*opts_handler)(const char *);
 typedef char opts_group[1];
@@ -8,4 +9,7 @@ typedef char opts_group[1];
 void opts_init(int, char *[]);
 void opts_add(const char *, const char *, opts_handler, opts_group);
 void opts_call(opts_group);
+char **opts_forward(const char *);
 char *opts_split(const char **, char);
+bool __attribute__ ((warn_unused_result)) opts_parse_uint32(const char *, uint32_t *);
+bool __attribute__ ((warn_unused_result)) opts_parse_uint64(const char *, uint64_t *);
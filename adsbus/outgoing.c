@@ -13,6 +13,7 @@
 #include "log.h"
 #include "opts.h"
 #include "peer.h"
+#include "profile.h"
 #include "receive.h"
 #include "resolve.h"
 #include "send.h"
@@ -24,23 +25,36 @@
 
 struct outgoing {
 	struct peer peer;
+	struct peer delay_peer;
 	uint8_t id[UUID_LEN];
 	char *node;
 	char *service;
 	struct addrinfo *addrs;
 	struct addrinfo *addr;
+	struct list_head connect_head;
 	uint32_t attempt;
 	struct flow *flow;
 	void *passthrough;
 	struct list_head outgoing_list;
 };
 
+// One in-flight connection attempt; several may race per outgoing.
+struct outgoing_connect {
+	struct peer peer;
+	struct outgoing *outgoing;
+	struct addrinfo *addr;
+	struct list_head connect_list;
+};
+
 static struct list_head outgoing_head = LIST_HEAD_INIT(outgoing_head);
 static opts_group outgoing_opts;
 
 static char log_module = 'O';
 
-static void outgoing_connect_result(struct outgoing *, int);
+// RFC 8305 "Connection Attempt Delay"
+#define OUTGOING_CONNECT_DELAY_MS 250
+
+static void outgoing_connect_result(struct outgoing_connect *, int);
 static void outgoing_resolve(struct outgoing *);
 static void outgoing_resolve_wrapper(struct peer *);
 
@@ -52,36 +66,118 @@ static void outgoing_retry(struct outgoing *outgoing) {
 	wakeup_add(&outgoing->peer, delay);
 }
 
+static void outgoing_addr_name(struct addrinfo *addr, char *hbuf, char *sbuf) {
+	assert(getnameinfo(addr->ai_addr, addr->ai_addrlen, hbuf, NI_MAXHOST, sbuf, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) == 0);
+}
+
+static void outgoing_sort_addrs(struct outgoing *outgoing) {
+	// RFC 8305 section 4: interleave address families, starting with the
+	// family of the first (most preferred) address.
+	int family = outgoing->addrs->ai_family;
+	struct addrinfo *preferred = NULL, **preferred_tail = &preferred;
+	struct addrinfo *other = NULL, **other_tail = &other;
+	for (struct addrinfo *iter = outgoing->addrs, *next; iter; iter = next) {
+		next = iter->ai_next;
+		if (iter->ai_family == family) {
+			*preferred_tail = iter;
+			preferred_tail = &iter->ai_next;
+		} else {
+			*other_tail = iter;
+			other_tail = &iter->ai_next;
+		}
+	}
+	*preferred_tail = *other_tail = NULL;
+
+	struct addrinfo **tail = &outgoing->addrs;
+	while (preferred || other) {
+		if (preferred) {
+			*tail = preferred;
+			tail = &preferred->ai_next;
+			preferred = preferred->ai_next;
+		}
+		if (other) {
+			*tail = other;
+			tail = &other->ai_next;
+			other = other->ai_next;
+		}
+	}
+	*tail = NULL;
+}
+
+static void outgoing_connect_del(struct outgoing_connect *connect) {
+	list_del(&connect->connect_list);
+	// Another attempt may be later in this epoll batch
+	peer_free(connect);
+}
+
+static void outgoing_connect_abort_all(struct outgoing *outgoing) {
+	// Everything left on the list is still waiting in epoll, and may
+	// already have an event queued behind the winner's; closing marks it
+	// so peer_loop() skips that.
+	struct outgoing_connect *iter, *next;
+	list_for_each_entry_safe(iter, next, &outgoing->connect_head, connect_list) {
+		char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+		outgoing_addr_name(iter->addr, hbuf, sbuf);
+		LOG(outgoing->id, "Abandoning connection attempt to %s/%s", hbuf, sbuf);
+		peer_close(&iter->peer);
+		outgoing_connect_del(iter);
+	}
+}
+
+static void outgoing_round_end(struct outgoing *outgoing) {
+	wakeup_cancel(&outgoing->delay_peer);
+	outgoing_connect_abort_all(outgoing);
+	resolve_free(outgoing->addrs);
+	outgoing->addrs = outgoing->addr = NULL;
+}
+
 static void outgoing_connect_next(struct outgoing *outgoing) {
+	wakeup_cancel(&outgoing->delay_peer);
+
 	if (outgoing->addr == NULL) {
-		freeaddrinfo(outgoing->addrs);
-		LOG(outgoing->id, "Can't connect to any addresses of %s/%s", outgoing->node, outgoing->service);
-		outgoing_retry(outgoing);
+		if (list_is_empty(&outgoing->connect_head)) {
+			outgoing_round_end(outgoing);
+			LOG(outgoing->id, "Can't connect to any addresses of %s/%s", outgoing->node, outgoing->service);
+			outgoing_retry(outgoing);
+		}
+		// Otherwise wait for the attempts still in flight
 		return;
 	}
 
+	struct outgoing_connect *connect = malloc(sizeof(*connect));
+	assert(connect);
+	connect->outgoing = outgoing;
+	connect->addr = outgoing->addr;
+	outgoing->addr = outgoing->addr->ai_next;
+	list_add(&connect->connect_list, &outgoing->connect_head);
+
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-	assert(getnameinfo(outgoing->addr->ai_addr, outgoing->addr->ai_addrlen, hbuf, sizeof(hbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV) == 0);
+	outgoing_addr_name(connect->addr, hbuf, sbuf);
 	LOG(outgoing->id, "Connecting to %s/%s...", hbuf, sbuf);
 
-	outgoing->peer.fd = socket(outgoing->addr->ai_family, outgoing->addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, outgoing->addr->ai_protocol);
-	assert(outgoing->peer.fd >= 0);
+	connect->peer.fd = socket(connect->addr->ai_family, connect->addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, connect->addr->ai_protocol);
+	assert(connect->peer.fd >= 0);
 
 	struct buf buf = BUF_INIT, *buf_ptr = &buf;
 	flow_get_hello(outgoing->flow, &buf_ptr, outgoing->passthrough);
-	ssize_t result = sendto(outgoing->peer.fd, buf_at(buf_ptr, 0), buf_ptr->length, MSG_FASTOPEN, outgoing->addr->ai_addr, outgoing->addr->ai_addrlen);
-	outgoing_connect_result(outgoing, result == (ssize_t) buf_ptr->length ? EINPROGRESS : errno);
+	ssize_t result = sendto(connect->peer.fd, buf_at(buf_ptr, 0), buf_ptr->length, MSG_FASTOPEN, connect->addr->ai_addr, connect->addr->ai_addrlen);
+	outgoing_connect_result(connect, result == (ssize_t) buf_ptr->length ? EINPROGRESS : errno);
+}
+
+static void outgoing_delay_handler(struct peer *peer) {
+	struct outgoing *outgoing = container_of(peer, struct outgoing, delay_peer);
+	outgoing_connect_next(outgoing);
 }
 
 static void outgoing_connect_handler(struct peer *peer) {
-	struct outgoing *outgoing = container_of(peer, struct outgoing, peer);
+	struct outgoing_connect *connect = container_of(peer, struct outgoing_connect, peer);
 
-	peer_epoll_del(&outgoing->peer);
+	peer_epoll_del(&connect->peer);
 
 	int error;
-  socklen_t len = sizeof(error);
-	assert(getsockopt(outgoing->peer.fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0);
-	outgoing_connect_result(outgoing, error);
+	socklen_t len = sizeof(error);
+	assert(getsockopt(connect->peer.fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0);
+	outgoing_connect_result(connect, error);
 }
 
 static void outgoing_disconnect_handler(struct peer *peer) {
@@ -90,15 +186,18 @@ static void outgoing_disconnect_handler(struct peer *peer) {
 	outgoing_retry(outgoing);
 }
 
-static void outgoing_connect_result(struct outgoing *outgoing, int result) {
+static void outgoing_connect_result(struct outgoing_connect *connect, int result) {
+	// connect is never registered with epoll on entry.
+	struct outgoing *outgoing = connect->outgoing;
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-	assert(getnameinfo(outgoing->addr->ai_addr, outgoing->addr->ai_addrlen, hbuf, sizeof(hbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV) == 0);
+	outgoing_addr_name(connect->addr, hbuf, sbuf);
 	switch (result) {
 		case 0:
 			LOG(outgoing->id, "Connected to %s/%s", hbuf, sbuf);
-			freeaddrinfo(outgoing->addrs);
+			int fd = connect->peer.fd;
+			outgoing_connect_del(connect);
+			outgoing_round_end(outgoing);
 			outgoing->attempt = 0;
-			int fd = outgoing->peer.fd;
 			outgoing->peer.fd = -1;
 			outgoing->peer.event_handler = outgoing_disconnect_handler;
 			flow_socket_ready(fd, outgoing->flow);
@@ -107,15 +206,19 @@ static void outgoing_connect_result(struct outgoing *outgoing, int result) {
 			break;
 
 		case EINPROGRESS:
-			outgoing->peer.event_handler = outgoing_connect_handler;
-			peer_epoll_add(&outgoing->peer, EPOLLOUT);
+			connect->peer.event_handler = outgoing_connect_handler;
+			peer_epoll_add(&connect->peer, EPOLLOUT);
+			if (outgoing->addr) {
+				// Race the next address if this one is slow
+				wakeup_add(&outgoing->delay_peer, OUTGOING_CONNECT_DELAY_MS);
+			}
 			break;
 
 		default:
 			LOG(outgoing->id, "Can't connect to %s/%s: %s", hbuf, sbuf, strerror(result));
-			assert(!close(outgoing->peer.fd));
-			outgoing->addr = outgoing->addr->ai_next;
-			// Tail recursion :/
+			assert(!close(connect->peer.fd));
+			outgoing_connect_del(connect);
+			// Start the next attempt immediately; tail recursion :/
 			outgoing_connect_next(outgoing);
 			break;
 	}
@@ -123,11 +226,14 @@ static void outgoing_connect_result(struct outgoing *outgoing, int result) {
 
 static void outgoing_resolve_handler(struct peer *peer) {
 	struct outgoing *outgoing = container_of(peer, struct outgoing, peer);
-	int err = resolve_result(peer, &outgoing->addrs);
+	struct addrinfo *addrs;
+	int err = resolve_result(peer, &addrs);
 	if (err) {
 		LOG(outgoing->id, "Failed to resolve %s/%s: %s", outgoing->node, outgoing->service, gai_strerror(err));
 		outgoing_retry(outgoing);
 	} else {
+		outgoing->addrs = addrs;
+		outgoing_sort_addrs(outgoing);
 		outgoing->addr = outgoing->addrs;
 		outgoing_connect_next(outgoing);
 	}
@@ -145,6 +251,10 @@ static void outgoing_resolve_wrapper(struct peer *peer) {
 
 static void outgoing_del(struct outgoing *outgoing) {
 	flow_ref_dec(outgoing->flow);
+	if (outgoing->addrs) {
+		outgoing_round_end(outgoing);
+	}
+	wakeup_cancel(&outgoing->peer);
 	peer_close(&outgoing->peer);
 	list_del(&outgoing->outgoing_list);
 	free(outgoing->node);
@@ -182,6 +292,9 @@ void outgoing_opts_add() {
 }
 
 void outgoing_init() {
+	profile_add_handler(outgoing_connect_handler, "outgoing");
+	profile_add_handler(outgoing_disconnect_handler, "outgoing");
+	profile_add_handler(outgoing_delay_handler, "outgoing");
 	opts_call(outgoing_opts);
 }
 
@@ -199,6 +312,11 @@ void outgoing_new(const char *node, const char *service, struct flow *flow, void
 	uuid_gen(outgoing->id);
 	outgoing->node = strdup(node);
 	outgoing->service = strdup(service);
+	outgoing->addrs = outgoing->addr = NULL;
+	list_head_init(&outgoing->connect_head);
+	outgoing->delay_peer.fd = -1;
+	outgoing->delay_peer.event_handler = outgoing_delay_handler;
+	outgoing->peer.wakeup_slot = outgoing->delay_peer.wakeup_slot = 0;
 	outgoing->attempt = 0;
 	outgoing->flow = flow;
 	outgoing->passthrough = passthrough;
@@ -20,6 +20,9 @@ struct packet {
 	uint8_t payload[PACKET_DATA_LEN_MAX];
 	uint64_t mlat_timestamp;
 	uint32_t rssi;
+	bool crc_invalid;
+	// CLOCK_MONOTONIC when read, for latency stats; 0 if not tracked
+	uint64_t receive_ns;
 };
 extern char *packet_type_names[];
 extern size_t packet_payload_len[];
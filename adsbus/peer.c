@@ -2,22 +2,30 @@
 #include <errno.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <sys/signalfd.h>
 #include <unistd.h>
 
 #include "log.h"
+#include "monotime.h"
+#include "profile.h"
 #include "server.h"
+#include "trace.h"
 
 #include "peer.h"
 
 static char log_module = 'X';
 
 uint32_t peer_count_in = 0, peer_count_out = 0, peer_count_out_in = 0;
+uint64_t peer_loop_iterations = 0, peer_loop_busy_ns = 0;
 
 static int peer_epoll_fd;
 static struct peer peer_shutdown_peer;
 static bool peer_shutdown_flag = false;
 static struct list_head peer_always_trigger_head = LIST_HEAD_INIT(peer_always_trigger_head);
+// Freed once the current batch of events has been dispatched
+static void **peer_free_pending = NULL;
+static size_t peer_free_pending_len = 0, peer_free_pending_size = 0;
 
 static void peer_shutdown() {
 	peer_close(&peer_shutdown_peer);
@@ -47,7 +55,18 @@ void peer_init() {
 	assert(!sigprocmask(SIG_BLOCK, &sigmask, NULL));
 }
 
+static void peer_free_drain() {
+	for (size_t i = 0; i < peer_free_pending_len; i++) {
+		free(peer_free_pending[i]);
+	}
+	peer_free_pending_len = 0;
+}
+
 void peer_cleanup() {
+	peer_free_drain();
+	free(peer_free_pending);
+	peer_free_pending = NULL;
+	peer_free_pending_size = 0;
 	assert(!close(peer_epoll_fd));
 }
 
@@ -91,10 +110,27 @@ void peer_close(struct peer *peer) {
 	peer->fd = -1;
 }
 
+void peer_free(void *ptr) {
+	// For structs holding a peer that may still have an event later in
+	// the current epoll_wait() batch. The peer must already be closed
+	// (fd == -1), so that event is skipped; the memory stays valid until
+	// the batch is done.
+	if (peer_free_pending_len == peer_free_pending_size) {
+		peer_free_pending_size = peer_free_pending_size ? peer_free_pending_size * 2 : 16;
+		peer_free_pending = realloc(peer_free_pending, peer_free_pending_size * sizeof(*peer_free_pending));
+		assert(peer_free_pending);
+	}
+	peer_free_pending[peer_free_pending_len++] = ptr;
+}
+
 void peer_call(struct peer *peer) {
 	if (peer_shutdown_flag || !peer) {
 		return;
 	}
+	if (profile_enabled) {
+		profile_call(peer);
+		return;
+	}
 	peer->event_handler(peer);
 }
 
@@ -118,9 +154,14 @@ void peer_loop() {
 			continue;
 		}
 		assert(nfds >= 0);
+		uint64_t start = monotime_ns();
 
     for (int n = 0; n < nfds; n++) {
 			struct peer *peer = events[n].data.ptr;
+			if (peer->fd == -1) {
+				// Closed by an earlier handler in this batch
+				continue;
+			}
 			peer_call(peer);
 		}
 
@@ -130,5 +171,10 @@ void peer_loop() {
 				peer_call(iter);
 			}
 		}
+		peer_free_drain();
+		uint64_t busy = monotime_ns() - start;
+		peer_loop_iterations++;
+		peer_loop_busy_ns += busy;
+		TRACE(loop_iteration, nfds, busy);
 	}
 }
@@ -12,14 +12,17 @@ struct peer {
 	peer_event_handler event_handler;
 	struct list_head peer_always_trigger_list;
 	bool always_trigger;
+	size_t wakeup_slot; // heap index + 1 while a wakeup is pending
 };
 
 extern uint32_t peer_count_in, peer_count_out, peer_count_out_in;
+extern uint64_t peer_loop_iterations, peer_loop_busy_ns;
 
 void peer_init(void);
 void peer_cleanup(void);
 void peer_epoll_add(struct peer *, uint32_t);
 void peer_epoll_del(struct peer *);
 void peer_close(struct peer *);
+void peer_free(void *);
 void peer_call(struct peer *);
 void peer_loop(void);
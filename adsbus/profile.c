@@ -0,0 +1,248 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "monotime.h"
+#include "opts.h"
+#include "server.h"
+
+#include "profile.h"
+
+// Exclusive time per stage: the clock is read on every stage change and
+// the elapsed ticks go to whatever was running, so nested stages (a write
+// inside a receive) don't double count. Stage 0 is time outside any stage,
+// which is nearly all epoll_wait(). Ticks are TSC cycles where we have
+// them, nanoseconds otherwise.
+
+struct profile_stage {
+	char name[32];
+	uint64_t calls;
+	uint64_t ticks;
+};
+
+struct profile_handler {
+	peer_event_handler handler;
+	uint32_t stage;
+};
+
+static opts_group profile_opts;
+
+static char log_module = 'P';
+
+#define PROFILE_STAGES_MAX 64
+#define PROFILE_HANDLERS_MAX 64
+#define PROFILE_DEPTH_MAX 32
+
+bool profile_enabled = false;
+static char *profile_json_path = NULL;
+#define PROFILE_STAGE_OTHER 1
+static struct profile_stage profile_stages[PROFILE_STAGES_MAX] = {
+	{
+		.name = "idle",
+	},
+	{
+		.name = "peer:other",
+	},
+};
+static uint32_t profile_num_stages = 2;
+static struct profile_handler profile_handlers[PROFILE_HANDLERS_MAX];
+static uint32_t profile_num_handlers = 0;
+static uint32_t profile_stack[PROFILE_DEPTH_MAX];
+// May exceed PROFILE_DEPTH_MAX; deeper stages are charged to the last one kept
+static uint32_t profile_depth = 0;
+static uint64_t profile_last;
+static uint64_t profile_start_ticks, profile_start_ns;
+static struct peer profile_dump_peer;
+
+static uint64_t profile_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return monotime_ns();
+#endif
+}
+
+static bool profile_enable(const char __attribute__ ((unused)) *arg) {
+	profile_enabled = true;
+	return true;
+}
+
+static bool profile_set_json(const char *path) {
+	if (profile_json_path) {
+		return false;
+	}
+	profile_json_path = strdup(path);
+	assert(profile_json_path);
+	profile_enabled = true;
+	return true;
+}
+
+static int profile_compare(const void *a, const void *b) {
+	const struct profile_stage *stage_a = *(const struct profile_stage * const *) a, *stage_b = *(const struct profile_stage * const *) b;
+	return (stage_a->ticks < stage_b->ticks) - (stage_a->ticks > stage_b->ticks);
+}
+
+static void profile_write_json(double ns_per_tick) {
+	json_t *stages = json_object();
+	for (uint32_t i = 0; i < profile_num_stages; i++) {
+		json_object_set_new(stages, profile_stages[i].name, json_pack("{sIsIsI}",
+				"calls", (json_int_t) profile_stages[i].calls,
+				"ticks", (json_int_t) profile_stages[i].ticks,
+				"ns", (json_int_t) ((double) profile_stages[i].ticks * ns_per_tick)));
+	}
+	json_t *out = json_pack("{sIso}",
+			"elapsed_ns", (json_int_t) (monotime_ns() - profile_start_ns),
+			"stages", stages);
+
+	// Replace atomically, so readers never see a partial dump
+	size_t tmp_len = strlen(profile_json_path) + 5;
+	char *tmp = malloc(tmp_len);
+	assert(tmp);
+	snprintf(tmp, tmp_len, "%s.tmp", profile_json_path);
+	if (json_dump_file(out, tmp, 0) || rename(tmp, profile_json_path)) {
+		LOG(server_id, "Failed to write profile to %s", profile_json_path);
+	}
+	free(tmp);
+	json_decref(out);
+}
+
+static void profile_dump() {
+	// Charge the time up to now before reporting it
+	profile_enter(0);
+	profile_exit();
+
+	uint64_t ticks = profile_ticks() - profile_start_ticks;
+	double ns_per_tick = ticks ? (double) (monotime_ns() - profile_start_ns) / (double) ticks : 0;
+	uint64_t busy = 0;
+	struct profile_stage *sorted[PROFILE_STAGES_MAX];
+	for (uint32_t i = 0; i < profile_num_stages; i++) {
+		sorted[i] = &profile_stages[i];
+		if (i) {
+			busy += profile_stages[i].ticks;
+		}
+	}
+	qsort(sorted, profile_num_stages, sizeof(*sorted), profile_compare);
+
+	LOG(server_id, "Profile: %.3fs elapsed, %.1f%% busy", (double) ticks * ns_per_tick / 1000000000, ticks ? (double) busy * 100 / (double) ticks : 0.0);
+	LOG(server_id, "Profile: %-24s %12s %16s %12s %8s", "stage", "calls", "ticks", "ms", "busy%");
+	for (uint32_t i = 0; i < profile_num_stages; i++) {
+		struct profile_stage *stage = sorted[i];
+		if (!stage->ticks || stage == &profile_stages[0]) {
+			continue;
+		}
+		LOG(server_id, "Profile: %-24s %12ju %16ju %12.3f %8.2f", stage->name, (uintmax_t) stage->calls, (uintmax_t) stage->ticks, (double) stage->ticks * ns_per_tick / 1000000, (double) stage->ticks * 100 / (double) busy);
+	}
+
+	if (profile_json_path) {
+		profile_write_json(ns_per_tick);
+	}
+}
+
+static void profile_dump_handler(struct peer *peer) {
+	struct signalfd_siginfo siginfo;
+	assert(read(peer->fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo));
+	profile_dump();
+}
+
+void profile_opts_add() {
+	opts_add("profile", NULL, profile_enable, profile_opts);
+	opts_add("profile-json", "PATH", profile_set_json, profile_opts);
+}
+
+void profile_init() {
+	opts_call(profile_opts);
+	if (!profile_enabled) {
+		profile_dump_peer.fd = -1;
+		return;
+	}
+
+	sigset_t sigmask;
+	assert(!sigemptyset(&sigmask));
+	assert(!sigaddset(&sigmask, SIGUSR1));
+	profile_dump_peer.fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	assert(profile_dump_peer.fd >= 0);
+	profile_dump_peer.event_handler = profile_dump_handler;
+	peer_epoll_add(&profile_dump_peer, EPOLLIN);
+	profile_add_handler(profile_dump_handler, "profile");
+	assert(!sigprocmask(SIG_BLOCK, &sigmask, NULL));
+
+	profile_start_ns = monotime_ns();
+	profile_start_ticks = profile_last = profile_ticks();
+}
+
+void profile_cleanup() {
+	if (profile_enabled) {
+		profile_dump();
+		profile_enabled = false;
+	}
+	peer_close(&profile_dump_peer);
+	free(profile_json_path);
+	profile_json_path = NULL;
+}
+
+uint32_t profile_add_stage(const char *type, const char *name) {
+	// Returns the id to pass to PROFILE_ENTER(); reported as "type:name"
+	assert(profile_num_stages < PROFILE_STAGES_MAX);
+	struct profile_stage *stage = &profile_stages[profile_num_stages];
+	snprintf(stage->name, sizeof(stage->name), "%s:%s", type, name);
+	return profile_num_stages++;
+}
+
+void profile_add_handler(peer_event_handler handler, const char *type) {
+	// Events for peers with this handler are charged to "peer:type"
+	uint32_t stage = 0;
+	for (uint32_t i = 0; i < profile_num_handlers; i++) {
+		if (!strcmp(strchr(profile_stages[profile_handlers[i].stage].name, ':') + 1, type)) {
+			stage = profile_handlers[i].stage;
+			break;
+		}
+	}
+	if (!stage) {
+		stage = profile_add_stage("peer", type);
+	}
+	assert(profile_num_handlers < PROFILE_HANDLERS_MAX);
+	profile_handlers[profile_num_handlers].handler = handler;
+	profile_handlers[profile_num_handlers].stage = stage;
+	profile_num_handlers++;
+}
+
+void profile_call(struct peer *peer) {
+	uint32_t stage = PROFILE_STAGE_OTHER;
+	for (uint32_t i = 0; i < profile_num_handlers; i++) {
+		if (profile_handlers[i].handler == peer->event_handler) {
+			stage = profile_handlers[i].stage;
+			break;
+		}
+	}
+	profile_enter(stage);
+	peer->event_handler(peer);
+	profile_exit();
+}
+
+void profile_enter(uint32_t stage) {
+	uint64_t now = profile_ticks();
+	uint32_t current = profile_depth ? profile_stack[(profile_depth < PROFILE_DEPTH_MAX ? profile_depth : PROFILE_DEPTH_MAX) - 1] : 0;
+	profile_stages[current].ticks += now - profile_last;
+	profile_last = now;
+	if (profile_depth < PROFILE_DEPTH_MAX) {
+		profile_stack[profile_depth] = stage;
+	}
+	profile_depth++;
+	profile_stages[stage].calls++;
+}
+
+void profile_exit() {
+	assert(profile_depth);
+	uint64_t now = profile_ticks();
+	uint32_t current = profile_stack[(profile_depth < PROFILE_DEPTH_MAX ? profile_depth : PROFILE_DEPTH_MAX) - 1];
+	profile_stages[current].ticks += now - profile_last;
+	profile_last = now;
+	profile_depth--;
+}
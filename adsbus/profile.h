@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "peer.h"
+
+#define PROFILE_ENTER(stage) \
+		do { \
+			if (profile_enabled) { \
+				profile_enter(stage); \
+			} \
+		} while (0)
+
+#define PROFILE_EXIT() \
+		do { \
+			if (profile_enabled) { \
+				profile_exit(); \
+			} \
+		} while (0)
+
+extern bool profile_enabled;
+
+void profile_opts_add(void);
+void profile_init(void);
+void profile_cleanup(void);
+uint32_t profile_add_stage(const char *, const char *);
+void profile_add_handler(peer_event_handler, const char *);
+void profile_call(struct peer *);
+void profile_enter(uint32_t);
+void profile_exit(void);
@@ -0,0 +1,185 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "filter.h"
+#include "icaotable.h"
+#include "log.h"
+#include "monotime.h"
+#include "packet.h"
+#include "server.h"
+
+#include "ratelimit.h"
+
+// Per-aircraft throttling for an output group ("json+rate:1"). Each ICAO
+// address gets a token bucket per message class, refilled at the given
+// rate per second and holding at most max(1, rate) tokens. Identity
+// messages and Comm-B replies aren't throttled but pass only when their
+// content changes.
+// Packets without an address (Mode A/C) are passed untouched.
+
+enum ratelimit_class {
+	RATELIMIT_CLASS_POSITION,
+	RATELIMIT_CLASS_VELOCITY,
+	RATELIMIT_CLASS_ALTITUDE,
+	RATELIMIT_CLASS_OTHER,
+	// Passed on change
+	RATELIMIT_CLASS_IDENTITY,
+	RATELIMIT_CLASS_SQUAWK,
+	RATELIMIT_CLASS_COMMB_ALTITUDE,
+	RATELIMIT_CLASS_COMMB_IDENTITY,
+};
+
+struct ratelimit_entry {
+	// icao << 8 | class
+	uint32_t key;
+	uint64_t last_ns;
+	// Millitokens, or a content hash for on-change classes
+	uint32_t value;
+};
+
+struct ratelimit {
+	double rate;
+	uint32_t capacity;
+	struct icaotable table;
+	uint64_t passed;
+	uint64_t dropped;
+};
+
+static char log_module = 'S'; // borrowing
+
+#define RATELIMIT_TERM "rate:"
+#define RATELIMIT_TABLE_SIZE_MIN 256
+#define RATELIMIT_TOKEN 1000
+// Entries idle for this long are dropped when the table grows
+#define RATELIMIT_EXPIRE_NS (300 * NS_PER_S)
+
+static uint32_t ratelimit_hash(uint32_t hash, const uint8_t *data, size_t len) {
+	// FNV-1a, continuing from hash
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ data[i]) * UINT32_C(16777619);
+	}
+	return hash;
+}
+
+static void ratelimit_classify(const struct packet *packet, enum ratelimit_class *class, uint32_t *hash) {
+	const uint8_t *payload = packet->payload;
+	size_t len = packet_payload_len[packet->type];
+	uint8_t df = payload[0] >> 3;
+	*hash = 0;
+	if ((df == 17 || df == 18) && packet->type == PACKET_TYPE_MODE_S_LONG) {
+		uint8_t tc = payload[4] >> 3;
+		if (tc >= 1 && tc <= 4) {
+			*class = RATELIMIT_CLASS_IDENTITY;
+			// ME field
+			*hash = ratelimit_hash(UINT32_C(2166136261), &payload[4], 7);
+		} else if ((tc >= 5 && tc <= 18) || (tc >= 20 && tc <= 22)) {
+			*class = RATELIMIT_CLASS_POSITION;
+		} else if (tc == 19) {
+			*class = RATELIMIT_CLASS_VELOCITY;
+		} else {
+			*class = RATELIMIT_CLASS_OTHER;
+		}
+	} else if (df == 4) {
+		*class = RATELIMIT_CLASS_ALTITUDE;
+	} else if (df == 5) {
+		*class = RATELIMIT_CLASS_SQUAWK;
+		// ID13
+		*hash = (uint32_t) (payload[2] & 0x1f) << 8 | payload[3];
+	} else if (df == 20 || df == 21) {
+		// Comm-B replies each carry their own MB data, so pass every
+		// distinct one
+		*class = df == 20 ? RATELIMIT_CLASS_COMMB_ALTITUDE : RATELIMIT_CLASS_COMMB_IDENTITY;
+		// AC13 or ID13, then MB
+		uint8_t code[2] = { (uint8_t) (payload[2] & 0x1f), payload[3] };
+		*hash = ratelimit_hash(ratelimit_hash(UINT32_C(2166136261), code, sizeof(code)), &payload[4], len - 7);
+	} else {
+		*class = RATELIMIT_CLASS_OTHER;
+	}
+}
+
+bool ratelimit_is_term(const char *term) {
+	return !strncasecmp(term, RATELIMIT_TERM, strlen(RATELIMIT_TERM));
+}
+
+struct ratelimit *ratelimit_new(const char *term) {
+	assert(ratelimit_is_term(term));
+	char *end;
+	double rate = strtod(&term[strlen(RATELIMIT_TERM)], &end);
+	if (end == &term[strlen(RATELIMIT_TERM)] || *end || !(rate > 0) || rate > 1000) {
+		return NULL;
+	}
+	struct ratelimit *ratelimit = malloc(sizeof(*ratelimit));
+	assert(ratelimit);
+	ratelimit->rate = rate;
+	ratelimit->capacity = rate > 1 ? (uint32_t) (rate * RATELIMIT_TOKEN) : RATELIMIT_TOKEN;
+	ratelimit->table = (struct icaotable) ICAOTABLE_INIT(struct ratelimit_entry, RATELIMIT_TABLE_SIZE_MIN, RATELIMIT_EXPIRE_NS, NULL);
+	ratelimit->passed = ratelimit->dropped = 0;
+	return ratelimit;
+}
+
+void ratelimit_del(struct ratelimit *ratelimit, const char *name) {
+	if (ratelimit->passed + ratelimit->dropped) {
+		LOG(server_id, "%s: throttled %ju of %ju packets (%.1f%%)", name, (uintmax_t) ratelimit->dropped, (uintmax_t) (ratelimit->passed + ratelimit->dropped), (double) ratelimit->dropped * 100 / (double) (ratelimit->passed + ratelimit->dropped));
+	}
+	icaotable_cleanup(&ratelimit->table);
+	free(ratelimit);
+}
+
+bool ratelimit_equal(const struct ratelimit *a, const struct ratelimit *b) {
+	if (!a || !b) {
+		return a == b;
+	}
+	return a->capacity == b->capacity && !(a->rate < b->rate || a->rate > b->rate);
+}
+
+bool ratelimit_pass(struct ratelimit *ratelimit, struct filter_packet *fp) {
+	uint32_t icao = filter_packet_icao(fp);
+	if (icao == FILTER_ICAO_EMPTY) {
+		// Mode A/C
+		return true;
+	}
+	uint32_t hash;
+	enum ratelimit_class class;
+	ratelimit_classify(fp->packet, &class, &hash);
+
+	uint64_t now = monotime_coarse_ns();
+	uint32_t key = icao << 8 | class;
+	struct ratelimit_entry *entry = icaotable_get(&ratelimit->table, key, now, true);
+	if (!entry->last_ns) {
+		// Just created
+		entry->value = class >= RATELIMIT_CLASS_IDENTITY ? hash : ratelimit->capacity - RATELIMIT_TOKEN;
+		entry->last_ns = now;
+		ratelimit->passed++;
+		return true;
+	}
+
+	bool pass;
+	if (class >= RATELIMIT_CLASS_IDENTITY) {
+		pass = entry->value != hash;
+		entry->value = hash;
+		entry->last_ns = now;
+	} else {
+		double refill = (double) (now - entry->last_ns) / NS_PER_S * ratelimit->rate * RATELIMIT_TOKEN;
+		uint64_t tokens = (uint64_t) entry->value + (refill < ratelimit->capacity ? (uint64_t) refill : ratelimit->capacity);
+		if (tokens > ratelimit->capacity) {
+			tokens = ratelimit->capacity;
+		}
+		pass = tokens >= RATELIMIT_TOKEN;
+		if (pass) {
+			tokens -= RATELIMIT_TOKEN;
+		}
+		entry->value = (uint32_t) tokens;
+		// Keep fractional tokens by only advancing the clock when we refill
+		if (refill >= 1) {
+			entry->last_ns = now;
+		}
+	}
+	if (pass) {
+		ratelimit->passed++;
+	} else {
+		ratelimit->dropped++;
+	}
+	return pass;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+
+struct filter_packet;
+struct ratelimit;
+
+bool ratelimit_is_term(const char *);
+struct ratelimit *ratelimit_new(const char *);
+void ratelimit_del(struct ratelimit *, const char *);
+bool ratelimit_equal(const struct ratelimit *, const struct ratelimit *);
+bool ratelimit_pass(struct ratelimit *, struct filter_packet *);
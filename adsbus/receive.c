@@ -2,25 +2,52 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/net_tstamp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+
+#include <zstd.h>
 
 #include "airspy_adsb.h"
 #include "beast.h"
+#include "block.h"
 #include "buf.h"
+#include "column.h"
+#include "crc.h"
 #include "flow.h"
 #include "json.h"
 #include "log.h"
+#include "metrics.h"
+#include "monotime.h"
 #include "packet.h"
 #include "peer.h"
+#include "profile.h"
 #include "proto.h"
 #include "raw.h"
 #include "socket.h"
+#include "reorder.h"
 #include "send.h"
+#include "sourcestats.h"
+#include "sourcetable.h"
+#include "stats.h"
+#include "trace.h"
 #include "uuid.h"
+#include "wakeup.h"
 
 #include "receive.h"
 
+// Replay pacing clock per source: hub captures interleave receivers whose
+// MLAT clocks are unrelated.
+struct receive_replay_source {
+	uint8_t id[UUID_LEN];
+	uint64_t base_ts;
+	uint64_t base_ns;
+	uint64_t last_ts;
+};
+
 struct receive;
 typedef bool (*parser_wrapper)(struct receive *, struct packet *);
 typedef bool (*parser)(struct buf *, struct packet *, void *state);
@@ -33,6 +60,30 @@ struct receive {
 	char parser_state[PARSER_STATE_LEN];
 	parser_wrapper parser_wrapper;
 	parser parser;
+	uint32_t parser_profile;
+	const struct receive_options *options;
+	struct peer replay_peer;
+	bool replay_held;
+	struct packet replay_packet;
+	uint8_t replay_source_id[UUID_LEN];
+	struct sourcetable replay_sources;
+	const uint8_t *map;
+	size_t map_pos;
+	ZSTD_DCtx *dctx;
+	uint8_t *zbuf;
+	size_t zbuf_pos;
+	size_t zbuf_length;
+	struct block_range *blocks;
+	size_t num_blocks;
+	size_t block_next;
+	size_t block_end;
+	struct column_reader *column;
+	bool column_done;
+	struct stats_entry stats;
+	// Stamped on packets for latency stats
+	uint64_t read_ns;
+	bool timestamps;
+	uint64_t start_ns;
 	struct list_head receive_list;
 };
 static struct list_head receive_head = LIST_HEAD_INIT(receive_head);
@@ -52,6 +103,7 @@ struct flow *receive_flow = &_receive_flow;
 static struct parser {
 	char *name;
 	parser parse;
+	uint32_t profile;
 } parsers[] = {
 	{
 		.name = "airspy_adsb",
@@ -77,9 +129,26 @@ static struct parser {
 #define NUM_PARSERS (sizeof(parsers) / sizeof(*parsers))
 
 static uint32_t receive_max_hops = 10;
+// Last slot counts input that never matched any parser
+static uint64_t receive_parse_errors[NUM_PARSERS + 1];
+static uint64_t receive_detected[NUM_PARSERS];
+static uint64_t receive_hop_drops = 0;
+static uint32_t receive_profile_read, receive_profile_autodetect;
+
+// Regular files are mapped and parsed this many bytes per event, so one
+// large input doesn't starve everything else.
+#define RECEIVE_MAP_BATCH (1 << 20)
+#define RECEIVE_COLUMN_BATCH (1 << 16)
+
+// Timestamp jumps larger than this (or backwards) restart pacing instead
+// of stalling output.
+#define RECEIVE_REPLAY_GAP_MAX (UINT64_C(10) * PACKET_MLAT_MHZ * 1000000)
 
 static bool receive_parse_wrapper(struct receive *receive, struct packet *packet) {
-	return receive->parser(&receive->buf, packet, receive->parser_state);
+	PROFILE_ENTER(receive->parser_profile);
+	bool ret = receive->parser(&receive->buf, packet, receive->parser_state);
+	PROFILE_EXIT();
+	return ret;
 }
 
 static bool receive_autodetect_parse(struct receive *receive, struct packet *packet) {
@@ -90,41 +159,149 @@ static bool receive_autodetect_parse(struct receive *receive, struct packet *pac
 	struct packet orig_packet;
 	memcpy(&orig_packet, packet, sizeof(orig_packet));
 
+	PROFILE_ENTER(receive_profile_autodetect);
 	for (size_t i = 0; i < NUM_PARSERS; i++) {
 		if (parsers[i].parse(buf, packet, state)) {
+			PROFILE_EXIT();
 			LOG(receive->id, "Detected input format: %s", parsers[i].name);
 			receive->parser_wrapper = receive_parse_wrapper;
 			receive->parser = parsers[i].parse;
+			receive->parser_profile = parsers[i].profile;
+			receive->stats.format = parsers[i].name;
+			receive_detected[i]++;
 			return true;
 		}
 		if (i < NUM_PARSERS - 1) {
 			memcpy(packet, &orig_packet, sizeof(*packet));
 		}
 	}
+	PROFILE_EXIT();
 	return false;
 }
 
 static void receive_del(struct receive *receive) {
 	LOG(receive->id, "Connection closed");
+	TRACE(peer_closed, "receive", receive->id);
 	peer_count_in--;
+	stats_del(&receive->stats);
+	if (receive->map) {
+		double secs = (double) (monotime_ns() - receive->start_ns) / NS_PER_S;
+		LOG(receive->id, "Read %ju bytes, %ju packets in %.3fs (%.1f MB/s)", (uintmax_t) receive->stats.counters.bytes, (uintmax_t) receive->stats.counters.packets, secs, secs > 0 ? (double) receive->stats.counters.bytes / secs / 1000000 : 0.0);
+		assert(!munmap((void *) receive->map, (size_t) receive->stat.st_size));
+	}
+	if (receive->dctx) {
+		ZSTD_freeDCtx(receive->dctx);
+		free(receive->zbuf);
+	}
+	free(receive->blocks);
+	if (receive->column) {
+		column_reader_del(receive->column);
+	}
+	wakeup_cancel(&receive->replay_peer);
+	sourcetable_cleanup(&receive->replay_sources);
+	if (receive->replay_held) {
+		// Not registered with epoll while paused
+		assert(!close(receive->peer.fd));
+		receive->peer.fd = -1;
+	}
 	peer_close(&receive->peer);
 	list_del(&receive->receive_list);
 	peer_call(receive->on_close);
 	free(receive);
 }
 
-static void receive_read(struct peer *peer) {
-	struct receive *receive = container_of(peer, struct receive, peer);
+static bool receive_replay_ready(struct receive *receive, struct packet *packet) {
+	if (!packet->mlat_timestamp) {
+		return true;
+	}
 
-	if (buf_fill(&receive->buf, receive->peer.fd) <= 0) {
-		receive_del(receive);
-		return;
+	uint64_t now = monotime_ns();
+	struct receive_replay_source *source = sourcetable_get(&receive->replay_sources, packet->source_id ? packet->source_id : receive->id);
+	if (!source->base_ns ||
+			packet->mlat_timestamp < source->last_ts ||
+			packet->mlat_timestamp - source->last_ts > RECEIVE_REPLAY_GAP_MAX) {
+		source->base_ts = packet->mlat_timestamp;
+		source->base_ns = now;
+	}
+	source->last_ts = packet->mlat_timestamp;
+
+	double offset_ns = (double) (packet->mlat_timestamp - source->base_ts) * 1000 / PACKET_MLAT_MHZ;
+	uint64_t due = source->base_ns + (uint64_t) (offset_ns / receive->options->speed);
+	if (due <= now) {
+		return true;
 	}
 
+	// Parsers may free source_id on their next call, so keep our own copy.
+	memcpy(&receive->replay_packet, packet, sizeof(receive->replay_packet));
+	memcpy(receive->replay_source_id, packet->source_id, UUID_LEN);
+	receive->replay_packet.source_id = receive->replay_source_id;
+	receive->replay_held = true;
+	wakeup_add_ns(&receive->replay_peer, due - now);
+	return false;
+}
+
+static bool receive_deliver(struct receive *receive, struct packet *packet) {
+	// Returns false if the packet was held back for replay pacing.
+	TRACE(packet_parsed, receive->stats.format, packet->type, packet->source_id, receive->id);
+	if (++packet->hops > receive_max_hops) {
+		LOG(receive->id, "Packet exceeded hop limit (%u > %u); dropping. You may have a loop in your configuration.", packet->hops, receive_max_hops);
+		TRACE(packet_dropped, "hop_limit", receive->id);
+		receive->stats.counters.drops++;
+		receive_hop_drops++;
+		stats_source_packet(packet, true);
+		return true;
+	}
+	if (receive->options && (packet->mlat_timestamp < receive->options->range_start || packet->mlat_timestamp > receive->options->range_end)) {
+		return true;
+	}
+	if (!crc_filter(packet)) {
+		TRACE(packet_dropped, "crc", receive->id);
+		receive->stats.counters.drops++;
+		stats_source_packet(packet, true);
+		return true;
+	}
+	stats_source_packet(packet, false);
+	sourcestats_update(packet);
+	if (receive->options && receive->options->speed > 0 && !receive_replay_ready(receive, packet)) {
+		return false;
+	}
+	receive->stats.counters.packets++;
+	reorder_write(packet);
+	return true;
+}
+
+static void receive_process_column(struct receive *receive) {
+	uint64_t start = receive->options ? receive->options->range_start : 0;
+	uint64_t end = receive->options ? receive->options->range_end : UINT64_MAX;
+	for (uint32_t i = 0; i < RECEIVE_COLUMN_BATCH; i++) {
+		struct packet packet = {
+			.input_stat = &receive->stat,
+			.receive_ns = receive->read_ns,
+		};
+		if (!column_reader_next(receive->column, &packet, start, end)) {
+			const char *error = column_reader_error(receive->column);
+			if (error) {
+				LOG(receive->id, "Error reading columnar input: %s", error);
+			}
+			receive->column_done = true;
+			return;
+		}
+		if (!receive_deliver(receive, &packet)) {
+			return;
+		}
+	}
+}
+
+static void receive_process(struct receive *receive) {
+	if (receive->column) {
+		receive_process_column(receive);
+		return;
+	}
 	while (receive->buf.length) {
 		struct packet packet = {
 			.source_id = receive->id,
 			.input_stat = &receive->stat,
+			.receive_ns = receive->read_ns,
 		};
 		if (!receive->parser_wrapper(receive, &packet)) {
 			break;
@@ -132,21 +309,213 @@ static void receive_read(struct peer *peer) {
 		if (packet.type == PACKET_TYPE_NONE) {
 			continue;
 		}
-		if (++packet.hops > receive_max_hops) {
-			LOG(receive->id, "Packet exceeded hop limit (%u > %u); dropping. You may have a loop in your configuration.", packet.hops, receive_max_hops);
-			continue;
+		if (!receive_deliver(receive, &packet)) {
+			return;
 		}
-		send_write(&packet);
 	}
+}
 
+static bool receive_check_overrun(struct receive *receive) {
 	if (receive->buf.length == BUF_LEN_MAX) {
 		LOG(receive->id, "Input buffer overrun. This probably means that adsbus doesn't understand the protocol that this source is speaking.");
+		TRACE(packet_dropped, "overrun", receive->id);
+		receive->stats.counters.parse_errors++;
+		size_t i = 0;
+		while (i < NUM_PARSERS && (receive->parser_wrapper == receive_autodetect_parse || parsers[i].parse != receive->parser)) {
+			i++;
+		}
+		receive_parse_errors[i]++;
+		receive_del(receive);
+		return false;
+	}
+	return true;
+}
+
+static ssize_t receive_fill_zstd(struct receive *receive) {
+	ZSTD_inBuffer in = {
+		.src = receive->map,
+		.size = (size_t) receive->stat.st_size,
+		.pos = receive->map_pos,
+	};
+	while (receive->zbuf_pos == receive->zbuf_length && in.pos < in.size) {
+		ZSTD_outBuffer out = {
+			.dst = receive->zbuf,
+			.size = ZSTD_DStreamOutSize(),
+			.pos = 0,
+		};
+		size_t ret = ZSTD_decompressStream(receive->dctx, &out, &in);
+		if (ZSTD_isError(ret)) {
+			LOG(receive->id, "Error decompressing: %s", ZSTD_getErrorName(ret));
+			return -1;
+		}
+		receive->zbuf_pos = 0;
+		receive->zbuf_length = out.pos;
+	}
+	receive->map_pos = in.pos;
+
+	size_t filled = buf_fill_mem(&receive->buf, &receive->zbuf[receive->zbuf_pos], receive->zbuf_length - receive->zbuf_pos);
+	receive->zbuf_pos += filled;
+	return (ssize_t) filled;
+}
+
+static ssize_t receive_fill_block(struct receive *receive) {
+	while (receive->map_pos == receive->block_end) {
+		if (receive->block_next == receive->num_blocks) {
+			return 0;
+		}
+		// Every block repeats the greeting; the parser only needs the first.
+		const struct block_range *block = &receive->blocks[receive->block_next];
+		receive->map_pos = block->offset + (receive->block_next ? block->hello_length : 0);
+		receive->block_end = block->offset + block->length;
+		receive->block_next++;
+	}
+	size_t in = buf_fill_mem(&receive->buf, &receive->map[receive->map_pos], receive->block_end - receive->map_pos);
+	receive->map_pos += in;
+	return (ssize_t) in;
+}
+
+static ssize_t receive_fill_timestamp(struct receive *receive) {
+	struct timespec kernel;
+	ssize_t in = buf_fill_timestamp(&receive->buf, receive->peer.fd, &kernel);
+	if (in > 0 && (kernel.tv_sec || kernel.tv_nsec)) {
+		// Time spent in the socket queue; kernel timestamps are wall clock
+		struct timespec now;
+		assert(!clock_gettime(CLOCK_REALTIME, &now));
+		int64_t delay = (int64_t) (now.tv_sec - kernel.tv_sec) * 1000000000 + (now.tv_nsec - kernel.tv_nsec);
+		if (delay >= 0) {
+			stats_record_latency(&receive->stats, (uint64_t) delay);
+		}
+	}
+	return in;
+}
+
+static ssize_t receive_fill(struct receive *receive) {
+	if (!receive->map) {
+		return receive->timestamps ? receive_fill_timestamp(receive) : buf_fill(&receive->buf, receive->peer.fd);
+	}
+	if (receive->blocks) {
+		return receive_fill_block(receive);
+	}
+	if (receive->dctx) {
+		return receive_fill_zstd(receive);
+	}
+	size_t in = buf_fill_mem(&receive->buf, &receive->map[receive->map_pos], (size_t) receive->stat.st_size - receive->map_pos);
+	receive->map_pos += in;
+	return (ssize_t) in;
+}
+
+static void receive_read_column(struct receive *receive) {
+	receive->read_ns = stats_latency ? monotime_ns() : 0;
+	receive_process(receive);
+	if (receive->replay_held) {
+		peer_epoll_del(&receive->peer);
+		return;
+	}
+	if (receive->column_done) {
 		receive_del(receive);
+	}
+}
+
+static void receive_read(struct peer *peer) {
+	struct receive *receive = container_of(peer, struct receive, peer);
+
+	if (receive->column) {
+		receive_read_column(receive);
 		return;
 	}
+
+	size_t batch = 0;
+	do {
+		PROFILE_ENTER(receive_profile_read);
+		ssize_t in = receive_fill(receive);
+		PROFILE_EXIT();
+		if (in <= 0) {
+			receive_del(receive);
+			return;
+		}
+		batch += (size_t) in;
+		receive->stats.counters.bytes += (uint64_t) in;
+		receive->read_ns = stats_latency ? monotime_ns() : 0;
+
+		receive_process(receive);
+		if (receive->replay_held) {
+			// Stop reading until receive_replay_handler() catches up
+			peer_epoll_del(&receive->peer);
+			return;
+		}
+		if (!receive_check_overrun(receive)) {
+			return;
+		}
+	} while (receive->map && batch < RECEIVE_MAP_BATCH);
 }
 
-static void receive_new(int fd, void __attribute__((unused)) *passthrough, struct peer *on_close) {
+static void receive_map(struct receive *receive) {
+	receive->map = NULL;
+	receive->map_pos = 0;
+	receive->dctx = NULL;
+	receive->blocks = NULL;
+	receive->column = NULL;
+	receive->column_done = false;
+	if (!S_ISREG(receive->stat.st_mode) || !receive->stat.st_size) {
+		return;
+	}
+	void *map = mmap(NULL, (size_t) receive->stat.st_size, PROT_READ, MAP_PRIVATE, receive->peer.fd, 0);
+	if (map == MAP_FAILED) {
+		// Fall back to read()
+		return;
+	}
+	assert(!madvise(map, (size_t) receive->stat.st_size, MADV_SEQUENTIAL));
+	receive->map = map;
+
+	if (block_detect(receive->map, (size_t) receive->stat.st_size)) {
+		uint64_t start = receive->options ? receive->options->range_start : 0;
+		uint64_t end = receive->options ? receive->options->range_end : UINT64_MAX;
+		size_t total;
+		bool indexed;
+		receive->num_blocks = block_select(receive->map, (size_t) receive->stat.st_size, start, end, &receive->blocks, &total, &indexed);
+		receive->block_next = receive->block_end = 0;
+		LOG(receive->id, "Indexed capture: decoding %zu of %zu blocks%s", receive->num_blocks, total, indexed ? "" : " (no index; scanned block headers)");
+		return;
+	}
+
+	if (column_detect(receive->map, (size_t) receive->stat.st_size)) {
+		LOG(receive->id, "Reading columnar input");
+		receive->column = column_reader_new(receive->map, (size_t) receive->stat.st_size);
+		return;
+	}
+
+	// zstd frame magic, little-endian; decompress transparently
+	if (receive->stat.st_size >= 4 &&
+			receive->map[0] == (ZSTD_MAGICNUMBER & 0xff) &&
+			receive->map[1] == ((ZSTD_MAGICNUMBER >> 8) & 0xff) &&
+			receive->map[2] == ((ZSTD_MAGICNUMBER >> 16) & 0xff) &&
+			receive->map[3] == ((ZSTD_MAGICNUMBER >> 24) & 0xff)) {
+		LOG(receive->id, "Decompressing zstd input");
+		receive->dctx = ZSTD_createDCtx();
+		assert(receive->dctx);
+		receive->zbuf = malloc(ZSTD_DStreamOutSize());
+		assert(receive->zbuf);
+		receive->zbuf_pos = receive->zbuf_length = 0;
+	}
+}
+
+static void receive_replay_handler(struct peer *peer) {
+	struct receive *receive = container_of(peer, struct receive, replay_peer);
+
+	receive->replay_held = false;
+	// Pacing delay is intended; count from release instead
+	receive->read_ns = stats_latency ? monotime_ns() : 0;
+	receive->replay_packet.receive_ns = receive->read_ns;
+	receive->stats.counters.packets++;
+	reorder_write(&receive->replay_packet);
+
+	receive_process(receive);
+	if (!receive->replay_held && receive_check_overrun(receive)) {
+		peer_epoll_add(&receive->peer, EPOLLIN);
+	}
+}
+
+static void receive_new(int fd, void *passthrough, struct peer *on_close) {
 	peer_count_in++;
 
 	struct receive *receive = malloc(sizeof(*receive));
@@ -159,13 +528,31 @@ static void receive_new(int fd, void __attribute__((unused)) *passthrough, struc
 	buf_init(&receive->buf);
 	memset(receive->parser_state, 0, PARSER_STATE_LEN);
 	receive->parser_wrapper = receive_autodetect_parse;
+	receive->options = passthrough;
+	receive->replay_peer.fd = -1;
+	receive->replay_peer.event_handler = receive_replay_handler;
+	receive->replay_peer.wakeup_slot = 0;
+	receive->replay_held = false;
+	receive->replay_sources = (struct sourcetable) SOURCETABLE_INIT(struct receive_replay_source);
+	receive->start_ns = monotime_ns();
 	assert(!fstat(fd, &receive->stat));
+	receive_map(receive);
+	// Queue depth only means something for pipes and sockets
+	stats_add(&receive->stats, STATS_KIND_RECEIVE, receive->id, NULL, S_ISREG(receive->stat.st_mode) ? NULL : &receive->peer.fd);
+	receive->read_ns = 0;
+	int timestamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	receive->timestamps = stats_kernel_timestamps && S_ISSOCK(receive->stat.st_mode) && !setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &timestamping, sizeof(timestamping));
+	if (receive->column) {
+		receive->stats.format = "columnar";
+		receive->stats.counters.bytes = (uint64_t) receive->stat.st_size;
+	}
 
 	list_add(&receive->receive_list, &receive_head);
 
 	peer_epoll_add(&receive->peer, EPOLLIN);
 
 	LOG(receive->id, "New receive connection");
+	TRACE(peer_opened, "receive", receive->id);
 }
 
 void receive_init() {
@@ -178,6 +565,25 @@ void receive_init() {
 		assert(max_hops_ul <= UINT32_MAX);
 		receive_max_hops = (uint32_t) max_hops_ul;
 	}
+
+	receive_profile_read = profile_add_stage("receive", "read");
+	receive_profile_autodetect = profile_add_stage("parse", "autodetect");
+	for (size_t i = 0; i < NUM_PARSERS; i++) {
+		parsers[i].profile = profile_add_stage("parse", parsers[i].name);
+	}
+	profile_add_handler(receive_read, "receive");
+	profile_add_handler(receive_replay_handler, "receive");
+
+	char labels[64];
+	for (size_t i = 0; i <= NUM_PARSERS; i++) {
+		snprintf(labels, sizeof(labels), "parser=\"%s\"", i < NUM_PARSERS ? parsers[i].name : "none");
+		metrics_add_counter("adsbus_receive_parse_errors", "Inputs closed on buffer overrun, by detected parser.", labels, &receive_parse_errors[i]);
+	}
+	for (size_t i = 0; i < NUM_PARSERS; i++) {
+		snprintf(labels, sizeof(labels), "parser=\"%s\"", parsers[i].name);
+		metrics_add_counter("adsbus_receive_detected", "Input format autodetection results.", labels, &receive_detected[i]);
+	}
+	metrics_add_counter("adsbus_receive_hop_limit_drops", "Packets dropped for exceeding the hop limit.", NULL, &receive_hop_drops);
 }
 
 void receive_cleanup() {
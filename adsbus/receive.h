@@ -1,9 +1,20 @@
 #pragma once
 
+#include <stdint.h>
+
 #define PARSER_STATE_LEN 256
 
 struct flow;
 
+// Passthrough for receive_flow. speed > 0 paces output by mlat_timestamp;
+// packets outside [range_start, range_end] are dropped, and indexed
+// captures only decode blocks that overlap the range.
+struct receive_options {
+	double speed;
+	uint64_t range_start;
+	uint64_t range_end;
+};
+
 void receive_init(void);
 void receive_cleanup(void);
 void receive_print_usage(void);
@@ -0,0 +1,248 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "monotime.h"
+#include "opts.h"
+#include "packet.h"
+#include "peer.h"
+#include "profile.h"
+#include "server.h"
+#include "sort.h"
+#include "sourcetable.h"
+#include "uuid.h"
+#include "wakeup.h"
+
+#include "reorder.h"
+
+// Merges packets from many receivers into one timestamp-ordered stream.
+// MLAT timestamps are free-running per-receiver clocks, so each source's
+// clock is mapped onto our monotonic clock by tracking the smallest
+// (arrival - timestamp) seen. Packets are then held for a fixed window
+// and released in mapped order; anything that shows up after later
+// packets have already gone out is dropped and counted.
+
+struct reorder_source {
+	uint8_t id[UUID_LEN];
+	bool synced;
+	int64_t offset_ns;
+	uint64_t packets;
+	uint64_t late;
+	uint64_t late_reported;
+	uint64_t late_max_ns;
+};
+
+struct reorder_entry {
+	uint64_t event_ns;
+	uint64_t sequence;
+	struct packet packet;
+	uint8_t source_id[UUID_LEN];
+	// The receive (and its stat) may be gone by the time we release this;
+	// keep what send needs to skip echoing back to the input.
+	dev_t input_dev;
+	ino_t input_ino;
+};
+
+static opts_group reorder_opts;
+
+static char log_module = 'M';
+
+// A jump in (arrival - timestamp) larger than this is a receiver clock
+// reset, not network delay; start tracking that source again.
+#define REORDER_RESYNC_NS (UINT64_C(10) * 1000000000)
+// Slowly forget the minimum, so that drift between the receiver clock and
+// ours doesn't push everything from that source out of the window.
+#define REORDER_OFFSET_DECAY_SHIFT 12
+#define REORDER_REPORT_NS (UINT64_C(10) * 1000000000)
+
+static uint32_t reorder_window_ms = 0;
+
+static struct sourcetable reorder_sources = SOURCETABLE_INIT(struct reorder_source);
+static struct reorder_entry *reorder_heap = NULL;
+static size_t reorder_heap_length = 0, reorder_heap_size = 0;
+static uint64_t reorder_sequence = 0;
+static uint64_t reorder_released_ns = 0;
+static uint64_t reorder_report_ns = 0;
+static struct peer reorder_peer;
+
+static bool reorder_set_window_ms(const char *arg) {
+	return opts_parse_uint32(arg, &reorder_window_ms);
+}
+
+static int64_t reorder_mlat_ns(uint64_t mlat_timestamp) {
+	// Split to avoid overflow near PACKET_MLAT_MAX
+	return (int64_t) ((mlat_timestamp / PACKET_MLAT_MHZ) * 1000 + (mlat_timestamp % PACKET_MLAT_MHZ) * 1000 / PACKET_MLAT_MHZ);
+}
+
+static uint64_t reorder_event_ns(struct reorder_source *source, const struct packet *packet, uint64_t now) {
+	if (!packet->mlat_timestamp) {
+		// No timestamp; arrival order is all we have
+		return now;
+	}
+	int64_t delta = (int64_t) now - reorder_mlat_ns(packet->mlat_timestamp);
+	if (!source->synced || delta < source->offset_ns) {
+		if (source->synced && (uint64_t) (source->offset_ns - delta) > REORDER_RESYNC_NS) {
+			LOG(source->id, "Source clock jumped forward; resynchronizing");
+		}
+		source->synced = true;
+		source->offset_ns = delta;
+	} else if ((uint64_t) (delta - source->offset_ns) > REORDER_RESYNC_NS) {
+		LOG(source->id, "Source clock jumped backward; resynchronizing");
+		source->offset_ns = delta;
+	} else {
+		source->offset_ns += (delta - source->offset_ns) >> REORDER_OFFSET_DECAY_SHIFT;
+	}
+	return (uint64_t) (reorder_mlat_ns(packet->mlat_timestamp) + source->offset_ns);
+}
+
+static bool reorder_less(const struct reorder_entry *a, const struct reorder_entry *b) {
+	if (a->event_ns != b->event_ns) {
+		return a->event_ns < b->event_ns;
+	}
+	return a->sequence < b->sequence;
+}
+
+static void reorder_swap(size_t a, size_t b) {
+	struct reorder_entry tmp = reorder_heap[a];
+	reorder_heap[a] = reorder_heap[b];
+	reorder_heap[b] = tmp;
+}
+
+static void reorder_sift_up(size_t i) {
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!reorder_less(&reorder_heap[i], &reorder_heap[parent])) {
+			break;
+		}
+		reorder_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void reorder_sift_down(size_t i) {
+	while (true) {
+		size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+		if (left < reorder_heap_length && reorder_less(&reorder_heap[left], &reorder_heap[smallest])) {
+			smallest = left;
+		}
+		if (right < reorder_heap_length && reorder_less(&reorder_heap[right], &reorder_heap[smallest])) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			break;
+		}
+		reorder_swap(i, smallest);
+		i = smallest;
+	}
+}
+
+static void reorder_release() {
+	struct reorder_entry entry = reorder_heap[0];
+	reorder_heap[0] = reorder_heap[--reorder_heap_length];
+	reorder_sift_down(0);
+
+	reorder_released_ns = entry.event_ns;
+	entry.packet.source_id = entry.source_id;
+	struct stat input_stat = {
+		.st_dev = entry.input_dev,
+		.st_ino = entry.input_ino,
+	};
+	entry.packet.input_stat = &input_stat;
+	sort_write(&entry.packet);
+}
+
+static void reorder_report() {
+	struct reorder_source *source;
+	size_t iter = 0;
+	while ((source = sourcetable_next(&reorder_sources, &iter))) {
+		if (source->late != source->late_reported) {
+			LOG(source->id, "Dropped %ju late packets (%ju of %ju total, up to %.1fms late)", (uintmax_t) (source->late - source->late_reported), (uintmax_t) source->late, (uintmax_t) source->packets, (double) source->late_max_ns / 1000000);
+			source->late_reported = source->late;
+		}
+	}
+}
+
+static void reorder_arm(uint64_t now) {
+	uint64_t due = reorder_heap[0].event_ns + reorder_window_ms * UINT64_C(1000000);
+	wakeup_add_ns(&reorder_peer, due > now ? due - now : 0);
+}
+
+static void reorder_handler(struct peer __attribute__ ((unused)) *peer) {
+	uint64_t now = monotime_ns();
+	uint64_t window_ns = reorder_window_ms * UINT64_C(1000000);
+	while (reorder_heap_length && reorder_heap[0].event_ns + window_ns <= now) {
+		reorder_release();
+	}
+	if (reorder_heap_length) {
+		reorder_arm(now);
+	}
+	if (now >= reorder_report_ns) {
+		reorder_report();
+		reorder_report_ns = now + REORDER_REPORT_NS;
+	}
+}
+
+void reorder_opts_add() {
+	opts_add("reorder-window-ms", "MS", reorder_set_window_ms, reorder_opts);
+}
+
+void reorder_init() {
+	opts_call(reorder_opts);
+	reorder_peer.fd = -1;
+	reorder_peer.event_handler = reorder_handler;
+	profile_add_handler(reorder_handler, "reorder");
+}
+
+void reorder_cleanup() {
+	if (!reorder_window_ms) {
+		return;
+	}
+	wakeup_cancel(&reorder_peer);
+	// Inputs are done; nothing else can arrive, so drain in order.
+	while (reorder_heap_length) {
+		reorder_release();
+	}
+	reorder_report();
+	free(reorder_heap);
+	sourcetable_cleanup(&reorder_sources);
+}
+
+void reorder_write(struct packet *packet) {
+	if (!reorder_window_ms) {
+		sort_write(packet);
+		return;
+	}
+	uint64_t now = monotime_ns();
+	struct reorder_source *source = sourcetable_get(&reorder_sources, packet->source_id);
+	source->packets++;
+	uint64_t event_ns = reorder_event_ns(source, packet, now);
+	if (event_ns < reorder_released_ns) {
+		source->late++;
+		if (reorder_released_ns - event_ns > source->late_max_ns) {
+			source->late_max_ns = reorder_released_ns - event_ns;
+		}
+		return;
+	}
+
+	if (reorder_heap_length == reorder_heap_size) {
+		reorder_heap_size = reorder_heap_size ? reorder_heap_size * 2 : 1024;
+		reorder_heap = realloc(reorder_heap, reorder_heap_size * sizeof(*reorder_heap));
+		assert(reorder_heap);
+	}
+	struct reorder_entry *entry = &reorder_heap[reorder_heap_length];
+	entry->event_ns = event_ns;
+	entry->sequence = reorder_sequence++;
+	memcpy(&entry->packet, packet, sizeof(entry->packet));
+	entry->input_dev = packet->input_stat->st_dev;
+	entry->input_ino = packet->input_stat->st_ino;
+	memcpy(entry->source_id, packet->source_id, UUID_LEN);
+	reorder_sift_up(reorder_heap_length++);
+
+	if (reorder_heap[0].sequence == reorder_sequence - 1) {
+		// New earliest deadline
+		wakeup_cancel(&reorder_peer);
+		reorder_arm(now);
+	}
+}
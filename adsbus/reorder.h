@@ -0,0 +1,8 @@
+#pragma once
+
+struct packet;
+
+void reorder_opts_add(void);
+void reorder_init(void);
+void reorder_cleanup(void);
+void reorder_write(struct packet *);
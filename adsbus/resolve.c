@@ -1,31 +1,247 @@
+#include <assert.h>
 #include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "asyncaddrinfo.h"
+#include "list.h"
+#include "opts.h"
 #include "peer.h"
 
 #include "resolve.h"
 
-void resolve_init() {
-	asyncaddrinfo_init(2);
+// One cached (or in-flight) lookup. Identical lookups share an entry.
+struct resolve_entry {
+	char *node;
+	char *service;
+	int flags;
+	bool pending;
+	int err;
+	struct addrinfo *addrs;
+	time_t expires;
+	struct list_head waiter_head;
+	struct list_head entry_list;
+};
+
+struct resolve_waiter {
+	struct peer *peer;
+	int err;
+	struct addrinfo *addrs;
+	struct list_head waiter_list;
+};
+
+static struct list_head resolve_entry_head = LIST_HEAD_INIT(resolve_entry_head);
+static struct list_head resolve_ready_head = LIST_HEAD_INIT(resolve_ready_head);
+static struct resolve_waiter *resolve_current = NULL;
+static struct peer resolve_peer;
+static opts_group resolve_opts;
+
+static uint32_t resolve_threads = 2;
+static uint32_t resolve_cache_ttl = 60;
+static uint32_t resolve_negative_ttl = 5;
+
+static bool resolve_set_threads(const char *arg) {
+	return opts_parse_uint32(arg, &resolve_threads) && resolve_threads > 0;
 }
 
-void resolve_cleanup() {
-	asyncaddrinfo_cleanup();
+static bool resolve_set_cache_ttl(const char *arg) {
+	return opts_parse_uint32(arg, &resolve_cache_ttl);
 }
 
-void resolve(struct peer *peer, const char *node, const char *service, int flags) {
+static bool resolve_set_negative_ttl(const char *arg) {
+	return opts_parse_uint32(arg, &resolve_negative_ttl);
+}
+
+static time_t resolve_now() {
+	struct timespec now;
+	assert(!clock_gettime(CLOCK_MONOTONIC_COARSE, &now));
+	return now.tv_sec;
+}
+
+static bool resolve_str_eq(const char *a, const char *b) {
+	if (!a || !b) {
+		return a == b;
+	}
+	return !strcmp(a, b);
+}
+
+static struct addrinfo *resolve_copy(const struct addrinfo *addrs) {
+	// Every waiter gets its own copy, freed with resolve_free().
+	struct addrinfo *ret = NULL, **tail = &ret;
+	for (; addrs; addrs = addrs->ai_next) {
+		struct addrinfo *copy = malloc(sizeof(*copy) + addrs->ai_addrlen);
+		assert(copy);
+		memcpy(copy, addrs, sizeof(*copy));
+		copy->ai_addr = (struct sockaddr *) (copy + 1);
+		memcpy(copy->ai_addr, addrs->ai_addr, addrs->ai_addrlen);
+		copy->ai_canonname = NULL;
+		copy->ai_next = NULL;
+		*tail = copy;
+		tail = &copy->ai_next;
+	}
+	return ret;
+}
+
+static void resolve_entry_del(struct resolve_entry *entry) {
+	assert(list_is_empty(&entry->waiter_head));
+	list_del(&entry->entry_list);
+	if (entry->addrs) {
+		freeaddrinfo(entry->addrs);
+	}
+	free(entry->node);
+	free(entry->service);
+	free(entry);
+}
+
+static void resolve_waiter_del(struct resolve_waiter *waiter) {
+	list_del(&waiter->waiter_list);
+	resolve_free(waiter->addrs);
+	free(waiter);
+}
+
+static void resolve_waiter_ready(struct resolve_waiter *waiter, struct resolve_entry *entry) {
+	waiter->err = entry->err;
+	waiter->addrs = entry->err ? NULL : resolve_copy(entry->addrs);
+	list_add(&waiter->waiter_list, &resolve_ready_head);
+}
+
+static struct resolve_entry *resolve_find(const char *node, const char *service, int flags) {
+	time_t now = resolve_now();
+	struct resolve_entry *iter, *next;
+	list_for_each_entry_safe(iter, next, &resolve_entry_head, entry_list) {
+		if (!iter->pending && iter->expires <= now) {
+			resolve_entry_del(iter);
+			continue;
+		}
+		if (iter->flags == flags && resolve_str_eq(iter->node, node) && resolve_str_eq(iter->service, service)) {
+			return iter;
+		}
+	}
+	return NULL;
+}
+
+static struct resolve_entry *resolve_entry_new(const char *node, const char *service, int flags) {
+	struct resolve_entry *entry = malloc(sizeof(*entry));
+	assert(entry);
+	entry->node = node ? strdup(node) : NULL;
+	entry->service = service ? strdup(service) : NULL;
+	entry->flags = flags;
+	entry->pending = true;
+	entry->err = 0;
+	entry->addrs = NULL;
+	entry->expires = 0;
+	list_head_init(&entry->waiter_head);
+	list_add(&entry->entry_list, &resolve_entry_head);
+
 	struct addrinfo hints = {
 		.ai_flags = AI_V4MAPPED | flags,
 		.ai_family = AF_UNSPEC,
 		.ai_socktype = SOCK_STREAM,
 	};
+	asyncaddrinfo_resolve(node, service, &hints, entry);
+	return entry;
+}
+
+static void resolve_handler(struct peer *peer) {
+	eventfd_t value;
+	assert(!eventfd_read(peer->fd, &value));
+
+	void *passthrough;
+	int err;
+	struct addrinfo *addrs;
+	while (asyncaddrinfo_result(&passthrough, &err, &addrs)) {
+		struct resolve_entry *entry = passthrough;
+		entry->pending = false;
+		entry->err = err;
+		entry->addrs = addrs;
+		entry->expires = resolve_now() + (err ? resolve_negative_ttl : resolve_cache_ttl);
+
+		struct resolve_waiter *iter, *next;
+		list_for_each_entry_safe(iter, next, &entry->waiter_head, waiter_list) {
+			list_del(&iter->waiter_list);
+			resolve_waiter_ready(iter, entry);
+		}
+	}
 
-	peer->fd = asyncaddrinfo_resolve(node, service, &hints);
-	peer_epoll_add(peer, EPOLLIN);
+	// Handlers may call resolve() again; always take from the head.
+	while (!list_is_empty(&resolve_ready_head)) {
+		struct resolve_waiter *waiter = list_entry(resolve_ready_head.next, struct resolve_waiter, waiter_list);
+		resolve_current = waiter;
+		peer_call(waiter->peer);
+		resolve_current = NULL;
+		resolve_waiter_del(waiter);
+	}
 }
 
-int resolve_result(struct peer *peer, struct addrinfo **addrs) {
-	int err = asyncaddrinfo_result(peer->fd, addrs);
+void resolve_opts_add() {
+	opts_add("resolve-threads", "COUNT", resolve_set_threads, resolve_opts);
+	opts_add("resolve-cache-ttl", "SECONDS", resolve_set_cache_ttl, resolve_opts);
+	opts_add("resolve-negative-ttl", "SECONDS", resolve_set_negative_ttl, resolve_opts);
+}
+
+void resolve_init() {
+	opts_call(resolve_opts);
+	asyncaddrinfo_init(resolve_threads);
+
+	resolve_peer.fd = asyncaddrinfo_fd();
+	resolve_peer.event_handler = resolve_handler;
+	peer_epoll_add(&resolve_peer, EPOLLIN);
+}
+
+void resolve_cleanup() {
+	// asyncaddrinfo owns the fd
+	peer_epoll_del(&resolve_peer);
+	asyncaddrinfo_cleanup();
+
+	struct resolve_waiter *waiter, *next_waiter;
+	list_for_each_entry_safe(waiter, next_waiter, &resolve_ready_head, waiter_list) {
+		resolve_waiter_del(waiter);
+	}
+
+	struct resolve_entry *entry, *next_entry;
+	list_for_each_entry_safe(entry, next_entry, &resolve_entry_head, entry_list) {
+		list_for_each_entry_safe(waiter, next_waiter, &entry->waiter_head, waiter_list) {
+			resolve_waiter_del(waiter);
+		}
+		resolve_entry_del(entry);
+	}
+}
+
+void resolve(struct peer *peer, const char *node, const char *service, int flags) {
+	struct resolve_waiter *waiter = malloc(sizeof(*waiter));
+	assert(waiter);
+	waiter->peer = peer;
+	waiter->addrs = NULL;
 	peer->fd = -1;
-	return err;
+
+	struct resolve_entry *entry = resolve_find(node, service, flags);
+	if (!entry) {
+		entry = resolve_entry_new(node, service, flags);
+	}
+
+	if (entry->pending) {
+		list_add(&waiter->waiter_list, &entry->waiter_head);
+	} else {
+		// Cache hit; deliver from the event loop, never re-entrantly.
+		resolve_waiter_ready(waiter, entry);
+		assert(!eventfd_write(resolve_peer.fd, 1));
+	}
+}
+
+int resolve_result(struct peer *peer, struct addrinfo **addrs) {
+	assert(resolve_current && resolve_current->peer == peer);
+	*addrs = resolve_current->addrs;
+	resolve_current->addrs = NULL;
+	return resolve_current->err;
+}
+
+void resolve_free(struct addrinfo *addrs) {
+	while (addrs) {
+		struct addrinfo *next = addrs->ai_next;
+		free(addrs);
+		addrs = next;
+	}
 }
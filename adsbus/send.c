@@ -2,25 +2,38 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "aircraft.h"
 #include "airspy_adsb.h"
 #include "beast.h"
 #include "buf.h"
+#include "capture.h"
+#include "cpr.h"
+#include "dedup.h"
+#include "filter.h"
 #include "flow.h"
 #include "json.h"
 #include "log.h"
+#include "monotime.h"
 #include "opts.h"
 #include "packet.h"
 #include "peer.h"
+#include "profile.h"
 #include "proto.h"
+#include "ratelimit.h"
 #include "raw.h"
+#include "server.h"
 #include "socket.h"
+#include "sort.h"
+#include "sourcestats.h"
 #include "stats.h"
+#include "trace.h"
 #include "uuid.h"
 
 #include "send.h"
@@ -30,7 +43,9 @@ struct send {
 	struct stat stat;
 	struct peer *on_close;
 	uint8_t id[UUID_LEN];
-	struct serializer *serializer;
+	struct send_group *group;
+	struct capture *capture;
+	struct stats_entry stats;
 	struct list_head send_list;
 };
 
@@ -54,7 +69,12 @@ static struct serializer {
 	char *name;
 	serialize serialize;
 	hello hello;
-	struct list_head send_head;
+	// Called when an output asks for this format
+	void (*enable)(void);
+	// Written on a timer through send_write_format(), never per packet
+	bool timed;
+	uint32_t profile;
+	struct list_head group_head;
 } serializers[] = {
 	{
 		.name = "airspy_adsb",
@@ -66,6 +86,12 @@ static struct serializer {
 		.serialize = beast_serialize,
 		.hello = NULL,
 	},
+	{
+		// Written from packets by the capture writer; regular files only
+		.name = "columnar",
+		.serialize = NULL,
+		.hello = NULL,
+	},
 	{
 		.name = "json",
 		.serialize = json_serialize,
@@ -81,21 +107,62 @@ static struct serializer {
 		.serialize = raw_serialize,
 		.hello = NULL,
 	},
+	{
+		.name = "sourcestats",
+		.serialize = sourcestats_serialize,
+		.hello = NULL,
+		.enable = sourcestats_enable,
+	},
 	{
 		.name = "stats",
-		.serialize = stats_serialize,
+		.serialize = NULL,
 		.hello = NULL,
+		.enable = stats_enable,
+		.timed = true,
 	},
 };
 #define NUM_SERIALIZERS (sizeof(serializers) / sizeof(*serializers))
 
+// What a send flow's passthrough points to: a format plus whatever
+// suffixes followed it ("beast+dedup+df:17"). Outputs with the same
+// format, dedup setting, filter and rate limit share a group, so each
+// packet is matched once per group and serialized at most once per format.
+struct send_group {
+	char *name;
+	struct serializer *serializer;
+	bool dedup;
+	struct filter *filter;
+	struct ratelimit *ratelimit;
+	struct list_head send_head;
+	struct list_head group_list;
+};
+
+#define SEND_DEDUP_TERM "dedup"
+
+static uint32_t send_dedup_count = 0;
+static uint32_t send_profile_sanity, send_profile_write;
+
+static bool send_from_packets(const struct serializer *serializer) {
+	// Built from packets by the capture writer rather than serialized
+	return !serializer->serialize && !serializer->timed;
+}
+
 static void send_del(struct send *send) {
 	LOG(send->id, "Connection closed");
+	TRACE(peer_closed, "send", send->id);
 	peer_count_out--;
+	stats_del(&send->stats);
+	if (send->group->dedup) {
+		send_dedup_count--;
+	}
+	if (send->capture) {
+		capture_del(send->capture);
+	}
 	peer_close(&send->peer);
 	list_del(&send->send_list);
 	peer_call(send->on_close);
-	free(send);
+	// An EPOLLERR/EPOLLHUP for it may be later in this epoll batch
+	peer_free(send);
 }
 
 static void send_del_wrapper(struct peer *peer) {
@@ -103,7 +170,8 @@ static void send_del_wrapper(struct peer *peer) {
 }
 
 static void send_new(int fd, void *passthrough, struct peer *on_close) {
-	struct serializer *serializer = (struct serializer *) passthrough;
+	struct send_group *group = (struct send_group *) passthrough;
+	struct serializer *serializer = group->serializer;
 
 	peer_count_out++;
 
@@ -114,87 +182,354 @@ static void send_new(int fd, void *passthrough, struct peer *on_close) {
 	send->peer.event_handler = send_del_wrapper;
 	send->on_close = on_close;
 	uuid_gen(send->id);
-	send->serializer = serializer;
+	send->group = group;
 	assert(!fstat(fd, &send->stat));
+	send->capture = S_ISREG(send->stat.st_mode) ? capture_new(fd, send->id, &send->peer, send_from_packets(serializer)) : NULL;
+	stats_add(&send->stats, STATS_KIND_SEND, send->id, group->name, send->capture ? NULL : &send->peer.fd);
 
-	list_add(&send->send_list, &serializer->send_head);
+	if (group->dedup) {
+		send_dedup_count++;
+	}
+	list_add(&send->send_list, &group->send_head);
 
 	peer_epoll_add(&send->peer, 0);
 
-	LOG(send->id, "New send connection: %s", serializer->name);
+	LOG(send->id, "New send connection: %s", group->name);
+	TRACE(peer_opened, "send", send->id);
+
+	// Sockets and pipes are rejected at option time; this catches a file
+	// path that turns out to be a fifo or device.
+	if (send_from_packets(serializer) && !send->capture) {
+		LOG(send->id, "Format %s needs a regular file", serializer->name);
+		send_del(send);
+	}
 }
 
-static struct serializer *send_parse_format(const char **arg) {
+static struct send_group *send_parse_format(const char **arg, bool regular) {
 	char *format = opts_split(arg, '=');
 	if (!format) {
 		return NULL;
 	}
 
-	struct serializer *serializer = send_get_serializer(format);
+	if (!send_check_output(format, regular)) {
+		free(format);
+		return NULL;
+	}
+	struct send_group *group = send_get_serializer(format);
 	free(format);
-	if (!serializer) {
+	if (!group) {
 		return NULL;
 	}
 
-	return serializer;
+	return group;
+}
+
+static void send_group_del(struct send_group *group) {
+	list_del(&group->group_list);
+	if (group->filter) {
+		filter_del(group->filter);
+	}
+	if (group->ratelimit) {
+		ratelimit_del(group->ratelimit, group->name);
+	}
+	free(group->name);
+	free(group);
+}
+
+static void send_write_group(struct send_group *group, const struct packet *packet, const void *data, size_t len) {
+	struct send *iter, *next;
+	list_for_each_entry_safe(iter, next, &group->send_head, send_list) {
+		if (packet->input_stat &&
+				iter->stat.st_dev == packet->input_stat->st_dev &&
+				iter->stat.st_ino == packet->input_stat->st_ino) {
+			// Same socket that this packet came from
+			continue;
+		}
+		// Before the write, which may free iter
+		iter->stats.counters.packets++;
+		iter->stats.counters.bytes += len;
+		if (packet->receive_ns) {
+			stats_record_latency(&iter->stats, monotime_ns() - packet->receive_ns);
+		}
+		TRACE(packet_written, iter->id, iter->group->name, len);
+		PROFILE_ENTER(send_profile_write);
+		bool alive = true, failed = false;
+		if (iter->capture) {
+			// On failure, on_error has already deleted iter
+			alive = capture_write(iter->capture, packet, data, len);
+		} else if (write(iter->peer.fd, data, len) != (ssize_t) len) {
+			iter->stats.counters.drops++;
+			failed = true;
+		}
+		PROFILE_EXIT();
+		if (!alive) {
+			continue;
+		}
+		if (failed) {
+			if (!S_ISSOCK(iter->stat.st_mode)) {
+				// Pipes can't be half-closed, and anything written after a
+				// short write would land mid-frame; close now. send_del()
+				// closes the fd, so a pending event for it is skipped, and
+				// the memory outlives the current epoll batch.
+				send_del(iter);
+				continue;
+			}
+			// peer_loop() will see this shutdown and call send_del
+			// Ignore error
+			shutdown(iter->peer.fd, SHUT_WR);
+		}
+	}
+}
+
+static void send_write_head(struct packet *packet, bool dedup) {
+	struct filter_packet fp = {
+		.packet = packet,
+	};
+	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
+		struct serializer *serializer = &serializers[i];
+		if (serializer->timed) {
+			continue;
+		}
+		struct buf buf = BUF_INIT;
+		bool serialized = false;
+		struct send_group *group;
+		list_for_each_entry(group, &serializer->group_head, group_list) {
+			if (group->dedup != dedup || list_is_empty(&group->send_head) || !filter_match(group->filter, &fp)) {
+				continue;
+			}
+			// Last, so that only packets we'd otherwise send use up tokens
+			if (group->ratelimit && !ratelimit_pass(group->ratelimit, &fp)) {
+				continue;
+			}
+			if (!serialized) {
+				if (serializer->serialize) {
+					PROFILE_ENTER(serializer->profile);
+					serializer->serialize(packet, &buf);
+					PROFILE_EXIT();
+				}
+				serialized = true;
+			}
+			if (serializer->serialize && buf.length == 0) {
+				break;
+			}
+			send_write_group(group, packet, buf_at(&buf, 0), buf.length);
+		}
+	}
 }
 
 void send_init() {
 	assert(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
 	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
-		list_head_init(&serializers[i].send_head);
+		list_head_init(&serializers[i].group_head);
+		serializers[i].profile = profile_add_stage("serialize", serializers[i].name);
 	}
+	send_profile_sanity = profile_add_stage("send", "sanity");
+	send_profile_write = profile_add_stage("send", "write");
+	profile_add_handler(send_del_wrapper, "send");
 }
 
 void send_cleanup() {
 	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
-		struct send *iter, *next;
-		list_for_each_entry_safe(iter, next, &serializers[i].send_head, send_list) {
-			send_del(iter);
+		struct send_group *group, *next_group;
+		list_for_each_entry_safe(group, next_group, &serializers[i].group_head, group_list) {
+			struct send *iter, *next;
+			list_for_each_entry_safe(iter, next, &group->send_head, send_list) {
+				send_del(iter);
+			}
+			send_group_del(group);
 		}
 	}
+	filter_cleanup();
 }
 
-void *send_get_serializer(const char *name) {
+static struct serializer *send_parse_spec(const char *name, bool *dedup, struct filter **filter, struct ratelimit **ratelimit) {
+	// Splits "FORMAT+term+term..." without side effects; on success the
+	// caller owns *filter and *ratelimit.
+	char *spec = strdup(name);
+	assert(spec);
+	char *terms = strchr(spec, '+');
+	if (terms) {
+		*terms++ = '\0';
+	}
+
+	struct serializer *serializer = NULL;
 	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
-		if (strcasecmp(serializers[i].name, name) == 0) {
-			return &serializers[i];
+		if (!strcasecmp(serializers[i].name, spec)) {
+			serializer = &serializers[i];
+			break;
 		}
 	}
-	return NULL;
+	if (!serializer) {
+		free(spec);
+		return NULL;
+	}
+
+	*dedup = false;
+	*filter = NULL;
+	*ratelimit = NULL;
+	while (terms) {
+		char *term = terms;
+		terms = strchr(terms, '+');
+		if (terms) {
+			*terms++ = '\0';
+		}
+		if (!strcasecmp(term, SEND_DEDUP_TERM)) {
+			*dedup = true;
+			continue;
+		}
+		if (!ratelimit_is_term(term)) {
+			if (!*filter) {
+				*filter = filter_new();
+			}
+			if (filter_add_term(*filter, term)) {
+				continue;
+			}
+		} else if (!*ratelimit) {
+			*ratelimit = ratelimit_new(term);
+			if (*ratelimit) {
+				continue;
+			}
+		}
+		if (*filter) {
+			filter_del(*filter);
+		}
+		if (*ratelimit) {
+			ratelimit_del(*ratelimit, name);
+		}
+		free(spec);
+		return NULL;
+	}
+	free(spec);
+	return serializer;
+}
+
+bool send_check_format(const char *name) {
+	bool dedup;
+	struct filter *filter;
+	struct ratelimit *ratelimit;
+	if (!send_parse_spec(name, &dedup, &filter, &ratelimit)) {
+		return false;
+	}
+	if (filter) {
+		filter_del(filter);
+	}
+	if (ratelimit) {
+		ratelimit_del(ratelimit, name);
+	}
+	return true;
+}
+
+bool send_check_output(const char *name, bool regular) {
+	// Rejects, at option time, outputs that can't work on a socket or pipe
+	if (regular) {
+		return true;
+	}
+	bool dedup;
+	struct filter *filter;
+	struct ratelimit *ratelimit;
+	struct serializer *serializer = send_parse_spec(name, &dedup, &filter, &ratelimit);
+	if (!serializer) {
+		return true;
+	}
+	if (filter) {
+		filter_del(filter);
+	}
+	if (ratelimit) {
+		ratelimit_del(ratelimit, name);
+	}
+	if (send_from_packets(serializer)) {
+		fprintf(stderr, "Format needs a regular file: %s\n", name);
+		return false;
+	}
+	// --sort writes everything at exit, after the event loop has stopped;
+	// a socket or pipe would drop whatever didn't fit in its buffer.
+	if (sort_enabled && !serializer->timed) {
+		fprintf(stderr, "--sort needs regular file outputs: %s\n", name);
+		return false;
+	}
+	return true;
+}
+
+void *send_get_serializer(const char *name) {
+	// Returns the group for this format and suffixes, creating it if needed
+	bool dedup;
+	struct filter *filter;
+	struct ratelimit *ratelimit;
+	struct serializer *serializer = send_parse_spec(name, &dedup, &filter, &ratelimit);
+	if (!serializer) {
+		return NULL;
+	}
+	if (serializer->enable) {
+		serializer->enable();
+	}
+	if (filter) {
+		filter_compile(filter);
+	}
+
+	struct send_group *group;
+	list_for_each_entry(group, &serializer->group_head, group_list) {
+		if (group->dedup == dedup && filter_equal(group->filter, filter) && ratelimit_equal(group->ratelimit, ratelimit)) {
+			if (filter) {
+				filter_del(filter);
+			}
+			if (ratelimit) {
+				ratelimit_del(ratelimit, name);
+			}
+			return group;
+		}
+	}
+	group = malloc(sizeof(*group));
+	assert(group);
+	group->name = strdup(name);
+	assert(group->name);
+	group->serializer = serializer;
+	group->dedup = dedup;
+	group->filter = filter;
+	group->ratelimit = ratelimit;
+	list_head_init(&group->send_head);
+	list_add(&group->group_list, &serializer->group_head);
+	return group;
 }
 
 void send_get_hello(struct buf **buf_pp, void *passthrough) {
-	struct serializer *serializer = (struct serializer *) passthrough;
-	if (serializer->hello) {
-		serializer->hello(buf_pp);
+	struct send_group *group = (struct send_group *) passthrough;
+	if (group->serializer->hello) {
+		group->serializer->hello(buf_pp);
 	}
 }
 
 void send_write(struct packet *packet) {
+	PROFILE_ENTER(send_profile_sanity);
 	packet_sanity_check(packet);
+	PROFILE_EXIT();
+	if (packet->receive_ns) {
+		stats_record_queue_latency(monotime_ns() - packet->receive_ns);
+	}
+	bool have_position = cpr_update(packet);
+	aircraft_update(packet, have_position);
+	send_write_head(packet, false);
+	if (send_dedup_count) {
+		dedup_write(packet);
+	}
+}
+
+void send_write_unique(struct packet *packet) {
+	send_write_head(packet, true);
+}
+
+void send_write_format(const char *name, const void *data, size_t len) {
+	// For formats not driven by packets; goes to every output of the format
+	struct packet packet = {
+		.type = PACKET_TYPE_NONE,
+		.source_id = server_id,
+	};
 	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
-		struct serializer *serializer = &serializers[i];
-		if (list_is_empty(&serializer->send_head)) {
+		if (strcasecmp(serializers[i].name, name)) {
 			continue;
 		}
-		struct buf buf = BUF_INIT;
-		serializer->serialize(packet, &buf);
-		if (buf.length == 0) {
-			continue;
-		}
-		struct send *iter, *next;
-		list_for_each_entry_safe(iter, next, &serializer->send_head, send_list) {
-			if (iter->stat.st_dev == packet->input_stat->st_dev &&
-					iter->stat.st_ino == packet->input_stat->st_ino) {
-				// Same socket that this packet came from
-				continue;
-			}
-			if (write(iter->peer.fd, buf_at(&buf, 0), buf.length) != (ssize_t) buf.length) {
-				// peer_loop() will see this shutdown and call send_del
-				// Ignore error
-				shutdown(iter->peer.fd, SHUT_WR);
-			}
+		struct send_group *group;
+		list_for_each_entry(group, &serializers[i].group_head, group_list) {
+			send_write_group(group, &packet, data, len);
 		}
 	}
 }
@@ -204,12 +539,30 @@ void send_print_usage() {
 	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
 		fprintf(stderr, "\t%s\n", serializers[i].name);
 	}
+	fprintf(stderr, "Send formats take optional +suffixes (e.g. beast+dedup+df:17,18):\n");
+	fprintf(stderr, "\t+dedup\t\tsuppress duplicate packets\n");
+	fprintf(stderr, "\t+rate:N\t\tat most N position/velocity/other messages per aircraft per second; identity and Comm-B only on change\n");
+	fprintf(stderr, "\t+valid\t\tdrop DF11/17/18 frames that fail parity\n");
+	fprintf(stderr, "\t+df:N,...\tonly these downlink formats\n");
+	fprintf(stderr, "\t+type:T,...\tonly these packet types (ac, short, long)\n");
+	fprintf(stderr, "\t+icao:HEX,...\tonly these aircraft addresses\n");
+	fprintf(stderr, "\t+source:UUID,...\tonly packets from these sources\n");
+	fprintf(stderr, "\t+area:LAT,LON,...\tonly aircraft inside this box (2 points) or polygon\n");
 }
 
 bool send_add(bool (*next)(const char *, struct flow *, void *), struct flow *flow, const char *arg) {
-	struct serializer *serializer = send_parse_format(&arg);
-	if (!serializer) {
+	// For sockets and pipes
+	struct send_group *group = send_parse_format(&arg, false);
+	if (!group) {
+		return false;
+	}
+	return next(arg, flow, group);
+}
+
+bool send_add_file(bool (*next)(const char *, struct flow *, void *), struct flow *flow, const char *arg) {
+	struct send_group *group = send_parse_format(&arg, true);
+	if (!group) {
 		return false;
 	}
-	return next(arg, flow, serializer);
+	return next(arg, flow, group);
 }
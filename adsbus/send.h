@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct buf;
 struct flow;
@@ -8,9 +9,14 @@ struct packet;
 
 void send_init(void);
 void send_cleanup(void);
+bool send_check_format(const char *);
+bool send_check_output(const char *, bool);
 void *send_get_serializer(const char *);
 void send_get_hello(struct buf **, void *);
 void send_write(struct packet *);
+void send_write_unique(struct packet *);
+void send_write_format(const char *, const void *, size_t);
 void send_print_usage(void);
 bool send_add(bool (*)(const char *, struct flow *, void *), struct flow *, const char *);
+bool send_add_file(bool (*)(const char *, struct flow *, void *), struct flow *, const char *);
 extern struct flow *send_flow;
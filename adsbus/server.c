@@ -7,6 +7,7 @@
 
 #include <jansson.h>
 #include <protobuf-c/protobuf-c.h>
+#include <zstd.h>
 
 #include "build.h"
 #include "log.h"
@@ -65,6 +66,7 @@ void server_init() {
 	LOG(server_id, "\tglibc_version: %d.%d", __GLIBC__, __GLIBC_MINOR__);
 	LOG(server_id, "\tjansson_version: %s", JANSSON_VERSION);
 	LOG(server_id, "\tprotobuf-c_version: %s", PROTOBUF_C_VERSION);
+	LOG(server_id, "\tzstd_version: %s", ZSTD_VERSION_STRING);
 	LOG(server_id, "\tdatetime: %s", __DATE__ " " __TIME__);
 	LOG(server_id, "\tusername: %s", USERNAME);
 	LOG(server_id, "\thostname: %s", HOSTNAME);
@@ -0,0 +1,305 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "opts.h"
+#include "packet.h"
+#include "send.h"
+#include "server.h"
+#include "uuid.h"
+
+#include "sort.h"
+
+// External merge sort of everything received, by mlat_timestamp then
+// source_id. Packets are collected into sorted runs of bounded size,
+// spilled to anonymous temporary files, and k-way merged to the outputs
+// once the inputs are done. The merge runs after the event loop has
+// stopped, so outputs must be regular files; send rejects the rest.
+
+struct sort_record {
+	uint64_t mlat_timestamp;
+	uint64_t sequence;
+	uint8_t source_id[UUID_LEN];
+	uint32_t rssi;
+	uint32_t hops;
+	uint8_t type;
+	bool crc_invalid;
+	uint8_t payload[PACKET_DATA_LEN_MAX];
+};
+
+struct sort_run {
+	int fd;
+	size_t records;
+	size_t read;
+	struct sort_record *buf;
+	size_t buf_length;
+	size_t buf_pos;
+};
+
+static opts_group sort_opts;
+
+static char log_module = 'S'; // borrowing
+
+// Minimum records buffered per run while merging
+#define SORT_MERGE_BUF_MIN 1024
+
+bool sort_enabled = false;
+static uint32_t sort_memory_mb = 256;
+static char *sort_temp_dir = NULL;
+
+static struct sort_record *sort_records = NULL;
+static size_t sort_records_length = 0;
+static size_t sort_records_size = 0;
+static uint64_t sort_sequence = 0;
+static struct sort_run *sort_runs = NULL;
+static size_t sort_runs_length = 0;
+
+static bool sort_set(const char __attribute__ ((unused)) *arg) {
+	sort_enabled = true;
+	return true;
+}
+
+static bool sort_set_memory_mb(const char *arg) {
+	return opts_parse_uint32(arg, &sort_memory_mb) && sort_memory_mb > 0;
+}
+
+static bool sort_set_temp_dir(const char *arg) {
+	free(sort_temp_dir);
+	sort_temp_dir = strdup(arg);
+	assert(sort_temp_dir);
+	return true;
+}
+
+static int sort_compare(const void *a_ptr, const void *b_ptr) {
+	const struct sort_record *a = a_ptr, *b = b_ptr;
+	if (a->mlat_timestamp != b->mlat_timestamp) {
+		return a->mlat_timestamp < b->mlat_timestamp ? -1 : 1;
+	}
+	int ret = memcmp(a->source_id, b->source_id, UUID_LEN);
+	if (ret) {
+		return ret;
+	}
+	// Keep arrival order for ties, so output is deterministic
+	return a->sequence < b->sequence ? -1 : (a->sequence > b->sequence);
+}
+
+static void sort_emit(const struct sort_record *record) {
+	static struct stat no_input;
+	struct packet packet = {
+		.source_id = record->source_id,
+		.input_stat = &no_input,
+		.type = (enum packet_type) record->type,
+		.hops = record->hops,
+		.mlat_timestamp = record->mlat_timestamp,
+		.rssi = record->rssi,
+		.crc_invalid = record->crc_invalid,
+	};
+	memcpy(packet.payload, record->payload, sizeof(packet.payload));
+	send_write(&packet);
+}
+
+static int sort_temp_open() {
+	const char *dir = sort_temp_dir ? sort_temp_dir : (getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd >= 0) {
+		return fd;
+	}
+	// Filesystem without O_TMPFILE; unlink it ourselves
+	char path[4096];
+	assert((size_t) snprintf(path, sizeof(path), "%s/adsbus-sort-XXXXXX", dir) < sizeof(path));
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd >= 0) {
+		assert(!unlink(path));
+	}
+	return fd;
+}
+
+static void sort_spill() {
+	qsort(sort_records, sort_records_length, sizeof(*sort_records), sort_compare);
+
+	int fd = sort_temp_open();
+	if (fd < 0) {
+		LOG(server_id, "Error creating sort run file: %s", strerror(errno));
+	}
+	assert(fd >= 0);
+	const uint8_t *iter = (const uint8_t *) sort_records;
+	size_t len = sort_records_length * sizeof(*sort_records);
+	while (len) {
+		ssize_t ret = write(fd, iter, len);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			LOG(server_id, "Error writing sort run: %s", strerror(errno));
+		}
+		assert(ret > 0);
+		iter += ret;
+		len -= (size_t) ret;
+	}
+
+	sort_runs = realloc(sort_runs, (sort_runs_length + 1) * sizeof(*sort_runs));
+	assert(sort_runs);
+	sort_runs[sort_runs_length++] = (struct sort_run) {
+		.fd = fd,
+		.records = sort_records_length,
+	};
+	LOG(server_id, "Spilled sort run %zu (%zu packets)", sort_runs_length, sort_records_length);
+	sort_records_length = 0;
+}
+
+static bool sort_run_fill(struct sort_run *run) {
+	if (run->buf_pos < run->buf_length) {
+		return true;
+	}
+	if (run->read == run->records) {
+		return false;
+	}
+	size_t want = run->records - run->read;
+	want = want < run->buf_length ? want : run->buf_length;
+	uint8_t *iter = (uint8_t *) run->buf;
+	size_t len = want * sizeof(*run->buf);
+	off_t offset = (off_t) (run->read * sizeof(*run->buf));
+	while (len) {
+		ssize_t ret = pread(run->fd, iter, len, offset);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		assert(ret > 0);
+		iter += ret;
+		offset += ret;
+		len -= (size_t) ret;
+	}
+	run->read += want;
+	run->buf_pos = 0;
+	run->buf_length = want;
+	return true;
+}
+
+static const struct sort_record *sort_run_head(struct sort_run *run) {
+	return &run->buf[run->buf_pos];
+}
+
+static void sort_heap_down(struct sort_run **heap, size_t length, size_t i) {
+	while (true) {
+		size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+		if (left < length && sort_compare(sort_run_head(heap[left]), sort_run_head(heap[smallest])) < 0) {
+			smallest = left;
+		}
+		if (right < length && sort_compare(sort_run_head(heap[right]), sort_run_head(heap[smallest])) < 0) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			return;
+		}
+		struct sort_run *tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+static void sort_merge() {
+	// Hand the run buffer's memory budget to the per-run read buffers
+	free(sort_records);
+	sort_records = NULL;
+
+	size_t per_run = (size_t) sort_memory_mb * 1024 * 1024 / sizeof(struct sort_record) / sort_runs_length;
+	per_run = per_run > SORT_MERGE_BUF_MIN ? per_run : SORT_MERGE_BUF_MIN;
+
+	struct sort_run **heap = malloc(sort_runs_length * sizeof(*heap));
+	assert(heap);
+	size_t heap_length = 0;
+	for (size_t i = 0; i < sort_runs_length; i++) {
+		struct sort_run *run = &sort_runs[i];
+		run->buf = malloc(per_run * sizeof(*run->buf));
+		assert(run->buf);
+		run->buf_length = per_run;
+		run->buf_pos = per_run;
+		run->read = 0;
+		if (sort_run_fill(run)) {
+			heap[heap_length++] = run;
+		}
+	}
+	for (size_t i = heap_length / 2; i-- > 0;) {
+		sort_heap_down(heap, heap_length, i);
+	}
+
+	while (heap_length) {
+		struct sort_run *run = heap[0];
+		sort_emit(sort_run_head(run));
+		run->buf_pos++;
+		if (!sort_run_fill(run)) {
+			heap[0] = heap[--heap_length];
+		}
+		sort_heap_down(heap, heap_length, 0);
+	}
+	free(heap);
+}
+
+void sort_opts_add() {
+	opts_add("sort", NULL, sort_set, sort_opts);
+	opts_add("sort-memory-mb", "MB", sort_set_memory_mb, sort_opts);
+	opts_add("sort-temp-dir", "PATH", sort_set_temp_dir, sort_opts);
+}
+
+void sort_init() {
+	opts_call(sort_opts);
+	if (!sort_enabled) {
+		return;
+	}
+	sort_records_size = (size_t) sort_memory_mb * 1024 * 1024 / sizeof(*sort_records);
+	sort_records = malloc(sort_records_size * sizeof(*sort_records));
+	assert(sort_records);
+}
+
+void sort_cleanup() {
+	if (!sort_enabled) {
+		return;
+	}
+	if (!sort_runs_length) {
+		LOG(server_id, "Sorting %zu packets in memory", sort_records_length);
+		qsort(sort_records, sort_records_length, sizeof(*sort_records), sort_compare);
+		for (size_t i = 0; i < sort_records_length; i++) {
+			sort_emit(&sort_records[i]);
+		}
+	} else {
+		if (sort_records_length) {
+			sort_spill();
+		}
+		LOG(server_id, "Merging %zu sort runs", sort_runs_length);
+		sort_merge();
+	}
+
+	for (size_t i = 0; i < sort_runs_length; i++) {
+		assert(!close(sort_runs[i].fd));
+		free(sort_runs[i].buf);
+	}
+	free(sort_runs);
+	free(sort_records);
+	free(sort_temp_dir);
+}
+
+void sort_write(struct packet *packet) {
+	if (!sort_enabled) {
+		send_write(packet);
+		return;
+	}
+	if (sort_records_length == sort_records_size) {
+		sort_spill();
+	}
+	struct sort_record *record = &sort_records[sort_records_length++];
+	record->mlat_timestamp = packet->mlat_timestamp;
+	record->sequence = sort_sequence++;
+	memcpy(record->source_id, packet->source_id, UUID_LEN);
+	record->rssi = packet->rssi;
+	record->hops = packet->hops;
+	record->type = (uint8_t) packet->type;
+	record->crc_invalid = packet->crc_invalid;
+	memcpy(record->payload, packet->payload, sizeof(record->payload));
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+
+struct packet;
+
+extern bool sort_enabled;
+
+void sort_opts_add(void);
+void sort_init(void);
+void sort_cleanup(void);
+void sort_write(struct packet *);
@@ -0,0 +1,188 @@
+#include <assert.h>
+#include <jansson.h>
+#include <math.h>
+#include <string.h>
+
+#include "buf.h"
+#include "json.h"
+#include "log.h"
+#include "monotime.h"
+#include "opts.h"
+#include "packet.h"
+#include "sourcetable.h"
+#include "uuid.h"
+
+#include "sourcestats.h"
+
+// Per-source message and clock rate estimation, reported as the
+// sourcestats send format. Each packet's MLAT timestamp is regressed
+// against our monotonic arrival time with exponentially weighted running
+// moments, so the slope (the source's true clock rate) costs a few
+// multiplies per packet. Arrival jitter around the fitted line is tracked
+// too, and packets far off it are counted as outliers instead of bending
+// the fit; outliers that persist mean the source clock was reset.
+
+struct sourcestats_source {
+	uint8_t id[UUID_LEN];
+	uint64_t report_ns;
+	uint64_t type_count[NUM_TYPES];
+	uint64_t outliers;
+	uint64_t outlier_start_ns;
+	// Regression state; x is arrival seconds, y is MLAT ticks, both
+	// relative to the first sample
+	uint64_t first_ns;
+	uint64_t last_ns;
+	uint64_t mlat_first;
+	uint64_t samples;
+	double mean_x, mean_y, var_x, cov_xy;
+	double var_residual;
+};
+
+static opts_group sourcestats_opts;
+
+static char log_module = 'R'; // borrowing
+
+// Weight given to old samples decays with this time constant, so drift
+// shows up within minutes while arrival jitter averages out.
+#define SOURCESTATS_TAU_S 600.0
+#define SOURCESTATS_JITTER_SAMPLES 1024
+// Samples before the fit is trusted enough to call anything an outlier
+#define SOURCESTATS_WARMUP_SAMPLES 256
+#define SOURCESTATS_OUTLIER_SIGMA 8.0
+#define SOURCESTATS_OUTLIER_MIN_S 0.002
+#define SOURCESTATS_OUTLIER_RESET_NS (2 * NS_PER_S)
+
+static bool sourcestats_enabled = false;
+static uint32_t sourcestats_interval_s = 60;
+static struct sourcetable sourcestats_table = SOURCETABLE_INIT(struct sourcestats_source);
+
+static bool sourcestats_set_interval(const char *arg) {
+	return opts_parse_uint32(arg, &sourcestats_interval_s) && sourcestats_interval_s;
+}
+
+static struct sourcestats_source *sourcestats_get_source(const uint8_t *id, uint64_t now) {
+	struct sourcestats_source *source = sourcetable_get(&sourcestats_table, id);
+	if (!source->report_ns) {
+		// New; monotonic time is never zero
+		source->report_ns = now;
+	}
+	return source;
+}
+
+static double sourcestats_slope(const struct sourcestats_source *source) {
+	// MLAT ticks per second
+	return source->var_x > 0 ? source->cov_xy / source->var_x : 0;
+}
+
+static void sourcestats_reset(struct sourcestats_source *source) {
+	source->samples = 0;
+	source->outlier_start_ns = 0;
+	source->mean_x = source->mean_y = source->var_x = source->cov_xy = source->var_residual = 0;
+}
+
+static void sourcestats_sample(struct sourcestats_source *source, uint64_t mlat_timestamp, uint64_t now) {
+	if (!source->samples) {
+		source->first_ns = source->last_ns = now;
+		source->mlat_first = mlat_timestamp;
+	}
+	double x = (double) (now - source->first_ns) / NS_PER_S;
+	double y = (double) (int64_t) (mlat_timestamp - source->mlat_first);
+
+	double slope = sourcestats_slope(source);
+	if (source->samples >= SOURCESTATS_WARMUP_SAMPLES && slope > 0) {
+		// Residual in seconds of arrival time
+		double residual = (y - source->mean_y) / slope - (x - source->mean_x);
+		double limit = SOURCESTATS_OUTLIER_SIGMA * sqrt(source->var_residual);
+		if (fabs(residual) > (limit > SOURCESTATS_OUTLIER_MIN_S ? limit : SOURCESTATS_OUTLIER_MIN_S)) {
+			source->outliers++;
+			if (!source->outlier_start_ns) {
+				source->outlier_start_ns = now;
+			} else if (now - source->outlier_start_ns > SOURCESTATS_OUTLIER_RESET_NS) {
+				LOG(source->id, "Source clock no longer matches its estimate; resetting");
+				sourcestats_reset(source);
+			}
+			return;
+		}
+		source->outlier_start_ns = 0;
+		double alpha = 1.0 / (double) (source->samples < SOURCESTATS_JITTER_SAMPLES ? source->samples : SOURCESTATS_JITTER_SAMPLES);
+		source->var_residual += alpha * (residual * residual - source->var_residual);
+	}
+
+	source->samples++;
+	double alpha = 1.0 / (double) source->samples;
+	double decay = (double) (now - source->last_ns) / NS_PER_S / SOURCESTATS_TAU_S;
+	if (decay > alpha) {
+		alpha = decay < 1 ? decay : 1;
+	}
+	source->last_ns = now;
+	double dx = x - source->mean_x, dy = y - source->mean_y;
+	source->mean_x += alpha * dx;
+	source->mean_y += alpha * dy;
+	source->var_x = (1 - alpha) * (source->var_x + alpha * dx * dx);
+	source->cov_xy = (1 - alpha) * (source->cov_xy + alpha * dx * dy);
+}
+
+void sourcestats_opts_add() {
+	opts_add("sourcestats-interval-s", "SECONDS", sourcestats_set_interval, sourcestats_opts);
+}
+
+void sourcestats_init() {
+	opts_call(sourcestats_opts);
+}
+
+void sourcestats_cleanup() {
+	sourcetable_cleanup(&sourcestats_table);
+}
+
+void sourcestats_enable() {
+	sourcestats_enabled = true;
+}
+
+void sourcestats_update(const struct packet *packet) {
+	if (!sourcestats_enabled || !packet->source_id) {
+		return;
+	}
+	uint64_t now = monotime_ns();
+	struct sourcestats_source *source = sourcestats_get_source(packet->source_id, now);
+	source->type_count[packet->type]++;
+	if (packet->mlat_timestamp) {
+		sourcestats_sample(source, packet->mlat_timestamp, now);
+	}
+}
+
+void sourcestats_serialize(struct packet *packet, struct buf *buf) {
+	if (!packet || !packet->source_id) {
+		return;
+	}
+	uint64_t now = monotime_ns();
+	struct sourcestats_source *source = sourcestats_get_source(packet->source_id, now);
+	if (now - source->report_ns < (uint64_t) sourcestats_interval_s * NS_PER_S) {
+		return;
+	}
+
+	json_t *counts = json_object();
+	for (int i = 0; i < NUM_TYPES; i++) {
+		if (i == PACKET_TYPE_NONE) {
+			continue;
+		}
+		json_object_set_new(counts, packet_type_names[i], json_integer((json_int_t) source->type_count[i]));
+	}
+	json_t *out = json_pack("{sssIso}",
+			"source_id", (const char *) source->id,
+			"interval_seconds", (json_int_t) ((now - source->report_ns) / NS_PER_S),
+			"packet_counts", counts);
+	double slope = sourcestats_slope(source);
+	if (source->samples >= SOURCESTATS_WARMUP_SAMPLES && slope > 0) {
+		// Integers keep the line short and exact; ppb of the nominal rate
+		json_object_set_new(out, "clock_ppb", json_integer((json_int_t) llround((slope / (PACKET_MLAT_MHZ * 1e6) - 1) * 1e9)));
+		json_object_set_new(out, "jitter_us", json_integer((json_int_t) llround(sqrt(source->var_residual) * 1e6)));
+	}
+	json_object_set_new(out, "outliers", json_integer((json_int_t) source->outliers));
+	assert(json_dump_callback(out, json_buf_append_callback, buf, 0) == 0);
+	json_decref(out);
+	buf_chr(buf, buf->length++) = '\n';
+
+	source->report_ns = now;
+	memset(source->type_count, 0, sizeof(source->type_count));
+	source->outliers = 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+struct buf;
+struct packet;
+
+void sourcestats_opts_add(void);
+void sourcestats_init(void);
+void sourcestats_cleanup(void);
+void sourcestats_enable(void);
+void sourcestats_update(const struct packet *);
+void sourcestats_serialize(struct packet *, struct buf *);
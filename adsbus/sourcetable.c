@@ -0,0 +1,93 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uuid.h"
+
+#include "sourcetable.h"
+
+// Open addressing with linear probing, kept at most half full.
+
+static const uint8_t *sourcetable_id(const void *entry) {
+	return (const uint8_t *) entry;
+}
+
+static size_t sourcetable_slot(const uint8_t *id, size_t size) {
+	// FNV-1a
+	uint32_t hash = UINT32_C(2166136261);
+	for (size_t i = 0; i < UUID_LEN && id[i]; i++) {
+		hash = (hash ^ id[i]) * UINT32_C(16777619);
+	}
+	return hash & (size - 1);
+}
+
+static void **sourcetable_probe(const struct sourcetable *table, const uint8_t *id) {
+	for (size_t i = sourcetable_slot(id, table->size);; i = (i + 1) & (table->size - 1)) {
+		if (!table->slots[i] || !strncmp((const char *) sourcetable_id(table->slots[i]), (const char *) id, UUID_LEN)) {
+			return &table->slots[i];
+		}
+	}
+}
+
+static void sourcetable_resize(struct sourcetable *table) {
+	void **old = table->slots;
+	size_t old_size = table->size;
+	table->size = old_size ? old_size * 2 : 16;
+	table->slots = calloc(table->size, sizeof(*table->slots));
+	assert(table->slots);
+	for (size_t i = 0; i < old_size; i++) {
+		if (old[i]) {
+			*sourcetable_probe(table, sourcetable_id(old[i])) = old[i];
+		}
+	}
+	free(old);
+}
+
+void *sourcetable_get(struct sourcetable *table, const uint8_t *id) {
+	// Packets mostly come in runs from one source
+	if (table->last && !strncmp((const char *) sourcetable_id(table->last), (const char *) id, UUID_LEN)) {
+		return table->last;
+	}
+	if (!table->size) {
+		sourcetable_resize(table);
+	}
+	void **slot = sourcetable_probe(table, id);
+	if (!*slot) {
+		if ((table->count + 1) * 2 > table->size) {
+			sourcetable_resize(table);
+			slot = sourcetable_probe(table, id);
+		}
+		*slot = calloc(1, table->entry_size);
+		assert(*slot);
+		strncpy((char *) *slot, (const char *) id, UUID_LEN - 1);
+		table->count++;
+	}
+	table->last = *slot;
+	return *slot;
+}
+
+void *sourcetable_find(const struct sourcetable *table, const uint8_t *id) {
+	// Like sourcetable_get(), but never creates
+	return table->size ? *sourcetable_probe(table, id) : NULL;
+}
+
+void *sourcetable_next(const struct sourcetable *table, size_t *iter) {
+	// Start with *iter = 0; returns NULL when done
+	while (*iter < table->size) {
+		void *entry = table->slots[(*iter)++];
+		if (entry) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+void sourcetable_cleanup(struct sourcetable *table) {
+	for (size_t i = 0; i < table->size; i++) {
+		free(table->slots[i]);
+	}
+	free(table->slots);
+	table->slots = NULL;
+	table->size = table->count = 0;
+	table->last = NULL;
+}
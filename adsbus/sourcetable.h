@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-source records keyed by source ID. Record types must start with
+// uint8_t id[UUID_LEN]; records are zeroed on creation and freed by
+// sourcetable_cleanup().
+struct sourcetable {
+	size_t entry_size;
+	void **slots;
+	size_t size;
+	size_t count;
+	void *last;
+};
+
+#define SOURCETABLE_INIT(type) { .entry_size = sizeof(type) }
+
+void *sourcetable_get(struct sourcetable *, const uint8_t *);
+void *sourcetable_find(const struct sourcetable *, const uint8_t *);
+void *sourcetable_next(const struct sourcetable *, size_t *);
+void sourcetable_cleanup(struct sourcetable *);
@@ -1,46 +1,269 @@
 #include <assert.h>
-#include <time.h>
 #include <jansson.h>
+#include <linux/sockios.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
 
-#include "buf.h"
-#include "json.h"
+#include "crc.h"
+#include "dedup.h"
+#include "latency.h"
+#include "opts.h"
 #include "packet.h"
+#include "peer.h"
+#include "profile.h"
+#include "send.h"
+#include "sourcetable.h"
+#include "uuid.h"
+#include "wakeup.h"
 
 #include "stats.h"
 
-static struct stats_state {
-	uint64_t total_count;
+// Counters are plain integers bumped in the hot path; they are only
+// formatted when the stats timer fires, and then written to every stats
+// output at once. Connections register their counters while open and fold
+// them into the totals on close.
+//
+// With a stats output, packets also carry the time they were read, and
+// each write records how long the packet spent inside us (including
+// reorder, sort and dedup hold times) in the output's histogram. Reported
+// percentiles cover one interval.
+
+struct stats_source {
+	uint8_t id[UUID_LEN];
 	uint64_t type_count[NUM_TYPES];
-	struct timespec start;
-} stats_state = {
-	.type_count = { 0 },
+	uint64_t drops;
 };
 
-void stats_init() {
-	assert(!clock_gettime(CLOCK_MONOTONIC_COARSE, &stats_state.start));
+static opts_group stats_opts;
+
+static bool stats_enabled = false;
+bool stats_latency = false, stats_kernel_timestamps = false;
+static uint32_t stats_interval_s = 10;
+static struct timespec stats_start;
+static struct peer stats_peer;
+struct list_head stats_head = LIST_HEAD_INIT(stats_head);
+static struct stats_counters stats_totals[NUM_STATS_KINDS];
+static const char *stats_kind_names[NUM_STATS_KINDS] = {
+	[STATS_KIND_RECEIVE] = "receive",
+	[STATS_KIND_SEND] = "send",
+};
+static struct sourcetable stats_sources = SOURCETABLE_INIT(struct stats_source);
+// Read until handed to outputs; time held in reorder, sort and replay
+static struct latency stats_queue_latency;
+
+static bool stats_set_interval(const char *arg) {
+	return opts_parse_uint32(arg, &stats_interval_s) && stats_interval_s;
+}
+
+static bool stats_set_kernel_timestamps(const char __attribute__ ((unused)) *arg) {
+	stats_kernel_timestamps = true;
+	return true;
 }
 
-void stats_serialize(struct packet *packet, struct buf *buf) {
-	if (packet) {
-		stats_state.total_count++;
-		stats_state.type_count[packet->type]++;
+static json_t *stats_counters_json(const struct stats_counters *counters) {
+	return json_pack("{sIsIsIsI}",
+			"packets", (json_int_t) counters->packets,
+			"bytes", (json_int_t) counters->bytes,
+			"parse_errors", (json_int_t) counters->parse_errors,
+			"drops", (json_int_t) counters->drops);
+}
+
+static json_t *stats_latency_json(struct latency *latency) {
+	json_t *out = json_pack("{sIsIsIsIsIsI}",
+			"count", (json_int_t) latency->count,
+			"p50", (json_int_t) latency_percentile(latency, 0.5),
+			"p90", (json_int_t) latency_percentile(latency, 0.9),
+			"p99", (json_int_t) latency_percentile(latency, 0.99),
+			"p999", (json_int_t) latency_percentile(latency, 0.999),
+			"max", (json_int_t) latency->max_ns);
+	latency_reset(latency);
+	return out;
+}
+
+static void stats_counters_add(struct stats_counters *sum, const struct stats_counters *counters) {
+	sum->packets += counters->packets;
+	sum->bytes += counters->bytes;
+	sum->parse_errors += counters->parse_errors;
+	sum->drops += counters->drops;
+}
+
+static json_t *stats_build() {
+	struct timespec now;
+	assert(!clock_gettime(CLOCK_MONOTONIC_COARSE, &now));
+
+	json_t *connections = json_array();
+	struct stats_entry *entry;
+	stats_for_each(entry) {
+		json_t *connection = stats_counters_json(&entry->counters);
+		json_object_set_new(connection, "id", json_string((const char *) entry->id));
+		json_object_set_new(connection, "kind", json_string(stats_kind_names[entry->kind]));
+		if (entry->format) {
+			json_object_set_new(connection, "format", json_string(entry->format));
+		}
+		int queue_bytes;
+		if (stats_get_queue_bytes(entry, &queue_bytes)) {
+			json_object_set_new(connection, "queue_bytes", json_integer(queue_bytes));
+		}
+		if (entry->latency && entry->latency->count) {
+			json_object_set_new(connection, "latency_ns", stats_latency_json(entry->latency));
+		}
+		json_array_append_new(connections, connection);
 	}
-	if (stats_state.total_count % 1000 != 0) {
-		return;
+
+	uint64_t type_count[NUM_TYPES] = { 0 };
+	json_t *sources = json_array();
+	struct stats_source *source;
+	size_t iter = 0;
+	while ((source = sourcetable_next(&stats_sources, &iter))) {
+		uint64_t packets = 0;
+		for (int j = 0; j < NUM_TYPES; j++) {
+			packets += source->type_count[j];
+			type_count[j] += source->type_count[j];
+		}
+		json_t *out = json_pack("{sssIsI}",
+				"source_id", (const char *) source->id,
+				"packets", (json_int_t) packets,
+				"drops", (json_int_t) source->drops);
+		const struct crc_counts *parity = crc_get_counts(source->id);
+		if (parity) {
+			json_object_set_new(out, "parity", json_pack("{sIsIsI}",
+					"valid", (json_int_t) parity->valid,
+					"corrected", (json_int_t) parity->corrected,
+					"invalid", (json_int_t) parity->invalid));
+		}
+		json_array_append_new(sources, out);
 	}
+
 	json_t *counts = json_object();
 	for (int i = 0; i < NUM_TYPES; i++) {
 		if (i == PACKET_TYPE_NONE) {
 			continue;
 		}
-		json_object_set_new(counts, packet_type_names[i], json_integer((json_int_t) stats_state.type_count[i]));
+		json_object_set_new(counts, packet_type_names[i], json_integer((json_int_t) type_count[i]));
 	}
-	struct timespec now;
-	assert(!clock_gettime(CLOCK_MONOTONIC_COARSE, &now));
-	json_t *out = json_pack("{sIso}",
-			"uptime_seconds", (json_int_t) (now.tv_sec - stats_state.start.tv_sec),
-			"packet_counts", counts);
-	assert(json_dump_callback(out, json_buf_append_callback, buf, 0) == 0);
+	json_t *kind_totals = json_object();
+	for (int i = 0; i < NUM_STATS_KINDS; i++) {
+		struct stats_counters totals;
+		stats_get_totals(i, &totals);
+		json_object_set_new(kind_totals, stats_kind_names[i], stats_counters_json(&totals));
+	}
+	json_t *out = json_pack("{sIsosososo}",
+			"uptime_seconds", (json_int_t) (now.tv_sec - stats_start.tv_sec),
+			"packet_counts", counts,
+			"totals", kind_totals,
+			"connections", connections,
+			"sources", sources);
+	if (stats_queue_latency.count) {
+		json_object_set_new(out, "queue_latency_ns", stats_latency_json(&stats_queue_latency));
+	}
+	const struct dedup_counts *dedup = dedup_get_counts();
+	if (dedup) {
+		json_object_set_new(out, "dedup", json_pack("{sIsIsI}",
+				"hits", (json_int_t) dedup->hits,
+				"misses", (json_int_t) dedup->misses,
+				"replaced", (json_int_t) dedup->replaced));
+	}
+	return out;
+}
+
+static void stats_emit(struct peer __attribute__ ((unused)) *peer) {
+	json_t *out = stats_build();
+	char *dump = json_dumps(out, 0);
+	assert(dump);
 	json_decref(out);
-	buf_chr(buf, buf->length++) = '\n';
+	size_t len = strlen(dump);
+	dump = realloc(dump, len + 2);
+	assert(dump);
+	dump[len++] = '\n';
+	send_write_format("stats", dump, len);
+	free(dump);
+	wakeup_add(&stats_peer, stats_interval_s * 1000);
+}
+
+void stats_opts_add() {
+	opts_add("stats-interval-s", "SECONDS", stats_set_interval, stats_opts);
+	opts_add("stats-kernel-timestamps", NULL, stats_set_kernel_timestamps, stats_opts);
+}
+
+void stats_init() {
+	assert(!clock_gettime(CLOCK_MONOTONIC_COARSE, &stats_start));
+	opts_call(stats_opts);
+	stats_peer.fd = -1;
+	stats_peer.event_handler = stats_emit;
+	profile_add_handler(stats_emit, "stats");
+}
+
+void stats_cleanup() {
+	wakeup_cancel(&stats_peer);
+	sourcetable_cleanup(&stats_sources);
+}
+
+void stats_enable() {
+	if (stats_enabled) {
+		return;
+	}
+	stats_enabled = true;
+	stats_latency = true;
+	wakeup_add(&stats_peer, stats_interval_s * 1000);
+}
+
+void stats_add(struct stats_entry *entry, enum stats_kind kind, const uint8_t *id, const char *format, const int *fd) {
+	entry->kind = kind;
+	entry->id = id;
+	entry->format = format;
+	entry->latency = NULL;
+	entry->fd = fd;
+	memset(&entry->counters, 0, sizeof(entry->counters));
+	list_add(&entry->stats_list, &stats_head);
+}
+
+void stats_del(struct stats_entry *entry) {
+	stats_counters_add(&stats_totals[entry->kind], &entry->counters);
+	free(entry->latency);
+	list_del(&entry->stats_list);
+}
+
+void stats_get_totals(enum stats_kind kind, struct stats_counters *totals) {
+	// Closed connections plus open ones
+	*totals = stats_totals[kind];
+	struct stats_entry *entry;
+	stats_for_each(entry) {
+		if (entry->kind == kind) {
+			stats_counters_add(totals, &entry->counters);
+		}
+	}
+}
+
+bool stats_get_queue_bytes(const struct stats_entry *entry, int *bytes) {
+	if (!entry->fd || *entry->fd == -1) {
+		return false;
+	}
+	// Bytes waiting in the kernel: unread for receive, unsent for send
+	return !ioctl(*entry->fd, entry->kind == STATS_KIND_RECEIVE ? FIONREAD : SIOCOUTQ, bytes);
+}
+
+void stats_source_packet(const struct packet *packet, bool dropped) {
+	if (!stats_enabled || !packet->source_id) {
+		return;
+	}
+	struct stats_source *source = sourcetable_get(&stats_sources, packet->source_id);
+	if (dropped) {
+		source->drops++;
+	} else {
+		source->type_count[packet->type]++;
+	}
+}
+
+void stats_record_latency(struct stats_entry *entry, uint64_t ns) {
+	if (!entry->latency) {
+		entry->latency = calloc(1, sizeof(*entry->latency));
+		assert(entry->latency);
+	}
+	latency_record(entry->latency, ns);
+}
+
+void stats_record_queue_latency(uint64_t ns) {
+	latency_record(&stats_queue_latency, ns);
 }
@@ -1,7 +1,54 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "list.h"
+
 struct packet;
-struct buf;
+struct latency;
+
+enum stats_kind {
+	STATS_KIND_RECEIVE,
+	STATS_KIND_SEND,
+	NUM_STATS_KINDS,
+};
+
+struct stats_counters {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t parse_errors;
+	uint64_t drops;
+};
 
+// Embedded in each connection; counters are bumped directly
+struct stats_entry {
+	enum stats_kind kind;
+	const uint8_t *id;
+	// Set by the owner once known; may be NULL
+	const char *format;
+	// NULL if queue depth doesn't apply (regular files)
+	const int *fd;
+	struct stats_counters counters;
+	// Send: read to write; receive: kernel to read. Allocated on first use
+	struct latency *latency;
+	struct list_head stats_list;
+};
+
+extern bool stats_latency, stats_kernel_timestamps;
+
+void stats_opts_add(void);
 void stats_init(void);
-void stats_serialize(struct packet *, struct buf *);
+void stats_cleanup(void);
+void stats_enable(void);
+void stats_add(struct stats_entry *, enum stats_kind, const uint8_t *, const char *, const int *);
+void stats_del(struct stats_entry *);
+void stats_get_totals(enum stats_kind, struct stats_counters *);
+bool stats_get_queue_bytes(const struct stats_entry *, int *);
+void stats_source_packet(const struct packet *, bool);
+void stats_record_latency(struct stats_entry *, uint64_t);
+void stats_record_queue_latency(uint64_t);
+extern struct list_head stats_head;
+
+#define stats_for_each(entry) \
+		list_for_each_entry(entry, &stats_head, stats_list)
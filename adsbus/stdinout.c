@@ -30,6 +30,11 @@ static bool stdinout_stdin(const char __attribute__((unused)) *arg) {
 }
 
 static bool stdinout_stdout(const char *arg) {
+	struct stat stat;
+	assert(!fstat(STDOUT_FILENO, &stat));
+	if (!send_check_output(arg, S_ISREG(stat.st_mode))) {
+		return false;
+	}
 	struct serializer *serializer = send_get_serializer(arg);
 	if (!serializer) {
 		return false;
@@ -0,0 +1,24 @@
+#pragma once
+
+// USDT probes (provider "adsbus") for bpftrace, perf and friends, e.g.:
+//   bpftrace -e 'usdt:./adsbus:adsbus:packet_written { @[str(arg0)] = sum(arg2); }'
+// Each probe is a single nop until something attaches. Compiled out when
+// sys/sdt.h (systemtap-sdt-dev) isn't installed.
+//
+//   packet_parsed(format, type, source_id, receive_id)
+//   packet_dropped(reason, receive_id)
+//   packet_written(send_id, format, bytes)
+//   peer_opened(kind, id)
+//   peer_closed(kind, id)
+//   loop_iteration(events, busy_ns)
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE(...) STAP_PROBEV(adsbus, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef TRACE
+#define TRACE(...) do { } while (0)
+#endif
@@ -1,72 +1,173 @@
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "monotime.h"
 #include "peer.h"
+#include "profile.h"
 #include "rand.h"
 
 #include "wakeup.h"
 
+// All wakeups share one timerfd, armed for the earliest deadline in a
+// binary min-heap. Each peer has at most one pending wakeup and remembers
+// its heap position, so cancel doesn't have to search.
 struct wakeup {
-	struct peer peer;
-	struct peer *inner_peer;
-	struct list_head wakeup_list;
+	uint64_t deadline_ns;
+	struct peer *peer;
 };
 
-static struct list_head wakeup_head = LIST_HEAD_INIT(wakeup_head);
+static struct wakeup *wakeup_heap = NULL;
+static size_t wakeup_heap_len = 0, wakeup_heap_size = 0;
+static struct peer wakeup_peer;
+static bool wakeup_in_handler = false;
 
-static void wakeup_del(struct wakeup *wakeup) {
-	peer_close(&wakeup->peer);
-	list_del(&wakeup->wakeup_list);
-	free(wakeup);
+static void wakeup_set(size_t i, struct wakeup *wakeup) {
+	wakeup_heap[i] = *wakeup;
+	wakeup->peer->wakeup_slot = i + 1;
 }
 
-static void wakeup_handler(struct peer *peer) {
-	struct wakeup *wakeup = container_of(peer, struct wakeup, peer);
+static void wakeup_swap(size_t a, size_t b) {
+	struct wakeup tmp = wakeup_heap[a];
+	wakeup_set(a, &wakeup_heap[b]);
+	wakeup_set(b, &tmp);
+}
 
-	uint64_t events;
-	assert(read(wakeup->peer.fd, &events, sizeof(events)) == sizeof(events));
-	assert(events == 1);
+static size_t wakeup_sift_up(size_t i) {
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (wakeup_heap[parent].deadline_ns <= wakeup_heap[i].deadline_ns) {
+			break;
+		}
+		wakeup_swap(i, parent);
+		i = parent;
+	}
+	return i;
+}
 
-	peer_call(wakeup->inner_peer);
-	wakeup_del(wakeup);
+static void wakeup_sift_down(size_t i) {
+	while (true) {
+		size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+		if (left < wakeup_heap_len && wakeup_heap[left].deadline_ns < wakeup_heap[smallest].deadline_ns) {
+			smallest = left;
+		}
+		if (right < wakeup_heap_len && wakeup_heap[right].deadline_ns < wakeup_heap[smallest].deadline_ns) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			break;
+		}
+		wakeup_swap(i, smallest);
+		i = smallest;
+	}
+}
+
+static void wakeup_remove(size_t i) {
+	assert(i < wakeup_heap_len);
+	wakeup_heap[i].peer->wakeup_slot = 0;
+	if (i < --wakeup_heap_len) {
+		wakeup_set(i, &wakeup_heap[wakeup_heap_len]);
+		wakeup_sift_down(wakeup_sift_up(i));
+	}
+}
+
+static void wakeup_arm() {
+	if (wakeup_in_handler) {
+		// wakeup_handler() re-arms once on the way out
+		return;
+	}
+	struct itimerspec ts;
+	memset(&ts, 0, sizeof(ts));
+	if (wakeup_heap_len) {
+		// A zero it_value would disarm; monotonic time is never zero.
+		uint64_t deadline_ns = wakeup_heap[0].deadline_ns;
+		ts.it_value.tv_sec = (time_t) (deadline_ns / NS_PER_S);
+		ts.it_value.tv_nsec = (long) (deadline_ns % NS_PER_S);
+	}
+	assert(!timerfd_settime(wakeup_peer.fd, TFD_TIMER_ABSTIME, &ts, NULL));
+}
+
+static void wakeup_handler(struct peer *peer) {
+	// May be EAGAIN if we were re-armed after expiry; the heap is authoritative.
+	uint64_t events;
+	ssize_t len = read(peer->fd, &events, sizeof(events));
+	assert(len == sizeof(events) || (len == -1 && errno == EAGAIN));
+
+	wakeup_in_handler = true;
+	uint64_t now = monotime_ns();
+	while (wakeup_heap_len && wakeup_heap[0].deadline_ns <= now) {
+		// Remove first, so the callee can add or cancel wakeups freely
+		struct peer *inner_peer = wakeup_heap[0].peer;
+		wakeup_remove(0);
+		peer_call(inner_peer);
+	}
+	wakeup_in_handler = false;
+	wakeup_arm();
 }
 
 void wakeup_init() {
+	wakeup_peer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	assert(wakeup_peer.fd >= 0);
+	wakeup_peer.event_handler = wakeup_handler;
+	peer_epoll_add(&wakeup_peer, EPOLLIN);
+	profile_add_handler(wakeup_handler, "wakeup");
 }
 
 void wakeup_cleanup() {
-	struct wakeup *iter, *next;
-	list_for_each_entry_safe(iter, next, &wakeup_head, wakeup_list) {
-		wakeup_del(iter);
-	}
+	peer_close(&wakeup_peer);
+	free(wakeup_heap);
+	wakeup_heap = NULL;
+	wakeup_heap_len = wakeup_heap_size = 0;
 }
 
 void wakeup_add(struct peer *peer, uint32_t delay_ms) {
-	struct wakeup *wakeup = malloc(sizeof(*wakeup));
-	wakeup->inner_peer = peer;
-	list_add(&wakeup->wakeup_list, &wakeup_head);
-
-	wakeup->peer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	assert(wakeup->peer.fd >= 0);
-
-#define MS_PER_S UINT64_C(1000)
-#define NS_PER_MS UINT64_C(1000000)
-	const struct itimerspec ts = {
-		.it_interval = {
-			.tv_sec = 0,
-			.tv_nsec = 0,
-		},
-		.it_value = {
-			.tv_sec = delay_ms / MS_PER_S,
-			.tv_nsec = (delay_ms % MS_PER_S) * NS_PER_MS,
-		},
-	};
-	assert(!timerfd_settime(wakeup->peer.fd, 0, &ts, NULL));
-
-	wakeup->peer.event_handler = wakeup_handler;
-	peer_epoll_add(&wakeup->peer, EPOLLIN);
+	wakeup_add_ns(peer, delay_ms * NS_PER_MS);
+}
+
+void wakeup_add_ns(struct peer *peer, uint64_t delay_ns) {
+	if (wakeup_heap_len == wakeup_heap_size) {
+		wakeup_heap_size = wakeup_heap_size ? wakeup_heap_size * 2 : 64;
+		wakeup_heap = realloc(wakeup_heap, wakeup_heap_size * sizeof(*wakeup_heap));
+		assert(wakeup_heap);
+	}
+
+	uint64_t deadline_ns = monotime_ns() + delay_ns;
+	size_t i;
+	if (peer->wakeup_slot) {
+		// Already pending; keep whichever deadline is sooner
+		i = peer->wakeup_slot - 1;
+		if (wakeup_heap[i].deadline_ns <= deadline_ns) {
+			return;
+		}
+		wakeup_heap[i].deadline_ns = deadline_ns;
+	} else {
+		struct wakeup wakeup = {
+			.deadline_ns = deadline_ns,
+			.peer = peer,
+		};
+		i = wakeup_heap_len++;
+		wakeup_set(i, &wakeup);
+	}
+	if (!wakeup_sift_up(i)) {
+		wakeup_arm();
+	}
+}
+
+void wakeup_cancel(struct peer *peer) {
+	if (!peer->wakeup_slot) {
+		return;
+	}
+	size_t i = peer->wakeup_slot - 1;
+	assert(wakeup_heap[i].peer == peer);
+	wakeup_remove(i);
+	if (!i) {
+		wakeup_arm();
+	}
 }
 
 #define RETRY_MIN_MS 2000
@@ -7,4 +7,6 @@ struct peer;
 void wakeup_init(void);
 void wakeup_cleanup(void);
 void wakeup_add(struct peer *, uint32_t);
+void wakeup_add_ns(struct peer *, uint64_t);
+void wakeup_cancel(struct peer *);
 uint32_t wakeup_get_retry_delay_ms(uint32_t);